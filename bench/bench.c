@@ -0,0 +1,130 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static long long alloc_count = 0;
+static long long live_count = 0;
+
+/* Sanitizers bring allocators of their own, which must not be bypassed */
+#if defined(__GLIBC__) && !defined(PSH_BENCH_SANITIZED)
+/* Count allocations by interposing the allocator. glibc routes its own
+ * internal allocations through these symbols as well and exports the real
+ * implementations under the __libc_ names.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  void *ptr = __libc_malloc(size);
+  if (ptr != NULL) {
+    __atomic_add_fetch(&live_count, 1, __ATOMIC_RELAXED);
+  }
+  return ptr;
+}
+
+void *calloc(size_t n, size_t size) {
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  void *ptr = __libc_calloc(n, size);
+  if (ptr != NULL) {
+    __atomic_add_fetch(&live_count, 1, __ATOMIC_RELAXED);
+  }
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+  __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  void *new_ptr = __libc_realloc(ptr, size);
+  /* realloc(NULL, n) allocates, realloc(ptr, 0) frees */
+  if (ptr == NULL && new_ptr != NULL) {
+    __atomic_add_fetch(&live_count, 1, __ATOMIC_RELAXED);
+  } else if (ptr != NULL && size == 0) {
+    __atomic_sub_fetch(&live_count, 1, __ATOMIC_RELAXED);
+  }
+  return new_ptr;
+}
+
+void free(void *ptr) {
+  if (ptr != NULL) {
+    __atomic_sub_fetch(&live_count, 1, __ATOMIC_RELAXED);
+  }
+  __libc_free(ptr);
+}
+#endif
+
+long long bench_alloc_count() {
+  return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
+
+long long bench_live_allocs() {
+  return __atomic_load_n(&live_count, __ATOMIC_RELAXED);
+}
+
+long long bench_now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void print_bench_result(const struct BenchResult *result) {
+  double ns_per_op =
+      result->ops > 0 ? (double)result->elapsed_ns / result->ops : 0.0;
+  double ops_per_sec =
+      result->elapsed_ns > 0 ? result->ops * 1e9 / result->elapsed_ns : 0.0;
+
+  double allocs_per_op =
+      result->ops > 0 ? (double)result->allocs / result->ops : 0.0;
+
+  printf("{\"suite\": \"%s\", \"name\": \"%s\", \"ops\": %lld, "
+         "\"ns_per_op\": %.1f, \"ops_per_sec\": %.1f, "
+         "\"allocs_per_op\": %.2f",
+         result->suite, result->name, result->ops, ns_per_op, ops_per_sec,
+         allocs_per_op);
+  if (result->bytes > 0) {
+    double mb_per_sec = result->elapsed_ns > 0
+                            ? result->bytes * 1e3 / result->elapsed_ns
+                            : 0.0;
+    printf(", \"mb_per_sec\": %.1f", mb_per_sec);
+  }
+  printf("}\n");
+  fflush(stdout);
+}
+
+void bench_run(const char *suite, const char *name, long long ops,
+               long long bytes_per_op, void (*fn)(void *arg), void *arg) {
+  long long allocs = bench_alloc_count();
+  long long start = bench_now_ns();
+  for (long long i = 0; i < ops; i++) {
+    fn(arg);
+  }
+  struct BenchResult result = {.suite = suite,
+                               .name = name,
+                               .ops = ops,
+                               .elapsed_ns = bench_now_ns() - start,
+                               .bytes = bytes_per_op * ops,
+                               .allocs = bench_alloc_count() - allocs};
+  print_bench_result(&result);
+}
@@ -0,0 +1,79 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_BENCH_H_
+#define PSH_BENCH_H_
+
+/* Defined in builds with AddressSanitizer or ThreadSanitizer. */
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+#define PSH_BENCH_SANITIZED 1
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+#define PSH_BENCH_SANITIZED 1
+#endif
+
+/*
+ * Holds the outcome of a single benchmark.
+ */
+struct BenchResult {
+  const char *suite;    /* Group of related benchmarks, e.g. "spawn". */
+  const char *name;     /* Name of the benchmark within the suite. */
+  long long ops;        /* Number of operations performed. */
+  long long elapsed_ns; /* Wall time taken for all operations. */
+  long long bytes;      /* Bytes processed by all operations, or 0. */
+  long long allocs;     /* Heap allocations made by all operations. */
+};
+
+/*
+ * Returns the current value of the monotonic clock in nanoseconds.
+ */
+long long bench_now_ns();
+
+/*
+ * Returns the number of calls to malloc, calloc and realloc made by the
+ * process so far, including those made inside libc. The bench programs
+ * interpose the allocator to count them.
+ */
+long long bench_alloc_count();
+
+/*
+ * Returns the number of heap blocks allocated and not freed yet, or 0 in
+ * builds that can not count them.
+ */
+long long bench_live_allocs();
+
+/*
+ * Prints the result as a single line of JSON to stdout, so that the output of
+ * several runs can be collected and compared by scripts. Besides the raw
+ * values, it reports ns_per_op, ops_per_sec, allocs_per_op and, if bytes is
+ * set, mb_per_sec.
+ */
+void print_bench_result(const struct BenchResult *result);
+
+/*
+ * Calls fn(arg) ops times, then prints the result of the benchmark with the
+ * given suite and name. bytes_per_op is the amount of data one call
+ * processes, or 0.
+ */
+void bench_run(const char *suite, const char *name, long long ops,
+               long long bytes_per_op, void (*fn)(void *arg), void *arg);
+
+#endif /* PSH_BENCH_H_ */
@@ -0,0 +1,128 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks job control of psh on a pseudo terminal: starts the interactive
+ * shell, runs a built-in that psh forks into its own job, stops it with Ctrl-Z
+ * like a user would and resumes it with fg and bg.
+ *
+ * Usage: psh_job_check [psh]
+ *
+ * Exits with 1 and names the step that failed if the shell does not report
+ * the job as stopped or finished in time. The shell defaults to the psh built
+ * alongside.
+ */
+
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/* Time the shell gets to answer each step. */
+#define STEP_TIMEOUT_MS 2000
+
+static int terminal_fd;
+static pid_t shell_pid;
+
+/* Output of the shell since the last step. */
+static char output[65536];
+static size_t output_len;
+
+/*
+ * Types text into the terminal after pausing for pause_ms, so that the shell
+ * has started what the previous step typed.
+ */
+static void type(const char *text, int pause_ms) {
+  usleep(pause_ms * 1000);
+  output_len = 0;
+  if (write(terminal_fd, text, strlen(text)) != (ssize_t)strlen(text)) {
+    perror("psh_job_check: write");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/*
+ * Reads the output of the shell until it contains expected, or fails the
+ * check with the description of the step.
+ */
+static void expect(const char *expected, const char *step) {
+  long long deadline = bench_now_ns() + STEP_TIMEOUT_MS * 1000000LL;
+  while (1) {
+    output[output_len] = '\0';
+    if (strstr(output, expected) != NULL) {
+      return;
+    }
+    int timeout_ms = (int)((deadline - bench_now_ns()) / 1000000);
+    struct pollfd pollfd = {terminal_fd, POLLIN, 0};
+    ssize_t n = 0;
+    if (timeout_ms > 0 && poll(&pollfd, 1, timeout_ms) == 1) {
+      n = read(terminal_fd, output + output_len,
+               sizeof output - 1 - output_len);
+    }
+    if (n <= 0 || output_len + n == sizeof output - 1) {
+      fprintf(stderr, "psh_job_check: %s, got:\n%s\n", step, output);
+      kill(shell_pid, SIGKILL);
+      exit(EXIT_FAILURE);
+    }
+    output_len += n;
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *psh = argc > 1 ? argv[1] : PSH_BINARY;
+
+  shell_pid = forkpty(&terminal_fd, NULL, NULL, NULL);
+  if (shell_pid == -1) {
+    perror("psh_job_check: forkpty");
+    return EXIT_FAILURE;
+  }
+  if (shell_pid == 0) {
+    execl(psh, psh, (char *)NULL);
+    perror(psh);
+    _exit(127);
+  }
+
+  /* The quotes keep the echo of the typed line from matching */
+  type("echo sta\"\"rted\n", 0);
+  expect("started", "the shell did not start");
+
+  type("parallel -j 2 sleep ::: 1 1\n", 0);
+  type("\x1a", 300);
+  expect("Stopped", "Ctrl-Z did not stop the forked built-in");
+
+  type("fg\n", 0);
+  type("\x1a", 300);
+  expect("Stopped", "Ctrl-Z did not stop the built-in after fg");
+
+  type("bg\n", 0);
+  type("wait; echo fini\"\"shed $?\n", 0);
+  expect("finished 0", "the built-in did not finish after bg");
+  type("exit\n", 0);
+
+  int status;
+  waitpid(shell_pid, &status, 0);
+  printf("psh_job_check: ok\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,478 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks that all scanner implementations of parse_input() produce the same
+ * result as a byte at a time reference state machine, then measures the
+ * parsing throughput of each of them.
+ *
+ * Usage: psh_parser_bench [-c corpus] [-n iterations]
+ *
+ * The check runs over the lines of the corpus file and over randomly generated
+ * lines made of the characters the parser treats specially.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "parser.h"
+#include "utils.h"
+
+#ifndef PSH_BENCH_DIR
+#define PSH_BENCH_DIR "bench"
+#endif
+
+/* Separators used to serialize a parse into a single string, the last
+ * COMMAND_END of a background pipeline is followed by BACKGROUND_END. The
+ * redirections of a command follow its tokens, each as REDIRECT_START, the
+ * type as a digit, the file descriptor, '"' if the target was quoted or '='
+ * otherwise, and the target ended by TOKEN_END.
+ */
+#define TOKEN_END '\x1f'
+#define COMMAND_END '\x1e'
+#define REDIRECT_START '\x1d'
+#define BACKGROUND_END '&'
+
+/*
+ * Writes the header of a redirection of type for fd to out, up to its target.
+ * Returns the position after it.
+ */
+static char *serialize_redirect(char *out, RedirectType type, int fd,
+                                int quoted) {
+  *out++ = REDIRECT_START;
+  *out++ = '0' + type;
+  out += sprintf(out, "%d", fd);
+  *out++ = quoted ? '"' : '=';
+  return out;
+}
+
+/*
+ * Returns whether the len characters at token are a file descriptor number in
+ * front of a redirection operator, as in 2>file.
+ */
+static int reference_fd_number(const char *token, size_t len) {
+  if (len == 0 || len > 4) {
+    return 0;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if (token[i] < '0' || token[i] > '9') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Reads the redirection operator at input[*i] for fd, or for the default
+ * descriptor of the operator if fd is -1, and writes its header to *out.
+ * Advances *i to the last character of the operator and returns the position
+ * of the quoted flag in the header.
+ */
+static char *reference_redirect(const char *input, size_t *i, int fd,
+                                char **out) {
+  char c = input[*i];
+  RedirectType type = c == '<' ? REDIRECT_INPUT : REDIRECT_OUTPUT;
+  if (input[*i + 1] == '&') {
+    type = REDIRECT_DUP;
+    (*i)++;
+  } else if (c == '>' && input[*i + 1] == '>') {
+    type = REDIRECT_APPEND;
+    (*i)++;
+  } else if (c == '<' && input[*i + 1] == '<') {
+    type = REDIRECT_HEREDOC;
+    (*i)++;
+    if (input[*i + 1] == '<') {
+      type = REDIRECT_HERESTRING;
+      (*i)++;
+    }
+  }
+  *out = serialize_redirect(*out, type, fd != -1 ? fd : c == '<' ? 0 : 1, 0);
+  return *out - 1;
+}
+
+/*
+ * Byte at a time reference implementation of the parser's state machine,
+ * writing the serialized result into out. Returns 0 if the input can not be
+ * parsed and 1 otherwise.
+ */
+static int reference_parse(const char *input, char *out) {
+  ParserState state = WHITESPACE;
+  int n_tokens = 0;
+  size_t len = strlen(input);
+
+  /* Empty input parses into no commands at all */
+  if (len == 0) {
+    *out = '\0';
+    return 1;
+  }
+
+  /* The redirections of the current command are collected in redirects and
+   * appended to out at its end. Word characters go to *dst, i.e. to out for
+   * tokens and to redirects for targets. token is the start of the current
+   * token in out, target_flag the quoted flag of the current target or NULL.
+   */
+  char *redirects = handled_malloc(8 * len + 8);
+  char *redirects_end = redirects;
+  char **dst = &out;
+  char *token = out;
+  int token_quoted = 0;
+  char *target_flag = NULL;
+  int ok = 1;
+
+  for (size_t i = 0; i <= len && ok; i++) {
+    char c = input[i];
+    switch (state) {
+      case IN_WORD:
+        if (c == '<' || c == '>') {
+          /* A number right before the operator is the descriptor */
+          int fd = -1;
+          if (target_flag == NULL && !token_quoted &&
+              reference_fd_number(token, out - token)) {
+            *out = '\0';
+            fd = atoi(token);
+            out = token;
+            n_tokens--;
+          } else {
+            *(*dst)++ = TOKEN_END;
+          }
+          target_flag = reference_redirect(input, &i, fd, &redirects_end);
+          dst = &redirects_end;
+          state = REDIRECT;
+        } else if (c == ' ' || c == '|' || c == '&' || c == '\0') {
+          *(*dst)++ = TOKEN_END;
+          dst = &out;
+          target_flag = NULL;
+          if (c == ' ') {
+            state = WHITESPACE;
+            break;
+          }
+          if (n_tokens == 0) {
+            ok = 0;
+            break;
+          }
+          out = mempcpy(out, redirects, redirects_end - redirects);
+          redirects_end = redirects;
+          *out++ = COMMAND_END;
+          n_tokens = 0;
+          state = c == '&' ? BACKGROUND : PIPE;
+        } else if (c == '"') {
+          if (target_flag != NULL) {
+            *target_flag = '"';
+          } else {
+            token_quoted = 1;
+          }
+          state = IN_WORD_QUOTED;
+        } else {
+          *(*dst)++ = c;
+        }
+        break;
+      case IN_WORD_QUOTED:
+        if (c == '"') {
+          state = IN_WORD;
+        } else if (c == '\0') {
+          ok = 0;
+        } else {
+          *(*dst)++ = c;
+        }
+        break;
+      case REDIRECT:
+        if (c == ' ') {
+          break;
+        }
+        if (c == '|' || c == '&' || c == '<' || c == '>' || c == '\0') {
+          ok = 0;
+        } else if (c == '"') {
+          *target_flag = '"';
+          state = IN_WORD_QUOTED;
+        } else {
+          *redirects_end++ = c;
+          state = IN_WORD;
+        }
+        break;
+      case WHITESPACE:
+      case PIPE:
+        if (c == ' ') {
+          state = WHITESPACE;
+        } else if (c == '|' && state == PIPE) {
+          ok = 0;
+        } else if (c == '<' || c == '>') {
+          target_flag = reference_redirect(input, &i, -1, &redirects_end);
+          dst = &redirects_end;
+          state = REDIRECT;
+        } else if (c == '|' || c == '&' || c == '\0') {
+          if (n_tokens == 0) {
+            ok = 0;
+            break;
+          }
+          out = mempcpy(out, redirects, redirects_end - redirects);
+          redirects_end = redirects;
+          *out++ = COMMAND_END;
+          n_tokens = 0;
+          state = c == '&' ? BACKGROUND : PIPE;
+        } else {
+          n_tokens++;
+          token = out;
+          token_quoted = c == '"';
+          if (c == '"') {
+            state = IN_WORD_QUOTED;
+          } else {
+            *out++ = c;
+            state = IN_WORD;
+          }
+        }
+        break;
+      case BACKGROUND:
+        if (c != ' ' && c != '\0') {
+          ok = 0;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+  free(redirects);
+  if (!ok) {
+    return 0;
+  }
+  if (state == BACKGROUND) {
+    *out++ = BACKGROUND_END;
+  }
+  *out = '\0';
+  return 1;
+}
+
+/*
+ * Serializes the result of parse_input() in the format of reference_parse().
+ */
+static void serialize(const struct ParsedInput *parsed_input, char *out) {
+  for (int i = 0; i < parsed_input->len; i++) {
+    const struct Command *command = &parsed_input->commands[i];
+    for (int j = 0; j < command->len; j++) {
+      out = stpcpy(out, command->tokens[j]);
+      *out++ = TOKEN_END;
+    }
+    for (int j = 0; j < command->n_redirects; j++) {
+      const struct Redirect *redirect = &command->redirects[j];
+      out = serialize_redirect(out, redirect->type, redirect->fd,
+                               redirect->quoted);
+      out = stpcpy(out, redirect->target);
+      *out++ = TOKEN_END;
+    }
+    *out++ = COMMAND_END;
+  }
+  if (parsed_input->background) {
+    *out++ = BACKGROUND_END;
+  }
+  *out = '\0';
+}
+
+static const char *scanner_names[] = {"auto", "scalar", "sse2", "avx2"};
+
+/*
+ * Compares the parse of line by every supported scanner against the
+ * reference. Returns the number of mismatches.
+ */
+static int check_line(const char *line) {
+  char *trimmed = strdup(line);
+  char *input = trim(trimmed);
+
+  size_t max_len = 8 * strlen(input) + 8;
+  char *expected = handled_malloc(max_len);
+  char *actual = handled_malloc(max_len);
+  int expected_ok = reference_parse(input, expected);
+
+  int mismatches = 0;
+  for (int scanner = SCANNER_SCALAR; scanner <= SCANNER_AVX2; scanner++) {
+    if (set_parser_scanner(scanner) != 0) {
+      continue;
+    }
+    char *copy = strdup(input);
+    struct ParsedInput *parsed_input = parse_input(copy);
+    int actual_ok = parsed_input != NULL;
+    if (actual_ok) {
+      serialize(parsed_input, actual);
+    }
+    if (actual_ok != expected_ok ||
+        (actual_ok && strcmp(actual, expected) != 0)) {
+      fprintf(stderr, "mismatch (%s): [%s]\n", scanner_names[scanner], line);
+      mismatches++;
+    }
+    free_parsed_input(parsed_input);
+    free(copy);
+  }
+
+  free(expected);
+  free(actual);
+  free(trimmed);
+  return mismatches;
+}
+
+static int check_corpus(const char *corpus_path) {
+  FILE *corpus = fopen(corpus_path, "r");
+  if (corpus == NULL) {
+    perror(corpus_path);
+    exit(EXIT_FAILURE);
+  }
+
+  int mismatches = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t line_len;
+  while ((line_len = getline(&line, &line_cap, corpus)) != -1) {
+    if (line_len > 0 && line[line_len - 1] == '\n') {
+      line[line_len - 1] = '\0';
+    }
+    mismatches += check_line(line);
+  }
+  free(line);
+  fclose(corpus);
+
+  /* Random lines over the special characters, with word runs of all lengths
+   * around the SIMD block sizes.
+   */
+  const char alphabet[] = "  ||\"\"abcdefg&$<>";
+  char random_line[200];
+  srand(1);
+  for (int i = 0; i < 100000; i++) {
+    int len = rand() % (sizeof random_line - 1);
+    for (int j = 0; j < len; j++) {
+      random_line[j] =
+          rand() % 4 == 0 ? alphabet[rand() % (sizeof alphabet - 1)] : 'w';
+    }
+    random_line[len] = '\0';
+    mismatches += check_line(random_line);
+  }
+  return mismatches;
+}
+
+static void bench_line(const char *name, const char *line, int iterations) {
+  char *input = strdup(line);
+  for (int scanner = SCANNER_SCALAR; scanner <= SCANNER_AVX2; scanner++) {
+    if (set_parser_scanner(scanner) != 0) {
+      continue;
+    }
+    long long allocs = bench_alloc_count();
+    long long start = bench_now_ns();
+    for (int i = 0; i < iterations; i++) {
+      free_parsed_input(parse_input(input));
+    }
+    long long elapsed_ns = bench_now_ns() - start;
+    char full_name[64];
+    snprintf(full_name, sizeof full_name, "%s/%s", name,
+             scanner_names[scanner]);
+    struct BenchResult result = {.suite = "tokenizer",
+                                 .name = full_name,
+                                 .ops = iterations,
+                                 .elapsed_ns = elapsed_ns,
+                                 .bytes = (long long)iterations * strlen(line),
+                                 .allocs = bench_alloc_count() - allocs};
+    print_bench_result(&result);
+  }
+  free(input);
+}
+
+/*
+ * Generates a line of n_tokens tokens of token_len characters each, every
+ * quote_every-th of them quoted, with pipes after every pipe_every tokens.
+ */
+static char *generate_line(int n_tokens, int token_len, int quote_every,
+                           int pipe_every) {
+  char *line = handled_malloc((size_t)n_tokens * (token_len + 5) + 1);
+  char *out = line;
+  for (int i = 0; i < n_tokens; i++) {
+    if (i > 0) {
+      if (pipe_every > 0 && i % pipe_every == 0) {
+        *out++ = '|';
+      }
+      *out++ = ' ';
+    }
+    int quoted = quote_every > 0 && i % quote_every == 0;
+    if (quoted) {
+      *out++ = '"';
+    }
+    for (int j = 0; j < token_len; j++) {
+      *out++ = quoted && j == token_len / 2 ? ' ' : 'a' + (i + j) % 26;
+    }
+    if (quoted) {
+      *out++ = '"';
+    }
+  }
+  *out = '\0';
+  return line;
+}
+
+int main(int argc, char **argv) {
+  const char *corpus_path = PSH_BENCH_DIR "/parser_corpus.txt";
+  int iterations = 20000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:")) != -1) {
+    switch (opt) {
+      case 'c':
+        corpus_path = optarg;
+        break;
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-c corpus] [-n iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  /* parse_input() reports parse errors on stdout, keep them out of the
+   * results.
+   */
+  fflush(stdout);
+  int saved_stdout = dup(1);
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, 1);
+  int mismatches = check_corpus(corpus_path);
+  fflush(stdout);
+  dup2(saved_stdout, 1);
+  close(saved_stdout);
+  close(devnull);
+
+  if (mismatches > 0) {
+    fprintf(stderr, "%d mismatches against the reference parser\n",
+            mismatches);
+    return EXIT_FAILURE;
+  }
+
+  bench_line("short", "ls -la /tmp", iterations * 10);
+
+  char *long_line = generate_line(5000, 12, 0, 0);
+  bench_line("many_args", long_line, iterations / 20);
+  free(long_line);
+
+  char *long_tokens = generate_line(50, 400, 5, 0);
+  bench_line("long_tokens", long_tokens, iterations / 20);
+  free(long_tokens);
+
+  char *many_pipes = generate_line(400, 6, 0, 2);
+  bench_line("many_pipes", many_pipes, iterations / 5);
+  free(many_pipes);
+
+  set_parser_scanner(SCANNER_AUTO);
+  return 0;
+}
@@ -0,0 +1,624 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks for the hot paths of psh: parsing, command resolution,
+ * variable expansion and end-to-end pipeline execution.
+ *
+ * Usage: psh_bench [-s suite] [-n scale]
+ *
+ * Suites are parse, resolve, expand, cache, script, glob, complete, history,
+ * execute, pipe_size and heredoc; by default all of them run. The number of
+ * iterations of each benchmark is multiplied by scale. Each result is printed
+ * as one line of JSON, see print_bench_result().
+ */
+
+#include <fcntl.h>
+#include <glob.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "command_hash.h"
+#include "completion.h"
+#include "history.h"
+#include "parser.h"
+#include "picoshell.h"
+#include "pipeline_cache.h"
+#include "utils.h"
+#include "vars.h"
+#include "wildcard.h"
+
+/* Multiplier for the number of iterations of every benchmark. */
+static double scale = 1.0;
+
+static long long iterations(long long base) {
+  long long n = base * scale;
+  return n > 0 ? n : 1;
+}
+
+/*
+ * Builds a line of n_commands commands joined by pipes, each consisting of
+ * n_args + 1 tokens.
+ */
+static char *make_line(int n_commands, int n_args) {
+  size_t size = (size_t)n_commands * (n_args + 1) * 16 + 1;
+  char *line = handled_malloc(size);
+  char *out = line;
+  for (int i = 0; i < n_commands; i++) {
+    out += snprintf(out, line + size - out, "%scommand%d",
+                    i > 0 ? " | " : "", i);
+    for (int j = 0; j < n_args; j++) {
+      out += snprintf(out, line + size - out,
+                      j % 4 == 0 ? " \"arg %d\"" : " --arg%d", j);
+    }
+  }
+  return line;
+}
+
+static void parse_line(void *arg) {
+  free_parsed_input(parse_input(arg));
+}
+
+static void bench_parse() {
+  char *line = strdup("ls -la /tmp");
+  bench_run("parse", "short", iterations(500000), strlen(line), parse_line,
+            line);
+  free(line);
+
+  line = make_line(1, 5000);
+  bench_run("parse", "long", iterations(500), strlen(line), parse_line, line);
+  free(line);
+
+  line = make_line(200, 3);
+  bench_run("parse", "many_pipes", iterations(5000), strlen(line), parse_line,
+            line);
+  free(line);
+}
+
+static void resolve(void *arg) { free(resolve_path(arg)); }
+
+static void resolve_cold(void *arg) {
+  hash_reset();
+  free(resolve_path(arg));
+}
+
+static void bench_resolve() {
+  char *saved_path = strdup(get_variable("PATH"));
+
+  set_variable("PATH",
+               "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin");
+  bench_run("resolve", "hit", iterations(1000000), 0, resolve, "ls");
+  bench_run("resolve", "hit_cold", iterations(100000), 0, resolve_cold, "ls");
+  bench_run("resolve", "miss", iterations(100000), 0, resolve,
+            "psh-no-such-command");
+  bench_run("resolve", "absolute", iterations(100000), 0, resolve,
+            "/usr/bin/ls");
+
+  /* 20 directories that do not contain ls before the one that does */
+  char long_path[1024] = "";
+  for (int i = 0; i < 20; i++) {
+    sprintf(long_path + strlen(long_path), "/nonexistent/psh-bench/dir%d:", i);
+  }
+  strcat(long_path, "/usr/bin:/bin");
+  set_variable("PATH", long_path);
+  bench_run("resolve", "long_path_hit", iterations(1000000), 0, resolve, "ls");
+  bench_run("resolve", "long_path_hit_cold", iterations(100000), 0,
+            resolve_cold, "ls");
+  bench_run("resolve", "long_path_miss", iterations(100000), 0, resolve,
+            "psh-no-such-command");
+
+  set_variable("PATH", saved_path);
+  free(saved_path);
+  hash_reset();
+}
+
+/*
+ * Holds the template of a command whose variables are expanded over and over.
+ */
+struct ExpandArg {
+  struct Command command;
+  char **tokens;
+};
+
+static void expand(void *arg) {
+  struct ExpandArg *expand_arg = arg;
+  struct Arena *arena = new_arena(256);
+  char *tokens[16];
+  memcpy(tokens, expand_arg->tokens,
+         sizeof(char *) * (expand_arg->command.len + 1));
+  struct Command command = {.len = expand_arg->command.len, .tokens = tokens};
+  resolve_env_variables(&command, arena);
+  free_arena(arena);
+}
+
+static void bench_expand() {
+  set_variable("PSH_BENCH_SHORT", "value");
+  char long_value[4096];
+  memset(long_value, 'x', sizeof long_value - 1);
+  long_value[sizeof long_value - 1] = '\0';
+  set_variable("PSH_BENCH_LONG", long_value);
+
+  char *plain[] = {"echo", "a", "b", "c", "d", NULL};
+  struct ExpandArg arg = {.command = {.len = 5}, .tokens = plain};
+  bench_run("expand", "no_variables", iterations(1000000), 0, expand, &arg);
+
+  char *short_vars[] = {"echo", "$PSH_BENCH_SHORT", "$PSH_BENCH_SHORT",
+                        "$PSH_BENCH_SHORT", "$PSH_BENCH_SHORT", NULL};
+  arg.tokens = short_vars;
+  bench_run("expand", "short_values", iterations(1000000), 0, expand, &arg);
+
+  char *long_vars[] = {"echo", "$PSH_BENCH_LONG", "$PSH_BENCH_LONG", NULL};
+  arg.command.len = 3;
+  arg.tokens = long_vars;
+  bench_run("expand", "long_values", iterations(200000), 0, expand, &arg);
+
+  char *embedded[] = {"echo", "a$PSH_BENCH_SHORT/b", "${PSH_BENCH_SHORT}c",
+                      "$PSH_BENCH_SHORT:$PSH_BENCH_SHORT:$?", NULL};
+  arg.command.len = 4;
+  arg.tokens = embedded;
+  bench_run("expand", "embedded", iterations(1000000), 0, expand, &arg);
+}
+
+/*
+ * Runs the newline separated lines of line through execute_input() ops times
+ * with stdout pointing to /dev/null, so the output of the pipeline stays out
+ * of the results.
+ */
+static void bench_execute_line(const char *suite, const char *name,
+                               const char *line, long long ops,
+                               long long bytes_per_op) {
+  fflush(stdout);
+  int saved_stdout = dup(1);
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, 1);
+
+  long long allocs = bench_alloc_count();
+  long long start = bench_now_ns();
+  for (long long op = 0; op < ops; op++) {
+    char *input = strdup(line);
+    char *rest = input;
+    char *next;
+    while ((next = strsep(&rest, "\n")) != NULL) {
+      execute_input(next);
+    }
+    free(input);
+  }
+  struct BenchResult result = {.suite = suite,
+                               .name = name,
+                               .ops = ops,
+                               .elapsed_ns = bench_now_ns() - start,
+                               .bytes = bytes_per_op * ops,
+                               .allocs = bench_alloc_count() - allocs};
+
+  dup2(saved_stdout, 1);
+  close(saved_stdout);
+  close(devnull);
+  print_bench_result(&result);
+}
+
+static void bench_execute() {
+  /* Push 256 MiB through pipelines of cat */
+  const long long size = 256LL << 20;
+  int stages[] = {1, 2, 4, 8};
+  for (int i = 0; i < 4; i++) {
+    char line[512];
+    int len = snprintf(line, sizeof line, "head -c %lld /dev/zero", size);
+    for (int j = 1; j < stages[i]; j++) {
+      len += snprintf(line + len, sizeof line - len, " | cat");
+    }
+    char name[32];
+    snprintf(name, sizeof name, "pipeline_%d_stages", stages[i]);
+    bench_execute_line("execute", name, line, iterations(4), size);
+  }
+
+  /* true is a built-in, the path keeps launch_true comparable with the
+   * numbers from before
+   */
+  bench_execute_line("execute", "launch_true", "/bin/true", iterations(2000),
+                     0);
+  bench_execute_line("execute", "builtin_true", "true", iterations(2000), 0);
+}
+
+static void bench_pipe_size() {
+  /* Push 256 MiB through chains of cat with pipes of different capacities,
+   * set with PSH_PIPE_SIZE in front of the pipeline. 0 is the kernel default.
+   */
+  const long long size = 256LL << 20;
+  int stages[] = {2, 4, 8};
+  const char *pipe_sizes[] = {"0", "256K", "1M"};
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      char line[512];
+      int len = snprintf(line, sizeof line,
+                         "PSH_PIPE_SIZE=%s head -c %lld /dev/zero",
+                         pipe_sizes[j], size);
+      for (int k = 1; k < stages[i]; k++) {
+        len += snprintf(line + len, sizeof line - len, " | cat");
+      }
+      char name[32];
+      snprintf(name, sizeof name, "stages_%d_%s", stages[i],
+               j == 0 ? "default" : pipe_sizes[j]);
+      bench_execute_line("pipe_size", name, line, iterations(4), size);
+    }
+  }
+}
+
+static void bench_heredoc() {
+  /* Feed here-documents of lines of 64 characters to cat */
+  long long sizes[] = {1LL << 10, 64LL << 10, 1LL << 20};
+  const char *names[] = {"heredoc_1K", "heredoc_64K", "heredoc_1M"};
+  for (int i = 0; i < 3; i++) {
+    char *text = handled_malloc(sizes[i] + 32);
+    char *end = stpcpy(text, "cat <<EOF\n");
+    for (long long j = 0; j < sizes[i]; j += 64) {
+      memset(end, 'a', 63);
+      end[63] = '\n';
+      end += 64;
+    }
+    strcpy(end, "EOF");
+    bench_execute_line("heredoc", names[i], text,
+                       iterations(sizes[i] >= 1LL << 20 ? 20 : 200),
+                       sizes[i]);
+    free(text);
+  }
+
+  bench_execute_line("heredoc", "herestring", "cat <<<word", iterations(500),
+                     0);
+  bench_execute_line("heredoc", "echo_pipe", "echo word | cat",
+                     iterations(500), 0);
+}
+
+static void execute_cached(void *arg) {
+  char *input = strdup(arg);
+  execute_input(input);
+  free(input);
+}
+
+static void execute_uncached(void *arg) {
+  clear_pipeline_cache();
+  execute_cached(arg);
+}
+
+static void bench_cache() {
+  /* The built-in : keeps process creation out of the results */
+  char *args = make_line(1, 40);
+  size_t size = strlen(args) + 3;
+  char *line = handled_malloc(size);
+  snprintf(line, size, ": %s", args);
+  free(args);
+  bench_run("cache", "hit", iterations(1000000), strlen(line), execute_cached,
+            line);
+  bench_run("cache", "miss", iterations(1000000), strlen(line),
+            execute_uncached, line);
+  free(line);
+
+  set_variable("PSH_BENCH_SHORT", "value");
+  const char *variables = ": a $PSH_BENCH_SHORT b ${PSH_BENCH_SHORT}c d e f";
+  bench_run("cache", "hit_variables", iterations(1000000), strlen(variables),
+            execute_cached, (void *)variables);
+  bench_run("cache", "miss_variables", iterations(1000000), strlen(variables),
+            execute_uncached, (void *)variables);
+  clear_pipeline_cache();
+}
+
+/*
+ * Runs line, a script that repeats a command n_iterations times, once and
+ * reports the time per iteration.
+ */
+static void bench_script_line(const char *name, const char *line,
+                              long long n_iterations) {
+  char *input = strdup(line);
+  long long allocs = bench_alloc_count();
+  long long start = bench_now_ns();
+  execute_input(input);
+  struct BenchResult result = {.suite = "script",
+                               .name = name,
+                               .ops = n_iterations,
+                               .elapsed_ns = bench_now_ns() - start,
+                               .allocs = bench_alloc_count() - allocs};
+  free(input);
+  print_bench_result(&result);
+}
+
+static void bench_script() {
+  /* A for loop over n items runs its body from the compiled script */
+  long long n = iterations(100000);
+  size_t size = n * 24 + 64;
+  char *line = handled_malloc(size);
+  char *end = stpcpy(line, "for i in");
+  for (long long i = 0; i < n; i++) {
+    end += snprintf(end, line + size - end, " %lld", i);
+  }
+  strcpy(end, "; do : item $i; done");
+  bench_script_line("for_loop", line, n);
+
+  /* The same commands separated by ;, so each of them is parsed */
+  end = line;
+  for (long long i = 0; i < n; i++) {
+    end += snprintf(end, line + size - end, ": item %lld;", i);
+  }
+  bench_script_line("separate_commands", line, n);
+  free(line);
+}
+
+/*
+ * Holds a pattern that is expanded over and over in a directory of files.
+ */
+struct GlobArg {
+  char *pattern;
+};
+
+static void expand_glob(void *arg) {
+  struct GlobArg *glob_arg = arg;
+  struct Arena *arena = new_arena(4096);
+  char *tokens[] = {"echo", glob_arg->pattern, NULL};
+  struct Command command = {.len = 2, .tokens = tokens};
+  expand_globs(&command, arena);
+  free_arena(arena);
+}
+
+static void expand_libc_glob(void *arg) {
+  struct GlobArg *glob_arg = arg;
+  glob_t result;
+  glob(glob_arg->pattern, 0, NULL, &result);
+  globfree(&result);
+}
+
+static void bench_glob() {
+  char dir[] = "/tmp/psh-bench-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("psh_bench: mkdtemp");
+    return;
+  }
+  long long n_files = iterations(10000);
+  char path[64];
+  for (long long i = 0; i < n_files; i++) {
+    snprintf(path, sizeof path, "%s/file-%lld.%s", dir, i,
+             i % 10 == 0 ? "c" : "o");
+    close(open(path, O_WRONLY | O_CREAT, 0644));
+  }
+
+  char all[64], suffix[64], prefix[64];
+  snprintf(all, sizeof all, "%s/*", dir);
+  snprintf(suffix, sizeof suffix, "%s/*.c", dir);
+  snprintf(prefix, sizeof prefix, "%s/file-1?.[co]", dir);
+  struct GlobArg args[] = {{all}, {suffix}, {prefix}};
+  const char *names[] = {"all", "suffix", "prefix"};
+  char name[32];
+  for (int i = 0; i < 3; i++) {
+    bench_run("glob", names[i], iterations(100), 0, expand_glob, &args[i]);
+    snprintf(name, sizeof name, "%s_libc", names[i]);
+    bench_run("glob", name, iterations(100), 0, expand_libc_glob, &args[i]);
+  }
+
+  for (long long i = 0; i < n_files; i++) {
+    snprintf(path, sizeof path, "%s/file-%lld.%s", dir, i,
+             i % 10 == 0 ? "c" : "o");
+    unlink(path);
+  }
+  rmdir(dir);
+}
+
+/*
+ * Generates all command names that start with the prefix arg.
+ */
+static void complete(void *arg) {
+  char *name;
+  for (int state = 0; (name = complete_command(arg, state)) != NULL;
+       state++) {
+    free(name);
+  }
+}
+
+/*
+ * Adds an executable to the directory arg before completing, so that the
+ * directory has to be read again.
+ */
+static void complete_changed(void *arg) {
+  static int n = 0;
+  char path[64];
+  snprintf(path, sizeof path, "%s/new-%d", (char *)arg, n++);
+  close(open(path, O_WRONLY | O_CREAT, 0755));
+  complete("cmd-1");
+}
+
+/*
+ * Alternates between two spellings of PATH, so that the index is rebuilt from
+ * scratch before completing.
+ */
+static void complete_cold(void *arg) {
+  static int n = 0;
+  set_variable("PATH", ((char **)arg)[n++ % 2]);
+  complete("cmd-1");
+}
+
+static void bench_complete() {
+  char *saved_path = strdup(get_variable("PATH"));
+  char dir[] = "/tmp/psh-bench-XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("psh_bench: mkdtemp");
+    free(saved_path);
+    return;
+  }
+  long long n_files = iterations(2000);
+  char path[64];
+  for (long long i = 0; i < n_files; i++) {
+    snprintf(path, sizeof path, "%s/cmd-%lld", dir, i);
+    close(open(path, O_WRONLY | O_CREAT, 0755));
+  }
+
+  char paths[2][128];
+  snprintf(paths[0], sizeof paths[0], "%s:/usr/bin:/bin", dir);
+  snprintf(paths[1], sizeof paths[1], "%s:/usr/bin:/bin:", dir);
+  char *path_values[] = {paths[0], paths[1]};
+  set_variable("PATH", paths[0]);
+  bench_run("complete", "prefix", iterations(100000), 0, complete, "cmd-12");
+  bench_run("complete", "all", iterations(1000), 0, complete, "");
+  bench_run("complete", "changed_dir", iterations(100), 0, complete_changed,
+            dir);
+  bench_run("complete", "cold", iterations(100), 0, complete_cold,
+            path_values);
+
+  set_variable("PATH", saved_path);
+  free(saved_path);
+  char command[128];
+  snprintf(command, sizeof command, "rm -rf %s", dir);
+  if (system(command) != 0) {
+    fprintf(stderr, "psh_bench: failed to remove %s\n", dir);
+  }
+}
+
+static void count_entry(long long number, const char *entry, size_t len,
+                        void *arg) {
+  (*(long long *)arg)++;
+}
+
+static void search(void *arg) {
+  long long n = 0;
+  search_history(arg, count_entry, &n);
+}
+
+/*
+ * Searches the history file like grep would, for comparison with the index.
+ */
+static void scan(void *arg) {
+  const char *text = arg;
+  int fd = open(getenv("PSH_BENCH_HISTFILE"), O_RDONLY | O_CLOEXEC);
+  char *buffer = handled_malloc(1 << 16);
+  size_t len = strlen(text), kept = 0;
+  ssize_t n;
+  long long matches = 0;
+  while ((n = read(fd, buffer + kept, (1 << 16) - kept)) > 0) {
+    char *start = buffer, *end = buffer + kept + n, *match;
+    while ((match = memmem(start, end - start, text, len)) != NULL) {
+      matches++;
+      char *newline = memchr(match, '\n', end - match);
+      start = newline != NULL ? newline + 1 : end;
+    }
+    /* Keep the last partial entry for the next read */
+    char *last = memrchr(start, '\n', end - start);
+    start = last != NULL ? last + 1 : start;
+    kept = end - start;
+    memmove(buffer, start, kept);
+  }
+  free(buffer);
+  close(fd);
+}
+
+static void list_last(void *arg) {
+  long long n = 0;
+  list_history(count_history() - 9, count_entry, &n);
+}
+
+static void bench_history() {
+  char path[] = "/tmp/psh-bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("psh_bench: mkstemp");
+    return;
+  }
+  static const char *commands[] = {"ls -l", "git status", "make -j8",
+                                   "cd /tmp", "grep -rn main src"};
+  long long n_entries = iterations(1000000);
+  FILE *file = fdopen(fd, "w");
+  srand(1);
+  for (long long i = 0; i < n_entries; i++) {
+    fprintf(file, "%s %d\n", commands[i % 5], rand() % 1000000);
+  }
+  fclose(file);
+  setenv("PSH_BENCH_HISTFILE", path, 1);
+
+  open_history(path);
+  long long start = bench_now_ns();
+  count_history();
+  struct BenchResult result = {.suite = "history",
+                               .name = "index",
+                               .ops = n_entries,
+                               .elapsed_ns = bench_now_ns() - start};
+  print_bench_result(&result);
+
+  bench_run("history", "search_rare", iterations(1000), 0, search,
+            "status 424242");
+  bench_run("history", "scan_rare", iterations(10), 0, scan, "status 424242");
+  bench_run("history", "search_common", iterations(10), 0, search, "git");
+  bench_run("history", "list_last", iterations(10000), 0, list_last, NULL);
+  close_history();
+
+  char index_path[sizeof path + 4];
+  snprintf(index_path, sizeof index_path, "%s.idx", path);
+  unlink(index_path);
+  unlink(path);
+}
+
+int main(int argc, char **argv) {
+  const char *suite = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s:n:")) != -1) {
+    switch (opt) {
+      case 's':
+        suite = optarg;
+        break;
+      case 'n':
+        scale = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-s suite] [-n scale]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (suite == NULL || strcmp(suite, "parse") == 0) {
+    bench_parse();
+  }
+  if (suite == NULL || strcmp(suite, "resolve") == 0) {
+    bench_resolve();
+  }
+  if (suite == NULL || strcmp(suite, "expand") == 0) {
+    bench_expand();
+  }
+  if (suite == NULL || strcmp(suite, "cache") == 0) {
+    bench_cache();
+  }
+  if (suite == NULL || strcmp(suite, "script") == 0) {
+    bench_script();
+  }
+  if (suite == NULL || strcmp(suite, "glob") == 0) {
+    bench_glob();
+  }
+  if (suite == NULL || strcmp(suite, "complete") == 0) {
+    bench_complete();
+  }
+  if (suite == NULL || strcmp(suite, "history") == 0) {
+    bench_history();
+  }
+  if (suite == NULL || strcmp(suite, "execute") == 0) {
+    bench_execute();
+  }
+  if (suite == NULL || strcmp(suite, "pipe_size") == 0) {
+    bench_pipe_size();
+  }
+  if (suite == NULL || strcmp(suite, "heredoc") == 0) {
+    bench_heredoc();
+  }
+  return 0;
+}
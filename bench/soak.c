@@ -0,0 +1,224 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Soak test for the lifecycle of parsing and executing lines: pushes a mix of
+ * lines through execute_input() and checks that the resident set size and the
+ * number of live heap blocks stay flat once the caches have warmed up.
+ *
+ * Usage: psh_soak [-n lines]
+ *
+ * The mix covers built-ins, pipelines of built-ins, variable assignments and
+ * expansion, compound commands, globs, parse errors, cache evictions through
+ * unique lines and an external command every EXTERNAL_EVERY lines. After the
+ * first tenth of the lines, a checkpoint is printed as one line of JSON every
+ * tenth. Exits with 1 if the last checkpoint exceeds the first by more than
+ * MAX_RSS_GROWTH_KB or MAX_LIVE_GROWTH. Built with sanitizers, the live
+ * blocks can not be counted and RSS includes the quarantine, so both checks
+ * are skipped and only LeakSanitizer's report at exit applies.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "completion.h"
+#include "picoshell.h"
+#include "prompt.h"
+#include "vars.h"
+
+/* Number of lines between two external commands. */
+#define EXTERNAL_EVERY 1000
+
+/* Growth of the resident set size tolerated after the warm up. */
+#define MAX_RSS_GROWTH_KB 1024
+
+/* Growth of the number of live heap blocks tolerated after the warm up. */
+#define MAX_LIVE_GROWTH 64
+
+static long rss_kb() {
+  long pages = 0, resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "re");
+  if (statm != NULL) {
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+      resident = 0;
+    }
+    fclose(statm);
+  }
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Writes line number i of the mix to line.
+ */
+static void make_line(char *line, size_t size, long long i) {
+  switch (i % 16) {
+    case 0:
+      snprintf(line, size, "V%lld=value%lld", i % 100, i);
+      break;
+    case 1:
+      snprintf(line, size, "echo $V%lld ${HOME}/x $? $$ a$V1b", i % 100);
+      break;
+    case 2:
+      snprintf(line, size, "export E%lld=%lld", i % 50, i);
+      break;
+    case 3:
+      snprintf(line, size, "unset E%lld", (i + 25) % 50);
+      break;
+    case 4:
+      snprintf(line, size, "for x in a b $V1; do : $x; done");
+      break;
+    case 5:
+      snprintf(line, size,
+               "if test %lld = 0; then : a; elif true; then : b; fi", i % 2);
+      break;
+    case 6:
+      snprintf(line, size, "echo /etc/host* \"/etc/*\" | true");
+      break;
+    case 7:
+      /* unique lines push the others out of the pipeline cache */
+      snprintf(line, size, ": unique %lld", i);
+      break;
+    case 8:
+      snprintf(line, size, "cd %s", i % 32 == 8 ? "/tmp" : "-");
+      break;
+    case 9:
+      snprintf(line, size, "printf %%s-%%d\\n a %lld | echo", i);
+      break;
+    case 10:
+      snprintf(line, size, "echo \"unterminated");
+      break;
+    case 11:
+      snprintf(line, size, "X=%lld true; hash; cache", i);
+      break;
+    case 12:
+      snprintf(line, size, "time : timed");
+      break;
+    case 13:
+      snprintf(line, size, "n=0; while test $n = 0; do n=1; done");
+      break;
+    case 14:
+      snprintf(line, size, "set -o pipefail; false | true; set +o pipefail");
+      break;
+    default:
+      snprintf(line, size, "psh-no-such-command-%lld", i % 4);
+      break;
+  }
+  if (i % EXTERNAL_EVERY == EXTERNAL_EVERY - 1) {
+    snprintf(line, size, "/bin/true %lld", i);
+  }
+}
+
+/*
+ * Runs what psh does around each line apart from reading it: rendering the
+ * prompt and, now and then, completing a command name.
+ */
+static void run_line(const char *text, long long i) {
+  free(render_prompt());
+  if (i % 100 == 0) {
+    char *name;
+    for (int state = 0; (name = complete_command("e", state)) != NULL;
+         state++) {
+      free(name);
+    }
+  }
+  char *line = strdup(text);
+  execute_input(line);
+  free(line);
+}
+
+int main(int argc, char **argv) {
+  long long n_lines = 1000000;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        n_lines = atoll(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n lines]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (n_lines < 10) {
+    n_lines = 10;
+  }
+
+  /* Keep the output of the lines away from the report. The sanitizers report
+   * to stderr, so it is only kept for them.
+   */
+  FILE *report = fdopen(dup(1), "w");
+  int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  dup2(null_fd, 1);
+#ifndef PSH_BENCH_SANITIZED
+  dup2(null_fd, 2);
+#endif
+  close(null_fd);
+  /* The vcs segment would only measure git */
+  set_variable("PSH_PROMPT", "user cwd duration status");
+
+  long first_rss = 0;
+  long long first_live = 0;
+  long last_rss = 0;
+  long long last_live = 0;
+  long long start = bench_now_ns();
+  char line[256];
+  for (long long i = 0; i < n_lines; i++) {
+    make_line(line, sizeof line, i);
+    run_line(line, i);
+
+    if ((i + 1) % (n_lines / 10) == 0) {
+      last_rss = rss_kb();
+      last_live = bench_live_allocs();
+      if (first_rss == 0) {
+        first_rss = last_rss;
+        first_live = last_live;
+      }
+      fprintf(report,
+              "{\"lines\": %lld, \"ns_per_line\": %.1f, \"rss_kb\": %ld, "
+              "\"live_allocs\": %lld}\n",
+              i + 1, (double)(bench_now_ns() - start) / (i + 1), last_rss,
+              last_live);
+      fflush(report);
+    }
+  }
+
+#ifdef PSH_BENCH_SANITIZED
+  /* The quarantine grows RSS, leaks are reported by LeakSanitizer */
+  fprintf(report,
+          "psh_soak: RSS and live heap block checks skipped under "
+          "sanitizers\n");
+  return 0;
+#endif
+  int failed = 0;
+  if (last_rss - first_rss > MAX_RSS_GROWTH_KB) {
+    fprintf(report, "psh_soak: RSS grew by %ld KB\n", last_rss - first_rss);
+    failed = 1;
+  }
+  if (last_live - first_live > MAX_LIVE_GROWTH) {
+    fprintf(report, "psh_soak: %lld more live heap blocks\n",
+            last_live - first_live);
+    failed = 1;
+  }
+  return failed;
+}
@@ -0,0 +1,165 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Measures how many commands per second each spawn backend can launch.
+ *
+ * Usage: psh_spawn_bench [-n launches] [-r rss_mb]
+ *
+ * With -r, the benchmark first allocates and touches rss_mb megabytes of heap
+ * to emulate a shell that has been running for a long time. fork() has to
+ * copy the page tables of all of it, posix_spawn() does not. The spawn server
+ * is started before the heap grows, like psh starts it at startup, so its
+ * fork() stays cheap while every launch pays for a round trip over a socket.
+ *
+ * Before measuring, each backend is checked to launch commands in the working
+ * directory and with the stdout the benchmark has at that time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "spawn.h"
+#include "spawn_server.h"
+
+/*
+ * Checks that a command launched by backend runs in the current working
+ * directory and writes to the current stdout, both changed after the spawn
+ * server was started, like after cd and set -o spawn_server >file. Exits if
+ * it does not.
+ */
+static void check_backend(const char *name, SpawnBackend backend) {
+  extern char **environ;
+  char *argv[] = {"pwd", NULL};
+  struct SpawnFileActions actions;
+  init_spawn_file_actions(&actions);
+
+  char *cwd = getcwd(NULL, 0);
+  int pipefds[2];
+  if (cwd == NULL || chdir("/") == -1 || pipe(pipefds) == -1) {
+    perror("check_backend");
+    exit(EXIT_FAILURE);
+  }
+  fflush(stdout);
+  int saved_stdout = dup(1);
+  dup2(pipefds[1], 1);
+  close(pipefds[1]);
+  pid_t pid = spawn_process(backend, "/bin/pwd", argv, environ, &actions);
+  dup2(saved_stdout, 1);
+  close(saved_stdout);
+
+  char output[64] = "";
+  if (pid != -1) {
+    ssize_t n = read(pipefds[0], output, sizeof output - 1);
+    output[n > 0 ? n : 0] = '\0';
+    waitpid(pid, NULL, 0);
+  }
+  close(pipefds[0]);
+  if (chdir(cwd) == -1 || strcmp(output, "/\n") != 0) {
+    fprintf(stderr, "%s: command did not run in the shell's context\n",
+            name);
+    exit(EXIT_FAILURE);
+  }
+  free(cwd);
+  free_spawn_file_actions(&actions);
+}
+
+static void bench_backend(const char *name, SpawnBackend backend,
+                          int launches) {
+  extern char **environ;
+  char *argv[] = {"true", NULL};
+  struct SpawnFileActions actions;
+  init_spawn_file_actions(&actions);
+
+  long long allocs = bench_alloc_count();
+  long long start = bench_now_ns();
+  for (int i = 0; i < launches; i++) {
+    pid_t pid = spawn_process(backend, "/bin/true", argv, environ, &actions);
+    if (pid == -1) {
+      perror("spawn_process");
+      exit(EXIT_FAILURE);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+  }
+  struct BenchResult result = {.suite = "spawn",
+                               .name = name,
+                               .ops = launches,
+                               .elapsed_ns = bench_now_ns() - start,
+                               .allocs = bench_alloc_count() - allocs};
+  print_bench_result(&result);
+
+  free_spawn_file_actions(&actions);
+}
+
+int main(int argc, char **argv) {
+  int launches = 2000;
+  long rss_mb = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+    switch (opt) {
+      case 'n':
+        launches = atoi(optarg);
+        break;
+      case 'r':
+        rss_mb = atol(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-n launches] [-r rss_mb]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (start_spawn_server() == -1) {
+    perror("start_spawn_server");
+    return EXIT_FAILURE;
+  }
+
+  char *ballast = NULL;
+  if (rss_mb > 0) {
+    ballast = malloc(rss_mb << 20);
+    if (ballast == NULL) {
+      perror("malloc");
+      return EXIT_FAILURE;
+    }
+    /* A shell heap is made of small allocations that are not backed by
+     * transparent huge pages, which would make copying the page tables cheap.
+     */
+    madvise(ballast, rss_mb << 20, MADV_NOHUGEPAGE);
+    memset(ballast, 1, rss_mb << 20);
+  }
+
+  check_backend("fork", SPAWN_FORK);
+  check_backend("posix_spawn", SPAWN_POSIX_SPAWN);
+  check_backend("spawn_server", SPAWN_SERVER);
+
+  bench_backend("fork", SPAWN_FORK, launches);
+  bench_backend("posix_spawn", SPAWN_POSIX_SPAWN, launches);
+  bench_backend("spawn_server", SPAWN_SERVER, launches);
+
+  stop_spawn_server();
+  free(ballast);
+  return 0;
+}
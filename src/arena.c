@@ -0,0 +1,96 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+static size_t align_up(size_t size) {
+  return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+/* The first block lives in the same allocation, right after the arena. */
+static struct ArenaBlock *first_block(struct Arena *arena) {
+  return (struct ArenaBlock *)((char *)arena + align_up(sizeof(struct Arena)));
+}
+
+static char *block_data(struct ArenaBlock *block) {
+  return (char *)block + align_up(sizeof(struct ArenaBlock));
+}
+
+struct Arena *new_arena(size_t size) {
+  size = align_up(size);
+  struct Arena *arena =
+      handled_malloc(align_up(sizeof(struct Arena)) +
+                     align_up(sizeof(struct ArenaBlock)) + size);
+  arena->blocks = first_block(arena);
+  arena->blocks->next = NULL;
+  arena->blocks->size = size;
+  arena->blocks->used = 0;
+  return arena;
+}
+
+void free_arena(struct Arena *arena) {
+  if (arena != NULL) {
+    struct ArenaBlock *block = arena->blocks;
+    while (block != first_block(arena)) {
+      struct ArenaBlock *next = block->next;
+      free(block);
+      block = next;
+    }
+    free(arena);
+  }
+}
+
+void *arena_alloc(struct Arena *arena, size_t size) {
+  size = align_up(size);
+  struct ArenaBlock *block = arena->blocks;
+
+  if (block->size - block->used < size) {
+    /* add a new block, at least double the size of the current one */
+    size_t new_size = 2 * block->size;
+    if (new_size < size) {
+      new_size = size;
+    }
+    struct ArenaBlock *new_block =
+        handled_malloc(align_up(sizeof(struct ArenaBlock)) + new_size);
+    new_block->next = block;
+    new_block->size = new_size;
+    new_block->used = 0;
+    arena->blocks = new_block;
+    block = new_block;
+  }
+
+  void *ptr = block_data(block) + block->used;
+  block->used += size;
+  return ptr;
+}
+
+char *arena_strndup(struct Arena *arena, const char *str, size_t len) {
+  char *copy = arena_alloc(arena, len + 1);
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  return copy;
+}
@@ -0,0 +1,67 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_ARENA_H_
+#define PSH_ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * Holds one contiguous chunk of arena memory. The chunk's memory directly
+ * follows this header.
+ */
+struct ArenaBlock {
+  struct ArenaBlock *next; /* Previously filled block, or NULL. */
+  size_t size;             /* Number of bytes that follow the header. */
+  size_t used;             /* Number of bytes handed out so far. */
+};
+
+/*
+ * Holds a region allocator. Allocations are carved out of large blocks and are
+ * all released at once by free_arena(), which makes the memory belonging to a
+ * single line of input cost O(1) calls to malloc.
+ */
+struct Arena {
+  struct ArenaBlock *blocks; /* Block allocations are currently served from. */
+};
+
+/*
+ * Creates a new arena whose first block holds at least size bytes. The arena
+ * and its first block are allocated with a single call to malloc.
+ */
+struct Arena *new_arena(size_t size);
+
+/*
+ * Frees the arena and all memory allocated from it.
+ */
+void free_arena(struct Arena *arena);
+
+/*
+ * Allocates size bytes from the arena, aligned for any type. Adds a new block
+ * if the current one is full.
+ */
+void *arena_alloc(struct Arena *arena, size_t size);
+
+/*
+ * Copies the first len characters of str into the arena and NUL terminates
+ * the copy.
+ */
+char *arena_strndup(struct Arena *arena, const char *str, size_t len);
+
+#endif /* PSH_ARENA_H_ */
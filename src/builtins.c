@@ -0,0 +1,952 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "builtins.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "command_hash.h"
+#include "history.h"
+#include "jobs.h"
+#include "parallel.h"
+#include "picoshell.h"
+#include "pipeline_cache.h"
+#include "spawn_server.h"
+#include "utils.h"
+#include "vars.h"
+
+/*
+ * Holds output of a built-in until it is written to out->fd in one go, so that
+ * built-ins do not issue a write per argument. With fd -1 the output is
+ * collected in captured instead, which grows as needed.
+ */
+struct OutBuffer {
+  int fd;         /* File descriptor the output is written to, or -1. */
+  int failed;     /* Whether a write has failed, e.g. with EPIPE. */
+  size_t len;     /* Number of bytes currently buffered. */
+  char data[4096];
+  char *captured;       /* Output flushed so far if fd is -1. */
+  size_t captured_len;  /* Number of bytes in captured. */
+  size_t captured_size; /* Number of bytes allocated for captured. */
+};
+
+/*
+ * Writes the len bytes at s to out->fd, or appends them to out->captured.
+ */
+static void out_send(struct OutBuffer *out, const char *s, size_t len) {
+  if (out->fd == -1) {
+    if (out->captured_len + len > out->captured_size) {
+      out->captured_size = 2 * (out->captured_len + len);
+      out->captured = handled_realloc(out->captured, out->captured_size);
+    }
+    memcpy(out->captured + out->captured_len, s, len);
+    out->captured_len += len;
+    return;
+  }
+  size_t written = 0;
+  while (written < len && !out->failed) {
+    ssize_t n = write(out->fd, s + written, len - written);
+    if (n == -1 && errno != EINTR) {
+      out->failed = 1;
+    } else if (n > 0) {
+      written += n;
+    }
+  }
+}
+
+static void out_flush(struct OutBuffer *out) {
+  out_send(out, out->data, out->len);
+  out->len = 0;
+}
+
+static void out_write(struct OutBuffer *out, const char *s, size_t len) {
+  if (out->len + len > sizeof out->data) {
+    out_flush(out);
+  }
+  if (len > sizeof out->data) {
+    /* too large to buffer, write it directly */
+    out_send(out, s, len);
+    return;
+  }
+  memcpy(out->data + out->len, s, len);
+  out->len += len;
+}
+
+static void out_char(struct OutBuffer *out, char c) { out_write(out, &c, 1); }
+
+static void out_string(struct OutBuffer *out, const char *s) {
+  out_write(out, s, strlen(s));
+}
+
+static void out_format(struct OutBuffer *out, const char *format, ...) {
+  char small[512];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(small, sizeof small, format, args);
+  va_end(args);
+  if (len < 0) {
+    return;
+  }
+  if ((size_t)len < sizeof small) {
+    out_write(out, small, len);
+    return;
+  }
+
+  char *large = handled_malloc(len + 1);
+  va_start(args, format);
+  vsnprintf(large, len + 1, format, args);
+  va_end(args);
+  out_write(out, large, len);
+  free(large);
+}
+
+/*
+ * Flushes the buffer and returns status, or 1 if writing the output failed.
+ */
+static int out_finish(struct OutBuffer *out, int status) {
+  out_flush(out);
+  return out->failed && status == 0 ? 1 : status;
+}
+
+/*
+ * Writes the character denoted by the backslash escape sequence at s, which
+ * points to the backslash. Octal escapes are \0nnn if zero_prefixed is set
+ * (echo -e and %b) and \nnn otherwise (printf formats). Sets *stop for \c,
+ * which ends all output. Returns a pointer to the last character of the
+ * sequence.
+ */
+static const char *out_escape(struct OutBuffer *out, const char *s,
+                              int zero_prefixed, int *stop) {
+  const char *c = s + 1;
+  switch (*c) {
+    case 'a':
+      out_char(out, '\a');
+      return c;
+    case 'b':
+      out_char(out, '\b');
+      return c;
+    case 'c':
+      *stop = 1;
+      return c;
+    case 'e':
+      out_char(out, '\033');
+      return c;
+    case 'f':
+      out_char(out, '\f');
+      return c;
+    case 'n':
+      out_char(out, '\n');
+      return c;
+    case 'r':
+      out_char(out, '\r');
+      return c;
+    case 't':
+      out_char(out, '\t');
+      return c;
+    case 'v':
+      out_char(out, '\v');
+      return c;
+    case '\\':
+      out_char(out, '\\');
+      return c;
+    case 'x': {
+      /* hexadecimal escape with up to two digits */
+      int value = 0;
+      int digits = 0;
+      while (digits < 2 && isxdigit((unsigned char)c[1])) {
+        c++;
+        value = value * 16 + (isdigit((unsigned char)*c)
+                                  ? *c - '0'
+                                  : tolower((unsigned char)*c) - 'a' + 10);
+        digits++;
+      }
+      if (digits == 0) {
+        out_write(out, s, 2);
+      } else {
+        out_char(out, value);
+      }
+      return c;
+    }
+    default:
+      if (zero_prefixed ? *c == '0' : (*c >= '0' && *c <= '7')) {
+        /* octal escape with up to three digits */
+        const char *digit = zero_prefixed ? c + 1 : c;
+        int value = 0;
+        for (int digits = 0; digits < 3 && *digit >= '0' && *digit <= '7';
+             digits++) {
+          value = value * 8 + (*digit - '0');
+          digit++;
+        }
+        out_char(out, value);
+        return digit - 1;
+      }
+      /* unknown escape or trailing backslash, print it as it is */
+      out_char(out, '\\');
+      if (*c == '\0') {
+        return s;
+      }
+      out_char(out, *c);
+      return c;
+  }
+}
+
+static int builtin_true(int argc, char **argv, struct BuiltinIO *io) {
+  return 0;
+}
+
+static int builtin_false(int argc, char **argv, struct BuiltinIO *io) {
+  return 1;
+}
+
+static int builtin_cd(int argc, char **argv, struct BuiltinIO *io) {
+  if (argc > 2) {
+    dprintf(io->err, "cd: too many arguments\n");
+    return 1;
+  }
+
+  /* cd without an argument changes to HOME, cd - to OLDPWD */
+  const char *dir = argc == 2 ? argv[1] : get_variable("HOME");
+  int print_dir = 0;
+  if (argc == 2 && strcmp(argv[1], "-") == 0) {
+    dir = get_variable("OLDPWD");
+    print_dir = 1;
+  }
+  if (dir == NULL) {
+    dprintf(io->err, "cd: %s not set\n", print_dir ? "OLDPWD" : "HOME");
+    return 1;
+  }
+
+  /* change_dir may replace the variable value dir points to */
+  char *dir_copy = strdup(dir);
+  int status = change_dir(dir_copy);
+  if (status == 0 && print_dir) {
+    dprintf(io->out, "%s\n", dir_copy);
+  }
+  free(dir_copy);
+  return status;
+}
+
+static int builtin_exit(int argc, char **argv, struct BuiltinIO *io) {
+  /* exit with the status of the last pipeline unless one is given */
+  int status = last_exit_status();
+  if (argc > 1) {
+    char *end;
+    long value = strtol(argv[1], &end, 10);
+    if (*argv[1] == '\0' || *end != '\0') {
+      dprintf(io->err, "exit: %s: numeric argument required\n", argv[1]);
+      status = 2;
+    } else {
+      status = value & 0xff;
+    }
+  }
+  fflush(stdout);
+  exit(status);
+}
+
+static int builtin_pwd(int argc, char **argv, struct BuiltinIO *io) {
+  struct OutBuffer out = {.fd = io->out};
+  const char *pwd = get_variable("PWD");
+  if (pwd != NULL) {
+    out_string(&out, pwd);
+  } else {
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+      dprintf(io->err, "pwd: %s\n", strerror(errno));
+      return 1;
+    }
+    out_string(&out, cwd);
+    free(cwd);
+  }
+  out_char(&out, '\n');
+  return out_finish(&out, 0);
+}
+
+static int builtin_echo(int argc, char **argv, struct BuiltinIO *io) {
+  struct OutBuffer out = {.fd = io->out};
+  int newline = 1;
+  int escapes = 0;
+
+  /* Leading arguments made of n, e and E only are options */
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+    if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) {
+      break;
+    }
+    for (char *option = argv[i] + 1; *option != '\0'; option++) {
+      if (*option == 'n') {
+        newline = 0;
+      } else {
+        escapes = *option == 'e';
+      }
+    }
+  }
+
+  int stop = 0;
+  for (int first = i; i < argc && !stop; i++) {
+    if (i > first) {
+      out_char(&out, ' ');
+    }
+    if (!escapes) {
+      out_string(&out, argv[i]);
+      continue;
+    }
+    for (const char *c = argv[i]; *c != '\0' && !stop; c++) {
+      if (*c == '\\') {
+        c = out_escape(&out, c, 1, &stop);
+      } else {
+        out_char(&out, *c);
+      }
+    }
+  }
+  if (newline && !stop) {
+    out_char(&out, '\n');
+  }
+  return out_finish(&out, 0);
+}
+
+/*
+ * Parses the argument of a numeric printf conversion. Like other printf
+ * implementations, accepts 'c and "c for the character code of c. Sets *ok to
+ * 0 if arg is not a number.
+ */
+static long long printf_integer(const char *arg, int *ok) {
+  if (arg[0] == '\'' || arg[0] == '"') {
+    return (unsigned char)arg[1];
+  }
+  char *end;
+  errno = 0;
+  long long value = strtoll(arg, &end, 0);
+  if (*arg == '\0' || *end != '\0' || errno == ERANGE) {
+    *ok = 0;
+  }
+  return value;
+}
+
+/*
+ * Writes the len bytes at s like %s with the flags, width and precision in
+ * the spec_len characters of spec, e.g. %-8.3, but including NUL characters.
+ */
+static void out_padded(struct OutBuffer *out, const char *spec, int spec_len,
+                       const char *s, size_t len) {
+  int left = 0;
+  int i = 1;
+  for (; i < spec_len && strchr("-+ #0", spec[i]) != NULL; i++) {
+    left |= spec[i] == '-';
+  }
+  long width = 0;
+  for (; i < spec_len && isdigit((unsigned char)spec[i]); i++) {
+    width = width * 10 + spec[i] - '0';
+  }
+  if (i < spec_len && spec[i] == '.') {
+    long precision = 0;
+    for (i++; i < spec_len && isdigit((unsigned char)spec[i]); i++) {
+      precision = precision * 10 + spec[i] - '0';
+    }
+    len = (size_t)precision < len ? (size_t)precision : len;
+  }
+
+  if (left) {
+    out_write(out, s, len);
+  }
+  for (long pad = width - (long)len; pad > 0; pad--) {
+    out_char(out, ' ');
+  }
+  if (!left) {
+    out_write(out, s, len);
+  }
+}
+
+static int builtin_printf(int argc, char **argv, struct BuiltinIO *io) {
+  if (argc < 2) {
+    dprintf(io->err, "printf: usage: printf format [arguments]\n");
+    return 2;
+  }
+
+  struct OutBuffer out = {.fd = io->out};
+  const char *format = argv[1];
+  int arg = 2;
+  int status = 0;
+  int stop = 0;
+
+  /* The format is reused as long as arguments are left */
+  do {
+    int first_arg = arg;
+    for (const char *f = format; *f != '\0' && !stop; f++) {
+      if (*f == '\\') {
+        f = out_escape(&out, f, 0, &stop);
+        continue;
+      }
+      if (*f != '%') {
+        out_char(&out, *f);
+        continue;
+      }
+      if (f[1] == '%') {
+        out_char(&out, '%');
+        f++;
+        continue;
+      }
+
+      /* Copy flags, width and precision of the conversion into spec, taking
+       * * from the arguments.
+       */
+      char spec[64];
+      int spec_len = 0;
+      spec[spec_len++] = *f++;
+      while (*f != '\0' && spec_len < 40 && strchr("-+ #0123456789.*", *f)) {
+        if (*f == '*') {
+          int ok = 1;
+          long long value =
+              arg < argc ? printf_integer(argv[arg++], &ok) : 0;
+          spec_len += snprintf(spec + spec_len, sizeof spec - spec_len, "%d",
+                               (int)value);
+        } else {
+          spec[spec_len++] = *f;
+        }
+        f++;
+      }
+
+      const char *value = arg < argc ? argv[arg++] : NULL;
+      int ok = 1;
+      switch (*f) {
+        case 's':
+        case 'c':
+          spec[spec_len++] = 's';
+          spec[spec_len] = '\0';
+          if (*f == 'c') {
+            char c[2] = {value != NULL ? value[0] : '\0', '\0'};
+            out_format(&out, spec, c);
+          } else {
+            out_format(&out, spec, value != NULL ? value : "");
+          }
+          break;
+        case 'b': {
+          /* %b expands escapes in its argument. The expansion may contain
+           * NUL characters, so it is padded by hand rather than with %s.
+           */
+          struct OutBuffer expanded = {.fd = -1};
+          for (const char *c = value != NULL ? value : "";
+               *c != '\0' && !stop; c++) {
+            if (*c == '\\') {
+              c = out_escape(&expanded, c, 1, &stop);
+            } else {
+              out_char(&expanded, *c);
+            }
+          }
+          out_flush(&expanded);
+          out_padded(&out, spec, spec_len, expanded.captured,
+                     expanded.captured_len);
+          free(expanded.captured);
+          break;
+        }
+        case 'd':
+        case 'i':
+          strcpy(spec + spec_len, "lld");
+          out_format(&out, spec,
+                     value != NULL ? printf_integer(value, &ok) : 0LL);
+          break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+          spec[spec_len++] = 'l';
+          spec[spec_len++] = 'l';
+          spec[spec_len++] = *f;
+          spec[spec_len] = '\0';
+          out_format(&out, spec,
+                     (unsigned long long)(value != NULL
+                                              ? printf_integer(value, &ok)
+                                              : 0));
+          break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G': {
+          spec[spec_len++] = *f;
+          spec[spec_len] = '\0';
+          char *end = NULL;
+          double number = value != NULL ? strtod(value, &end) : 0.0;
+          if (value != NULL && (*value == '\0' || *end != '\0')) {
+            ok = 0;
+          }
+          out_format(&out, spec, number);
+          break;
+        }
+        default:
+          out_flush(&out);
+          dprintf(io->err, "printf: %%%c: invalid conversion\n",
+                  *f != '\0' ? *f : '%');
+          return 1;
+      }
+      if (!ok) {
+        dprintf(io->err, "printf: %s: invalid number\n", value);
+        status = 1;
+      }
+    }
+    if (arg == first_arg) {
+      /* The format has no conversions, do not loop forever */
+      break;
+    }
+  } while (arg < argc && !stop);
+
+  return out_finish(&out, status);
+}
+
+/*
+ * Parses an integer operand of test. Returns 0 and prints an error if arg is
+ * not an integer.
+ */
+static int test_integer(const char *arg, long long *value,
+                        struct BuiltinIO *io) {
+  char *end;
+  errno = 0;
+  *value = strtoll(arg, &end, 10);
+  while (isspace((unsigned char)*end)) {
+    end++;
+  }
+  if (*arg == '\0' || *end != '\0' || errno == ERANGE) {
+    dprintf(io->err, "test: %s: integer expression expected\n", arg);
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Evaluates a unary test. Returns 0 if it is true, 1 if it is false and 2 if
+ * op is not a unary operator.
+ */
+static int test_unary(const char *op, const char *arg) {
+  struct stat st;
+  if (op[0] != '-' || op[1] == '\0' || op[2] != '\0') {
+    return 2;
+  }
+  switch (op[1]) {
+    case 'n':
+      return arg[0] != '\0' ? 0 : 1;
+    case 'z':
+      return arg[0] == '\0' ? 0 : 1;
+    case 'e':
+      return stat(arg, &st) == 0 ? 0 : 1;
+    case 'f':
+      return stat(arg, &st) == 0 && S_ISREG(st.st_mode) ? 0 : 1;
+    case 'd':
+      return stat(arg, &st) == 0 && S_ISDIR(st.st_mode) ? 0 : 1;
+    case 'p':
+      return stat(arg, &st) == 0 && S_ISFIFO(st.st_mode) ? 0 : 1;
+    case 'S':
+      return stat(arg, &st) == 0 && S_ISSOCK(st.st_mode) ? 0 : 1;
+    case 'b':
+      return stat(arg, &st) == 0 && S_ISBLK(st.st_mode) ? 0 : 1;
+    case 'c':
+      return stat(arg, &st) == 0 && S_ISCHR(st.st_mode) ? 0 : 1;
+    case 's':
+      return stat(arg, &st) == 0 && st.st_size > 0 ? 0 : 1;
+    case 'h':
+    case 'L':
+      return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode) ? 0 : 1;
+    case 'r':
+      return access(arg, R_OK) == 0 ? 0 : 1;
+    case 'w':
+      return access(arg, W_OK) == 0 ? 0 : 1;
+    case 'x':
+      return access(arg, X_OK) == 0 ? 0 : 1;
+    case 't':
+      return isatty(atoi(arg)) ? 0 : 1;
+    default:
+      return 2;
+  }
+}
+
+/*
+ * Evaluates a binary test. Returns 0 if it is true, 1 if it is false, 2 on
+ * errors and 3 if op is not a binary operator.
+ */
+static int test_binary(const char *left, const char *op, const char *right,
+                       struct BuiltinIO *io) {
+  if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+    return strcmp(left, right) == 0 ? 0 : 1;
+  } else if (strcmp(op, "!=") == 0) {
+    return strcmp(left, right) != 0 ? 0 : 1;
+  } else if (strcmp(op, "<") == 0) {
+    return strcmp(left, right) < 0 ? 0 : 1;
+  } else if (strcmp(op, ">") == 0) {
+    return strcmp(left, right) > 0 ? 0 : 1;
+  }
+
+  const char *int_ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+  for (int i = 0; i < 6; i++) {
+    if (strcmp(op, int_ops[i]) != 0) {
+      continue;
+    }
+    long long a, b;
+    if (!test_integer(left, &a, io) || !test_integer(right, &b, io)) {
+      return 2;
+    }
+    int result[] = {a == b, a != b, a < b, a <= b, a > b, a >= b};
+    return result[i] ? 0 : 1;
+  }
+  return 3;
+}
+
+static int negate(int status) { return status == 2 ? 2 : !status; }
+
+/*
+ * Evaluates the operands of test following the POSIX rules, which decide by
+ * the number of operands.
+ */
+static int test_operands(int argc, char **argv, struct BuiltinIO *io) {
+  int status;
+  switch (argc) {
+    case 0:
+      return 1;
+    case 1:
+      return argv[0][0] != '\0' ? 0 : 1;
+    case 2:
+      if (strcmp(argv[0], "!") == 0) {
+        return negate(test_operands(1, argv + 1, io));
+      }
+      status = test_unary(argv[0], argv[1]);
+      if (status == 2) {
+        dprintf(io->err, "test: %s: unary operator expected\n", argv[0]);
+      }
+      return status;
+    case 3:
+      status = test_binary(argv[0], argv[1], argv[2], io);
+      if (status != 3) {
+        return status;
+      }
+      if (strcmp(argv[0], "!") == 0) {
+        return negate(test_operands(2, argv + 1, io));
+      }
+      if (strcmp(argv[0], "(") == 0 && strcmp(argv[2], ")") == 0) {
+        return test_operands(1, argv + 1, io);
+      }
+      dprintf(io->err, "test: %s: binary operator expected\n", argv[1]);
+      return 2;
+    case 4:
+      if (strcmp(argv[0], "!") == 0) {
+        return negate(test_operands(3, argv + 1, io));
+      }
+      if (strcmp(argv[0], "(") == 0 && strcmp(argv[3], ")") == 0) {
+        return test_operands(2, argv + 1, io);
+      }
+      /* fall through */
+    default:
+      dprintf(io->err, "test: too many arguments\n");
+      return 2;
+  }
+}
+
+static int builtin_test(int argc, char **argv, struct BuiltinIO *io) {
+  /* [ requires ] as its last argument */
+  if (strcmp(argv[0], "[") == 0) {
+    if (strcmp(argv[argc - 1], "]") != 0) {
+      dprintf(io->err, "[: missing ]\n");
+      return 2;
+    }
+    argc--;
+  }
+  return test_operands(argc - 1, argv + 1, io);
+}
+
+/*
+ * Lists an exported variable for export without arguments.
+ */
+static void list_export(const char *name, size_t name_len, const char *value,
+                        int exported, void *arg) {
+  if (exported) {
+    out_format(arg, "export %.*s=\"%s\"\n", (int)name_len, name, value);
+  }
+}
+
+static int builtin_export(int argc, char **argv, struct BuiltinIO *io) {
+  if (argc == 1) {
+    struct OutBuffer out = {.fd = io->out};
+    for_each_variable(list_export, &out);
+    return out_finish(&out, 0);
+  }
+
+  int status = 0;
+  for (int i = 1; i < argc; i++) {
+    char *equals = strchr(argv[i], '=');
+    size_t name_len = equals != NULL ? (size_t)(equals - argv[i])
+                                     : strlen(argv[i]);
+    if (!is_variable_name(argv[i], name_len)) {
+      dprintf(io->err, "export: %s: not a valid identifier\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    if (equals != NULL) {
+      *equals = '\0';
+      set_variable(argv[i], equals + 1);
+      export_variable(argv[i]);
+      *equals = '=';
+    } else {
+      export_variable(argv[i]);
+    }
+  }
+  return status;
+}
+
+static int builtin_unset(int argc, char **argv, struct BuiltinIO *io) {
+  int status = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!is_variable_name(argv[i], strlen(argv[i]))) {
+      dprintf(io->err, "unset: %s: not a valid identifier\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    unset_variable(argv[i]);
+  }
+  return status;
+}
+
+/* Names of the options that can be toggled with set -o/+o and pointers to the
+ * corresponding fields in shell_options.
+ */
+static const char *shell_option_names[] = {"pipefail", "posix_spawn",
+                                           "spawn_server"};
+static int *shell_option_values[] = {&shell_options.pipefail,
+                                     &shell_options.posix_spawn,
+                                     &shell_options.spawn_server};
+static const int n_shell_options = 3;
+
+/*
+ * Lists a variable for set without arguments.
+ */
+static void list_set(const char *name, size_t name_len, const char *value,
+                     int exported, void *arg) {
+  out_format(arg, "%.*s=%s\n", (int)name_len, name, value);
+}
+
+static int builtin_set(int argc, char **argv, struct BuiltinIO *io) {
+  /* set without arguments lists all variables, exported or not */
+  if (argc == 1) {
+    struct OutBuffer out = {.fd = io->out};
+    for_each_variable(list_set, &out);
+    return out_finish(&out, 0);
+  }
+
+  /* set -o without a name lists all options and their current values */
+  if (argc == 2 && strcmp(argv[1], "-o") == 0) {
+    struct OutBuffer out = {.fd = io->out};
+    for (int i = 0; i < n_shell_options; i++) {
+      out_format(&out, "%-15s %s\n", shell_option_names[i],
+                 *shell_option_values[i] ? "on" : "off");
+    }
+    return out_finish(&out, 0);
+  }
+
+  if (argc != 3 ||
+      (strcmp(argv[1], "-o") != 0 && strcmp(argv[1], "+o") != 0)) {
+    dprintf(io->err, "set: usage: set [-o|+o] option\n");
+    return 2;
+  }
+
+  for (int i = 0; i < n_shell_options; i++) {
+    if (strcmp(argv[2], shell_option_names[i]) == 0) {
+      /* -o enables, +o disables the option */
+      *shell_option_values[i] = argv[1][0] == '-';
+      if (shell_option_values[i] == &shell_options.spawn_server) {
+        if (shell_options.spawn_server) {
+          start_spawn_server();
+        } else {
+          stop_spawn_server();
+        }
+      }
+      return 0;
+    }
+  }
+  dprintf(io->err, "set: no such option: %s\n", argv[2]);
+  return 1;
+}
+
+static int builtin_hash(int argc, char **argv, struct BuiltinIO *io) {
+  if (argc == 1) {
+    hash_print(io->out);
+    return 0;
+  }
+  if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+    hash_reset();
+    invalidate_command_paths();
+    return 0;
+  }
+
+  /* hash name... looks up the names and remembers their locations */
+  int status = 0;
+  for (int i = 1; i < argc; i++) {
+    if (argv[i][0] == '-') {
+      dprintf(io->err, "hash: usage: hash [-r] [name ...]\n");
+      return 2;
+    }
+    if (strchr(argv[i], '/') == NULL && hash_lookup(argv[i]) == NULL) {
+      dprintf(io->err, "hash: %s: not found\n", argv[i]);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+static void print_history_entry(long long number, const char *entry,
+                                size_t len, void *arg) {
+  struct OutBuffer *out = arg;
+  out_format(out, "%5lld  ", number);
+  out_write(out, entry, len);
+  out_char(out, '\n');
+}
+
+/*
+ * history lists all entries of the history file, history n the last n of
+ * them and history -s text those that contain text.
+ */
+static int builtin_history(int argc, char **argv, struct BuiltinIO *io) {
+  struct OutBuffer out = {.fd = io->out};
+  char *end = "";
+  long long n = argc == 2 ? strtoll(argv[1], &end, 10) : 0;
+  if (argc == 1) {
+    list_history(1, print_history_entry, &out);
+  } else if (argc == 2 && isdigit((unsigned char)*argv[1]) && *end == '\0') {
+    list_history(count_history() - n + 1, print_history_entry, &out);
+  } else if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+    search_history(argv[2], print_history_entry, &out);
+  } else {
+    dprintf(io->err, "history: usage: history [n] | history -s text\n");
+    return 2;
+  }
+  return out_finish(&out, 0);
+}
+
+static int builtin_cache(int argc, char **argv, struct BuiltinIO *io) {
+  if (argc == 1) {
+    print_pipeline_cache(io->out);
+    return 0;
+  }
+  if (argc == 2 && strcmp(argv[1], "-r") == 0) {
+    clear_pipeline_cache();
+    return 0;
+  }
+  dprintf(io->err, "cache: usage: cache [-r]\n");
+  return 2;
+}
+
+static int builtin_jobs(int argc, char **argv, struct BuiltinIO *io) {
+  reap_jobs();
+  print_jobs(io->out);
+  return 0;
+}
+
+/*
+ * Implements fg and bg, which continue the job given as argument or the
+ * current job.
+ */
+static int builtin_fg(int argc, char **argv, struct BuiltinIO *io) {
+  int foreground = strcmp(argv[0], "fg") == 0;
+  if (foreground && job_terminal_fd() == -1) {
+    dprintf(io->err, "fg: no job control\n");
+    return 1;
+  }
+  if (argc > 2) {
+    dprintf(io->err, "%s: usage: %s [job]\n", argv[0], argv[0]);
+    return 2;
+  }
+
+  reap_jobs();
+  struct Job *job = find_job(argc == 2 ? argv[1] : NULL);
+  if (job == NULL) {
+    dprintf(io->err, "%s: %s: no such job\n", argv[0],
+            argc == 2 ? argv[1] : "current");
+    return 1;
+  }
+  return continue_job(job, foreground);
+}
+
+static int builtin_wait(int argc, char **argv, struct BuiltinIO *io) {
+  if (argc == 1) {
+    return wait_job(NULL);
+  }
+
+  /* The status is that of the last job waited for */
+  int status = 0;
+  for (int i = 1; i < argc; i++) {
+    reap_jobs();
+    struct Job *job = find_job(argv[i]);
+    if (job == NULL) {
+      dprintf(io->err, "wait: %s: no such job\n", argv[i]);
+      status = 127;
+      continue;
+    }
+    status = wait_job(job);
+  }
+  return status;
+}
+
+/* Sorted by name for find_builtin() */
+static const struct Builtin builtins[] = {
+    {":", builtin_true, 1, 0},
+    {"[", builtin_test, 1, 0},
+    {"bg", builtin_fg, 0, 0},
+    {"cache", builtin_cache, 0, 0},
+    {"cd", builtin_cd, 0, 0},
+    {"echo", builtin_echo, 1, 0},
+    {"exit", builtin_exit, 0, 0},
+    {"export", builtin_export, 0, 0},
+    {"false", builtin_false, 1, 0},
+    {"fg", builtin_fg, 0, 0},
+    {"hash", builtin_hash, 0, 0},
+    {"history", builtin_history, 1, 0},
+    {"jobs", builtin_jobs, 0, 0},
+    {"parallel", builtin_parallel, 0, 1},
+    {"printf", builtin_printf, 1, 0},
+    {"pwd", builtin_pwd, 1, 0},
+    {"set", builtin_set, 0, 0},
+    {"test", builtin_test, 1, 0},
+    {"true", builtin_true, 1, 0},
+    {"unset", builtin_unset, 0, 0},
+    {"wait", builtin_wait, 0, 0},
+};
+
+static int compare_builtin(const void *name, const void *builtin) {
+  return strcmp(name, ((const struct Builtin *)builtin)->name);
+}
+
+const struct Builtin *find_builtin(const char *name) {
+  return bsearch(name, builtins, sizeof builtins / sizeof builtins[0],
+                 sizeof builtins[0], compare_builtin);
+}
+
+const char *builtin_name(int n) {
+  if (n < 0 || n >= (int)(sizeof builtins / sizeof builtins[0])) {
+    return NULL;
+  }
+  return builtins[n].name;
+}
+
+int run_builtin(const struct Builtin *builtin, int argc, char **argv,
+                struct BuiltinIO *io) {
+  return builtin->function(argc, argv, io);
+}
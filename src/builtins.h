@@ -0,0 +1,73 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_BUILTINS_H_
+#define PSH_BUILTINS_H_
+
+/*
+ * Holds the file descriptors a built-in reads from and writes to. Built-ins
+ * never use stdio for their own input and output, so that they can be pointed
+ * at other file descriptors than 0, 1 and 2.
+ */
+struct BuiltinIO {
+  int in;  /* File descriptor of the built-in's stdin. */
+  int out; /* File descriptor of the built-in's stdout. */
+  int err; /* File descriptor of the built-in's stderr. */
+};
+
+/*
+ * Signature of the functions implementing built-ins. argv is NULL terminated
+ * and argv[0] is the name of the built-in. Returns the exit status.
+ */
+typedef int (*BuiltinFunction)(int argc, char **argv, struct BuiltinIO *io);
+
+/*
+ * Holds a single entry of the built-in table.
+ */
+struct Builtin {
+  const char *name;         /* Name the built-in is invoked by. */
+  BuiltinFunction function; /* Implementation of the built-in. */
+  int in_thread;            /* Whether the built-in leaves the state of the
+                               shell alone, so that it can run on a helper
+                               thread as a stage of a pipeline. */
+  int starts_commands;      /* Whether the built-in starts commands of its
+                               own. With job control, it then runs in a
+                               forked child with a process group of its own,
+                               so that e.g. Ctrl-C reaches the commands. */
+};
+
+/*
+ * Returns the built-in called name, or NULL if there is none.
+ */
+const struct Builtin *find_builtin(const char *name);
+
+/*
+ * Returns the name of the n-th built-in in the order of strcmp, or NULL if
+ * there are no more than n built-ins.
+ */
+const char *builtin_name(int n);
+
+/*
+ * Runs the built-in with the given arguments and file descriptors and returns
+ * its exit status.
+ */
+int run_builtin(const struct Builtin *builtin, int argc, char **argv,
+                struct BuiltinIO *io);
+
+#endif /* PSH_BUILTINS_H_ */
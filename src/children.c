@@ -0,0 +1,259 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "children.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/*
+ * Holds a watched child and its pidfd, or -1 if the kernel has no pidfds.
+ */
+struct WatchedChild {
+  pid_t pid;
+  int pidfd;
+};
+
+/*
+ * Holds a state change of a child that has been collected, but not returned
+ * by wait_child() yet.
+ */
+struct ChildEvent {
+  pid_t pid;
+  int status;
+  struct rusage usage;
+};
+
+/* The epoll set and the signalfd in it, and the process they belong to */
+static int epoll_fd = -1;
+static int signal_fd = -1;
+static pid_t owner_pid = 0;
+
+static struct WatchedChild *children = NULL;
+static int n_children = 0;
+static int max_children = 0;
+
+/* Collected state changes, oldest first */
+static struct ChildEvent *events = NULL;
+static int n_events = 0;
+static int max_events = 0;
+
+void init_child_events() {
+  pid_t pid = getpid();
+  if (epoll_fd != -1 && owner_pid == pid) {
+    return;
+  }
+  if (epoll_fd != -1) {
+    /* A forked child shares the epoll set with the shell, so it must not
+     * touch it. The children watched in there are not its children anyway.
+     */
+    close(epoll_fd);
+    close(signal_fd);
+    for (int i = 0; i < n_children; i++) {
+      if (children[i].pidfd != -1) {
+        close(children[i].pidfd);
+      }
+    }
+    n_children = 0;
+    n_events = 0;
+  }
+
+  /* An inherited SIG_IGN would let the kernel reap the children on its own
+   * and leave no status to collect
+   */
+  signal(SIGCHLD, SIG_DFL);
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGCHLD);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (epoll_fd == -1 || signal_fd == -1) {
+    perror("psh: epoll");
+    exit(EXIT_FAILURE);
+  }
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = signal_fd};
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event);
+  owner_pid = pid;
+}
+
+void watch_child(pid_t pid) {
+  init_child_events();
+  if (n_children == max_children) {
+    max_children = max_children > 0 ? 2 * max_children : 16;
+    children = handled_realloc(children,
+                               sizeof(struct WatchedChild) * max_children);
+  }
+
+  /* Without a pidfd, the exit is still noticed through SIGCHLD */
+  int pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd != -1) {
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = pidfd};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pidfd, &event);
+  }
+  children[n_children++] = (struct WatchedChild){.pid = pid, .pidfd = pidfd};
+}
+
+static void unwatch_child(int index) {
+  int pidfd = children[index].pidfd;
+  if (pidfd != -1) {
+    /* Forked children may still hold the pidfd, so closing it is not enough
+     * to take it out of the set.
+     */
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pidfd, NULL);
+    close(pidfd);
+  }
+  children[index] = children[--n_children];
+}
+
+/*
+ * Collects a state change of the child at index if it has one. Returns 1 if
+ * the child has exited and is no longer watched, which moves the last child
+ * to index, and 0 otherwise.
+ */
+static int collect_child(int index) {
+  struct ChildEvent event;
+  event.pid = children[index].pid;
+  pid_t pid;
+  while ((pid = wait4(event.pid, &event.status,
+                      WNOHANG | WUNTRACED | WCONTINUED, &event.usage)) == -1 &&
+         errno == EINTR) {
+  }
+  if (pid == 0) {
+    return 0;
+  }
+  if (pid == -1) {
+    /* Reaped elsewhere already, so how it ended is unknown. Reporting success
+     * would hide a failed command.
+     */
+    printf("psh: %d: %s\n", event.pid, strerror(errno));
+    event.status = W_EXITCODE(127, 0);
+    memset(&event.usage, 0, sizeof event.usage);
+  }
+
+  if (n_events == max_events) {
+    max_events = max_events > 0 ? 2 * max_events : 16;
+    events = handled_realloc(events, sizeof(struct ChildEvent) * max_events);
+  }
+  events[n_events++] = event;
+  if (pid == -1 || WIFEXITED(event.status) || WIFSIGNALED(event.status)) {
+    unwatch_child(index);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Empties the signalfd. Returns 1 if a SIGCHLD was pending.
+ */
+static int read_signals() {
+  struct signalfd_siginfo info[8];
+  int pending = 0;
+  while (read(signal_fd, info, sizeof info) > 0) {
+    pending = 1;
+  }
+  return pending;
+}
+
+/*
+ * Collects the state changes the ready entries of the epoll set stand for.
+ */
+static void handle_ready(const struct epoll_event *ready, int n) {
+  for (int i = 0; i < n; i++) {
+    int fd = ready[i].data.fd;
+    if (fd == signal_fd) {
+      /* SIGCHLD does not say which children changed, as it is not queued
+       * while one is pending, so all are checked.
+       */
+      if (read_signals()) {
+        for (int index = 0; index < n_children;) {
+          index += collect_child(index) == 0;
+        }
+      }
+      continue;
+    }
+    /* The child may have been collected after SIGCHLD already */
+    for (int index = 0; index < n_children; index++) {
+      if (children[index].pidfd == fd) {
+        collect_child(index);
+        break;
+      }
+    }
+  }
+}
+
+static long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+pid_t wait_child(int *status, struct rusage *usage, int timeout_ms) {
+  init_child_events();
+  long long deadline = timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+  while (n_events == 0) {
+    if (n_children == 0) {
+      read_signals();
+      return -1;
+    }
+    int wait_ms = timeout_ms;
+    if (timeout_ms > 0) {
+      long long left = deadline - now_ms();
+      wait_ms = left > 0 ? left : 0;
+    }
+    struct epoll_event ready[16];
+    int n = epoll_wait(epoll_fd, ready, 16, wait_ms);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      perror("psh: epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+    if (n == 0) {
+      return 0;
+    }
+    handle_ready(ready, n);
+  }
+
+  struct ChildEvent event = events[0];
+  memmove(events, events + 1, sizeof(struct ChildEvent) * --n_events);
+  *status = event.status;
+  if (usage != NULL) {
+    *usage = event.usage;
+  }
+  return event.pid;
+}
+
+int child_event_fd() {
+  init_child_events();
+  return epoll_fd;
+}
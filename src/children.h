@@ -0,0 +1,67 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_CHILDREN_H_
+#define PSH_CHILDREN_H_
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+/*
+ * All children the shell waits for are watched by a single event loop: each
+ * one has a pidfd in an epoll set, which becomes readable when it exits, and
+ * the set also holds a signalfd for SIGCHLD, which reports stopped and
+ * continued children. Only watched children are ever reaped, so commands the
+ * shell runs for itself, e.g. for the prompt, can wait for theirs.
+ *
+ * SIGCHLD is blocked so that it can be read from the signalfd. Commands get
+ * an empty signal mask when they are launched, see spawn.h. A forked child of
+ * the shell that watches children of its own gets a loop of its own. The
+ * functions are meant to be called from the main thread only.
+ */
+
+/*
+ * Resets SIGCHLD to its default, blocks it and sets up the event loop. Must
+ * be called before any threads are created, so that they inherit the blocked
+ * SIGCHLD; the other functions set up the loop on first use, too.
+ */
+void init_child_events();
+
+/*
+ * Starts watching pid, a child of the calling process.
+ */
+void watch_child(pid_t pid);
+
+/*
+ * Waits until a watched child exits, is stopped or continues. Returns its pid
+ * and stores its status as returned by waitpid() in *status and its resource
+ * usage in *usage unless usage is NULL. A child that has exited is no longer
+ * watched. A child that was reaped elsewhere is reported as exited with
+ * status 127. Gives up after timeout_ms, or waits indefinitely if timeout_ms is
+ * -1, and returns 0 then. Returns -1 if no child is watched.
+ */
+pid_t wait_child(int *status, struct rusage *usage, int timeout_ms);
+
+/*
+ * Returns the file descriptor of the epoll set, which becomes readable when a
+ * watched child may have changed its state, for poll() loops like readline's.
+ */
+int child_event_fd();
+
+#endif /* PSH_CHILDREN_H_ */
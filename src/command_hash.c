@@ -0,0 +1,311 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "command_hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "utils.h"
+#include "vars.h"
+
+/* Minimum number of seconds between two checks of the same PATH directory. */
+#define RECHECK_INTERVAL 1
+
+/*
+ * Holds one directory of PATH together with its modification time at the
+ * time entries were added for it.
+ */
+struct PathDir {
+  char *path;              /* Directory including a trailing /. */
+  int len;                 /* Length of path. */
+  int known;               /* Whether mtime has been recorded. */
+  struct timespec mtime;   /* Modification time of the directory. */
+  time_t checked;          /* Monotonic seconds of the last check. */
+};
+
+/*
+ * Holds a single remembered executable location.
+ */
+struct HashEntry {
+  char *name;              /* Executable name, e.g. "ls". */
+  char *full_path;         /* Full path, e.g. "/usr/bin/ls". */
+  int dir;                 /* Index of the PATH directory it was found in. */
+  int hits;                /* Number of lookups that returned this entry. */
+  struct HashEntry *next;  /* Next entry in the same bucket. */
+};
+
+/* Copy of the PATH value the directories below were split from. */
+static char *cached_path = NULL;
+static struct PathDir *dirs = NULL;
+static int n_dirs = 0;
+
+static struct HashEntry **buckets = NULL;
+static int n_buckets = 0;
+static int n_entries = 0;
+
+static unsigned int hash_name(const char *name) {
+  /* 32 bit FNV-1a */
+  unsigned int hash = 2166136261u;
+  while (*name != '\0') {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void free_entry(struct HashEntry *entry) {
+  free(entry->name);
+  free(entry->full_path);
+  free(entry);
+}
+
+/*
+ * Drops all entries that were found in PATH directory first_dir or later.
+ */
+static void flush_entries(int first_dir) {
+  for (int i = 0; i < n_buckets; i++) {
+    struct HashEntry **link = &buckets[i];
+    while (*link != NULL) {
+      struct HashEntry *entry = *link;
+      if (entry->dir >= first_dir) {
+        *link = entry->next;
+        free_entry(entry);
+        n_entries--;
+      } else {
+        link = &entry->next;
+      }
+    }
+  }
+}
+
+static void free_dirs() {
+  for (int i = 0; i < n_dirs; i++) {
+    free(dirs[i].path);
+  }
+  free(dirs);
+  dirs = NULL;
+  n_dirs = 0;
+  free(cached_path);
+  cached_path = NULL;
+}
+
+/*
+ * Splits path into PATH directories, each with a trailing /.
+ */
+static void split_path(const char *path) {
+  cached_path = strdup(path);
+
+  int max_dirs = 1;
+  for (const char *c = path; *c != '\0'; c++) {
+    if (*c == ':') {
+      max_dirs++;
+    }
+  }
+  dirs = handled_malloc(sizeof(struct PathDir) * max_dirs);
+
+  const char *start = path;
+  while (1) {
+    const char *end = strchr(start, ':');
+    int len = end != NULL ? end - start : (int)strlen(start);
+    /* Skip empty entries, like the strtok based search did before */
+    if (len > 0) {
+      struct PathDir *dir = &dirs[n_dirs++];
+      int needs_slash = start[len - 1] != '/';
+      dir->path = handled_malloc(len + needs_slash + 1);
+      memcpy(dir->path, start, len);
+      if (needs_slash) {
+        dir->path[len] = '/';
+      }
+      dir->path[len + needs_slash] = '\0';
+      dir->len = len + needs_slash;
+      dir->known = 0;
+      dir->checked = 0;
+    }
+    if (end == NULL) {
+      break;
+    }
+    start = end + 1;
+  }
+}
+
+static time_t now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+/*
+ * Checks whether the modification time of PATH directory n has changed since
+ * it was recorded and drops the entries that may be stale if it has. Returns 1
+ * if entries were dropped, 0 otherwise.
+ */
+static int check_dir(int n, time_t now) {
+  struct PathDir *dir = &dirs[n];
+  if (dir->known && now - dir->checked < RECHECK_INTERVAL) {
+    return 0;
+  }
+  dir->checked = now;
+
+  struct stat st;
+  if (stat(dir->path, &st) == -1) {
+    /* Directory does not exist (anymore), treat it like any other change */
+    st.st_mtim.tv_sec = 0;
+    st.st_mtim.tv_nsec = 0;
+  }
+  int changed = !dir->known || st.st_mtim.tv_sec != dir->mtime.tv_sec ||
+                st.st_mtim.tv_nsec != dir->mtime.tv_nsec;
+  dir->mtime = st.st_mtim;
+  if (changed && dir->known) {
+    dir->known = 1;
+    flush_entries(n);
+    return 1;
+  }
+  dir->known = 1;
+  return 0;
+}
+
+static void grow_buckets() {
+  int new_n_buckets = n_buckets == 0 ? 64 : 2 * n_buckets;
+  struct HashEntry **new_buckets =
+      handled_malloc(sizeof(struct HashEntry *) * new_n_buckets);
+  memset(new_buckets, 0, sizeof(struct HashEntry *) * new_n_buckets);
+
+  for (int i = 0; i < n_buckets; i++) {
+    struct HashEntry *entry = buckets[i];
+    while (entry != NULL) {
+      struct HashEntry *next = entry->next;
+      unsigned int bucket = hash_name(entry->name) % new_n_buckets;
+      entry->next = new_buckets[bucket];
+      new_buckets[bucket] = entry;
+      entry = next;
+    }
+  }
+  free(buckets);
+  buckets = new_buckets;
+  n_buckets = new_n_buckets;
+}
+
+static struct HashEntry *find_entry(const char *name) {
+  if (n_buckets == 0) {
+    return NULL;
+  }
+  struct HashEntry *entry = buckets[hash_name(name) % n_buckets];
+  while (entry != NULL && strcmp(entry->name, name) != 0) {
+    entry = entry->next;
+  }
+  return entry;
+}
+
+/*
+ * Searches the PATH directories for the executable and remembers its location
+ * if it is found.
+ */
+static struct HashEntry *search_path(const char *executable, time_t now) {
+  int len = strlen(executable);
+  for (int i = 0; i < n_dirs; i++) {
+    char *full_path = handled_malloc(dirs[i].len + len + 1);
+    memcpy(full_path, dirs[i].path, dirs[i].len);
+    memcpy(full_path + dirs[i].len, executable, len + 1);
+
+    if (access(full_path, F_OK) == 0) {
+      /* Record the mtimes the entry is validated against later on */
+      for (int j = 0; j <= i; j++) {
+        check_dir(j, now);
+      }
+
+      if (4 * (n_entries + 1) > 3 * n_buckets) {
+        grow_buckets();
+      }
+      struct HashEntry *entry = handled_malloc(sizeof(struct HashEntry));
+      entry->name = strdup(executable);
+      entry->full_path = full_path;
+      entry->dir = i;
+      entry->hits = 0;
+
+      unsigned int bucket = hash_name(executable) % n_buckets;
+      entry->next = buckets[bucket];
+      buckets[bucket] = entry;
+      n_entries++;
+      return entry;
+    }
+    free(full_path);
+  }
+  return NULL;
+}
+
+const char *hash_lookup(const char *executable) {
+  /* Start over if PATH has changed since the table was filled */
+  const char *path = get_variable("PATH");
+  if (path == NULL) {
+    path = "";
+  }
+  if (cached_path == NULL || strcmp(path, cached_path) != 0) {
+    hash_reset();
+    free_dirs();
+    split_path(path);
+  }
+
+  time_t now = now_seconds();
+  struct HashEntry *entry = find_entry(executable);
+  if (entry != NULL) {
+    /* Validate the directories that could have removed or shadowed it */
+    for (int i = 0; i <= entry->dir; i++) {
+      if (check_dir(i, now)) {
+        break;
+      }
+    }
+    entry = find_entry(executable);
+  }
+
+  if (entry == NULL) {
+    entry = search_path(executable, now);
+    if (entry == NULL) {
+      return NULL;
+    }
+  }
+
+  entry->hits++;
+  return entry->full_path;
+}
+
+void hash_reset() {
+  flush_entries(0);
+  for (int i = 0; i < n_dirs; i++) {
+    dirs[i].known = 0;
+  }
+}
+
+void hash_print(int fd) {
+  if (n_entries == 0) {
+    dprintf(fd, "hash: hash table empty\n");
+    return;
+  }
+  dprintf(fd, "hits\tcommand\n");
+  for (int i = 0; i < n_buckets; i++) {
+    for (struct HashEntry *entry = buckets[i]; entry != NULL;
+         entry = entry->next) {
+      dprintf(fd, "%4d\t%s\n", entry->hits, entry->full_path);
+    }
+  }
+}
@@ -0,0 +1,52 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_COMMAND_HASH_H_
+#define PSH_COMMAND_HASH_H_
+
+/*
+ * Looks up the full path of an executable name that does not contain a /,
+ * e.g. "ls". The result of searching the directories in PATH is remembered in
+ * a hash table, so that repeated lookups of the same name do not search PATH
+ * again.
+ *
+ * The table is flushed when PATH changes. An entry found in the n-th PATH
+ * directory is dropped when the modification time of that directory or of one
+ * of the directories before it changes, i.e. when the executable may have been
+ * removed or shadowed. Directory modification times are checked at most once
+ * per second, so that tight loops do not pay for a stat per command.
+ *
+ * Returns a pointer to the full path owned by the table, which stays valid
+ * until the next call of a function in this module, or NULL if the executable
+ * can not be found.
+ */
+const char *hash_lookup(const char *executable);
+
+/*
+ * Forgets all remembered locations (hash -r).
+ */
+void hash_reset();
+
+/*
+ * Prints the remembered locations together with the number of times each of
+ * them has been looked up, to the file descriptor fd.
+ */
+void hash_print(int fd);
+
+#endif /* PSH_COMMAND_HASH_H_ */
@@ -0,0 +1,421 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "completion.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "builtins.h"
+#include "utils.h"
+#include "vars.h"
+
+/* Events of a watched directory that may add or remove executables. */
+#define WATCH_EVENTS                                                 \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+   IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/* Number of changed names after which a directory is read again instead. */
+#define MAX_PENDING 64
+
+/*
+ * Holds one directory of PATH together with the names of the executables it
+ * contained when it was read. Names that inotify reported as created, removed
+ * or changed since are collected in pending and checked one at a time.
+ */
+struct IndexDir {
+  char *path;            /* Directory as given in PATH. */
+  int wd;                /* inotify watch descriptor, or -1 if unwatched. */
+  int stale;             /* Whether the directory has to be read again. */
+  struct timespec mtime; /* Modification time when it was read. */
+  char *names;           /* Names of the executables, each NUL terminated. */
+  size_t names_len;      /* Number of bytes used in names. */
+  size_t names_size;     /* Number of bytes allocated for names. */
+  int n_names;           /* Number of names. */
+  char *pending;         /* Changed names, each NUL terminated. */
+  size_t pending_len;    /* Number of bytes used in pending. */
+  size_t pending_size;   /* Number of bytes allocated for pending. */
+  int n_pending;         /* Number of changed names. */
+};
+
+/* Copy of the PATH value the directories below were split from. */
+static char *cached_path = NULL;
+static struct IndexDir *dirs = NULL;
+static int n_dirs = 0;
+
+/* inotify instance watching dirs, or -1 */
+static int inotify_fd = -1;
+
+/* Sorted names of all executables and built-ins, pointing into dirs */
+static const char **index_names = NULL;
+static int n_index_names = 0;
+static int max_index_names = 0;
+
+static void free_dirs() {
+  for (int i = 0; i < n_dirs; i++) {
+    free(dirs[i].path);
+    free(dirs[i].names);
+    free(dirs[i].pending);
+  }
+  free(dirs);
+  dirs = NULL;
+  n_dirs = 0;
+  free(cached_path);
+  cached_path = NULL;
+  /* Closing the instance removes all of its watches */
+  if (inotify_fd != -1) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+}
+
+/*
+ * Splits path into PATH directories, all of which still have to be read.
+ */
+static void split_path(const char *path) {
+  cached_path = strdup(path);
+
+  int max_dirs = 1;
+  for (const char *c = path; *c != '\0'; c++) {
+    if (*c == ':') {
+      max_dirs++;
+    }
+  }
+  dirs = handled_malloc(sizeof(struct IndexDir) * max_dirs);
+
+  const char *start = path;
+  while (1) {
+    const char *end = strchr(start, ':');
+    int len = end != NULL ? end - start : (int)strlen(start);
+    if (len > 0) {
+      struct IndexDir *dir = &dirs[n_dirs++];
+      memset(dir, 0, sizeof(struct IndexDir));
+      dir->path = strndup(start, len);
+      dir->wd = -1;
+      dir->stale = 1;
+    }
+    if (end == NULL) {
+      break;
+    }
+    start = end + 1;
+  }
+
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+}
+
+/*
+ * Appends the NUL terminated name to the names in *pool.
+ */
+static void append_name(char **pool, size_t *len, size_t *size,
+                        const char *name) {
+  size_t name_len = strlen(name) + 1;
+  if (*len + name_len > *size) {
+    *size = 2 * (*len + name_len);
+    *pool = handled_realloc(*pool, *size);
+  }
+  memcpy(*pool + *len, name, name_len);
+  *len += name_len;
+}
+
+static void add_name(struct IndexDir *dir, const char *name) {
+  append_name(&dir->names, &dir->names_len, &dir->names_size, name);
+  dir->n_names++;
+}
+
+static void add_pending(struct IndexDir *dir, const char *name) {
+  if (dir->n_pending == MAX_PENDING) {
+    dir->stale = 1;
+    return;
+  }
+  append_name(&dir->pending, &dir->pending_len, &dir->pending_size, name);
+  dir->n_pending++;
+}
+
+/*
+ * Collects the names inotify reported changes for. Directories whose changes
+ * can not be told by name, e.g. because they were removed, are marked stale.
+ */
+static void read_events() {
+  char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(inotify_fd, buffer, sizeof buffer)) > 0) {
+    const struct inotify_event *event;
+    for (char *p = buffer; p < buffer + n;
+         p += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event *)p;
+      for (int i = 0; i < n_dirs; i++) {
+        /* The same directory may appear more than once in PATH */
+        if (dirs[i].wd != event->wd && !(event->mask & IN_Q_OVERFLOW)) {
+          continue;
+        }
+        if (event->len > 0 && !(event->mask & IN_Q_OVERFLOW)) {
+          add_pending(&dirs[i], event->name);
+        } else {
+          dirs[i].stale = 1;
+        }
+        if (event->mask & IN_IGNORED) {
+          dirs[i].wd = -1;
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Marks the directories that are not watched as stale if their modification
+ * time has changed since they were read, e.g. because they have been created.
+ */
+static void check_unwatched() {
+  for (int i = 0; i < n_dirs; i++) {
+    struct IndexDir *dir = &dirs[i];
+    if (dir->wd != -1 || dir->stale) {
+      continue;
+    }
+    struct stat st;
+    if (stat(dir->path, &st) == -1) {
+      st.st_mtim.tv_sec = 0;
+      st.st_mtim.tv_nsec = 0;
+    }
+    dir->stale = st.st_mtim.tv_sec != dir->mtime.tv_sec ||
+                 st.st_mtim.tv_nsec != dir->mtime.tv_nsec;
+  }
+}
+
+/*
+ * Reads the names of the executable files in dir.
+ */
+static void read_dir(struct IndexDir *dir) {
+  dir->stale = 0;
+  dir->names_len = 0;
+  dir->n_names = 0;
+  dir->pending_len = 0;
+  dir->n_pending = 0;
+
+  /* Watch before reading, so that no change after the reading is missed */
+  if (inotify_fd != -1 && dir->wd == -1) {
+    dir->wd = inotify_add_watch(inotify_fd, dir->path, WATCH_EVENTS);
+  }
+  struct stat st;
+  if (stat(dir->path, &st) == -1) {
+    dir->mtime.tv_sec = 0;
+    dir->mtime.tv_nsec = 0;
+    return;
+  }
+  dir->mtime = st.st_mtim;
+
+  int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+  DIR *stream = fdopendir(fd);
+  if (stream == NULL) {
+    close(fd);
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(stream)) != NULL) {
+    const char *name = entry->d_name;
+    if (name[0] == '.' &&
+        (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+      continue;
+    }
+    /* Symbolic links and unknown types have to be resolved with a stat */
+    if (entry->d_type != DT_REG && entry->d_type != DT_LNK &&
+        entry->d_type != DT_UNKNOWN) {
+      continue;
+    }
+    if (fstatat(fd, name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+        (st.st_mode & 0111) != 0) {
+      add_name(dir, name);
+    }
+  }
+  closedir(stream);
+}
+
+static void remove_name(struct IndexDir *dir, const char *name) {
+  size_t len = strlen(name) + 1;
+  char *end = dir->names + dir->names_len;
+  for (char *p = dir->names; p < end; p += strlen(p) + 1) {
+    if (memcmp(p, name, len) == 0) {
+      memmove(p, p + len, end - p - len);
+      dir->names_len -= len;
+      dir->n_names--;
+      return;
+    }
+  }
+}
+
+/*
+ * Checks the pending names of dir, removing those that are no executables
+ * (anymore) and adding the new ones.
+ */
+static void update_dir(struct IndexDir *dir) {
+  int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  const char *name = dir->pending;
+  for (int i = 0; i < dir->n_pending; i++) {
+    remove_name(dir, name);
+    struct stat st;
+    if (fd != -1 && fstatat(fd, name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+        (st.st_mode & 0111) != 0) {
+      add_name(dir, name);
+    }
+    name += strlen(name) + 1;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  dir->pending_len = 0;
+  dir->n_pending = 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*
+ * Rebuilds the sorted index from the built-ins and the names of all
+ * directories, dropping duplicates.
+ */
+static void build_index() {
+  int n = 0;
+  while (builtin_name(n) != NULL) {
+    n++;
+  }
+  for (int i = 0; i < n_dirs; i++) {
+    n += dirs[i].n_names;
+  }
+  if (n > max_index_names) {
+    max_index_names = n;
+    index_names =
+        handled_realloc(index_names, sizeof(const char *) * max_index_names);
+  }
+
+  n = 0;
+  const char *name;
+  while ((name = builtin_name(n)) != NULL) {
+    index_names[n++] = name;
+  }
+  for (int i = 0; i < n_dirs; i++) {
+    name = dirs[i].names;
+    for (int j = 0; j < dirs[i].n_names; j++) {
+      index_names[n++] = name;
+      name += strlen(name) + 1;
+    }
+  }
+  qsort(index_names, n, sizeof(const char *), compare_names);
+
+  n_index_names = 0;
+  for (int i = 0; i < n; i++) {
+    if (n_index_names == 0 ||
+        strcmp(index_names[n_index_names - 1], index_names[i]) != 0) {
+      index_names[n_index_names++] = index_names[i];
+    }
+  }
+}
+
+/*
+ * Brings the index up to date with PATH and the contents of its directories.
+ */
+static void refresh_index() {
+  const char *path = get_variable("PATH");
+  if (path == NULL) {
+    path = "";
+  }
+  int changed = 0;
+  if (cached_path == NULL || strcmp(cached_path, path) != 0) {
+    free_dirs();
+    split_path(path);
+    changed = 1;
+  }
+  if (inotify_fd != -1) {
+    read_events();
+  }
+  check_unwatched();
+
+  for (int i = 0; i < n_dirs; i++) {
+    if (dirs[i].stale) {
+      read_dir(&dirs[i]);
+      changed = 1;
+    } else if (dirs[i].n_pending > 0) {
+      update_dir(&dirs[i]);
+      changed = 1;
+    }
+  }
+  if (changed) {
+    build_index();
+  }
+}
+
+int completes_command(const char *line, int start) {
+  static const char *keywords[] = {"do",   "elif",  "else",  "if", "then",
+                                   "time", "until", "while", NULL};
+
+  int end = start;
+  while (end > 0 && (line[end - 1] == ' ' || line[end - 1] == '\t')) {
+    end--;
+  }
+  if (end == 0 || strchr("|;&", line[end - 1]) != NULL) {
+    return 1;
+  }
+
+  int begin = end;
+  while (begin > 0 && strchr(" \t|;&", line[begin - 1]) == NULL) {
+    begin--;
+  }
+  for (int i = 0; keywords[i] != NULL; i++) {
+    if ((int)strlen(keywords[i]) == end - begin &&
+        strncmp(line + begin, keywords[i], end - begin) == 0) {
+      return completes_command(line, begin);
+    }
+  }
+  return 0;
+}
+
+char *complete_command(const char *prefix, int state) {
+  static int next;
+  static size_t prefix_len;
+
+  if (state == 0) {
+    refresh_index();
+    prefix_len = strlen(prefix);
+    /* The names starting with prefix follow the first one not less than it */
+    int low = 0, high = n_index_names;
+    while (low < high) {
+      int mid = low + (high - low) / 2;
+      if (strcmp(index_names[mid], prefix) < 0) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    next = low;
+  }
+
+  if (next < n_index_names &&
+      strncmp(index_names[next], prefix, prefix_len) == 0) {
+    return strdup(index_names[next++]);
+  }
+  return NULL;
+}
@@ -0,0 +1,46 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_COMPLETION_H_
+#define PSH_COMPLETION_H_
+
+/*
+ * Returns whether the word starting at offset start of line is in the
+ * position of a command name, i.e. it is the first word of the line or follows
+ * |, ; or &, or a keyword like then or do that is in that position itself.
+ */
+int completes_command(const char *line, int start);
+
+/*
+ * Generates the names of the executables in the PATH directories and of the
+ * built-ins that start with prefix, in the order of strcmp and without
+ * duplicates. Follows the convention of readline's completion generators:
+ * state is 0 on the first call for a prefix and the function is called again
+ * until it returns NULL. Each name is returned as a copy the caller frees.
+ *
+ * The names are kept in a sorted index, so generating the matches costs a
+ * binary search plus the matches themselves. The index is refreshed on the
+ * first call for a prefix: it is rebuilt when PATH has changed, and otherwise
+ * only the files inotify reported as changed are checked again. Directories
+ * that can not be watched are read again when their modification time
+ * changes.
+ */
+char *complete_command(const char *prefix, int state);
+
+#endif /* PSH_COMPLETION_H_ */
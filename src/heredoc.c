@@ -0,0 +1,144 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "heredoc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/*
+ * Holds a here-document whose body is being read, and the arena the body is
+ * stored in once it is complete.
+ */
+struct PendingHeredoc {
+  struct Redirect *redirect;
+  struct Arena *arena;
+};
+
+/* The queued here-documents, in the order their bodies follow */
+static struct PendingHeredoc *pending = NULL;
+static int n_pending = 0;
+static int pending_size = 0;
+static int first_pending = 0;
+
+/* The lines read so far for the first queued here-document */
+static char *body = NULL;
+static size_t body_len = 0;
+static size_t body_size = 0;
+
+int expect_heredocs(struct ParsedInput *parsed_input) {
+  int n = 0;
+  for (int i = 0; i < parsed_input->len; i++) {
+    struct Command *command = &parsed_input->commands[i];
+    for (int j = 0; j < command->n_redirects; j++) {
+      if (command->redirects[j].type != REDIRECT_HEREDOC) {
+        continue;
+      }
+      if (n_pending == pending_size) {
+        pending_size = pending_size == 0 ? 4 : 2 * pending_size;
+        pending = handled_realloc(
+            pending, sizeof(struct PendingHeredoc) * pending_size);
+      }
+      pending[n_pending++] = (struct PendingHeredoc){&command->redirects[j],
+                                                     parsed_input->arena};
+      n++;
+    }
+  }
+  return n;
+}
+
+int heredoc_pending() { return first_pending < n_pending; }
+
+int read_heredoc_line(const char *line) {
+  struct PendingHeredoc *heredoc = &pending[first_pending];
+  if (strcmp(line, heredoc->redirect->target) == 0) {
+    heredoc->redirect->body =
+        arena_strndup(heredoc->arena, body != NULL ? body : "", body_len);
+    body_len = 0;
+    first_pending++;
+    if (first_pending == n_pending) {
+      discard_heredocs();
+      return 0;
+    }
+    return 1;
+  }
+
+  size_t len = strlen(line);
+  if (body_len + len + 1 > body_size) {
+    body_size = 2 * (body_len + len + 1);
+    body = handled_realloc(body, body_size);
+  }
+  memcpy(body + body_len, line, len);
+  body_len += len;
+  body[body_len++] = '\n';
+  return 1;
+}
+
+void discard_heredocs() {
+  n_pending = 0;
+  first_pending = 0;
+  body_len = 0;
+}
+
+/*
+ * Writes the len bytes at data to fd. Returns 0 on success and -1 otherwise.
+ */
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n == -1 && errno != EINTR) {
+      return -1;
+    }
+    if (n > 0) {
+      data += n;
+      len -= n;
+    }
+  }
+  return 0;
+}
+
+int open_heredoc(const struct Redirect *redirect) {
+  int fd = memfd_create("psh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1) {
+    return -1;
+  }
+
+  /* A here-string is its word and a newline, a here-document that has no
+   * body is empty
+   */
+  const char *data = redirect->type == REDIRECT_HERESTRING ? redirect->target
+                     : redirect->body != NULL              ? redirect->body
+                                                           : "";
+  if (write_all(fd, data, strlen(data)) == -1 ||
+      (redirect->type == REDIRECT_HERESTRING && write_all(fd, "\n", 1) == -1) ||
+      fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+      lseek(fd, 0, SEEK_SET) == -1) {
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  return fd;
+}
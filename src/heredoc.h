@@ -0,0 +1,68 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_HEREDOC_H_
+#define PSH_HEREDOC_H_
+
+#include "parser.h"
+
+/*
+ * The body of a here-document is read from the lines that follow the line of
+ * its << redirection, up to a line that consists of the delimiter only, and
+ * stored in the redirection. Each time the command runs, its input is written
+ * to a sealed memfd that the command gets as the redirected descriptor. Unlike
+ * a temporary file this does no file system I/O, and unlike a pipe fed by the
+ * shell or a helper process the input can be of any size without anybody
+ * blocking on it.
+ */
+
+/*
+ * Queues the here-documents of parsed_input, whose bodies are then read by
+ * read_heredoc_line() and stored in the arena of parsed_input, which must stay
+ * alive until they are complete. Returns the number of queued here-documents.
+ */
+int expect_heredocs(struct ParsedInput *parsed_input);
+
+/*
+ * Returns whether here-documents are queued, i.e. whether the following lines
+ * are read as their bodies.
+ */
+int heredoc_pending();
+
+/*
+ * Adds line to the body of the first queued here-document, or completes the
+ * body if line is its delimiter. Returns whether here-documents are still
+ * pending.
+ */
+int read_heredoc_line(const char *line);
+
+/*
+ * Drops the queued here-documents, e.g. when the input they belong to is
+ * discarded.
+ */
+void discard_heredocs();
+
+/*
+ * Returns a memfd holding the input of redirect, a REDIRECT_HEREDOC or
+ * REDIRECT_HERESTRING, positioned at its start. The memfd is close-on-exec and
+ * sealed against any change. Returns -1 and sets errno on failure.
+ */
+int open_heredoc(const struct Redirect *redirect);
+
+#endif /* PSH_HEREDOC_H_ */
@@ -0,0 +1,491 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "history.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/* Number of bits of the Bloom filter of an index block. */
+#define BLOOM_BITS 2048
+
+/* Identifies index files of the layout below. */
+#define INDEX_MAGIC "pshidx01"
+
+/*
+ * Starts the index file. Index files written with other parameters are
+ * rebuilt.
+ */
+struct IndexHeader {
+  char magic[8];
+  uint32_t block_size;
+  uint32_t bloom_bits;
+};
+
+/*
+ * Describes one block of entries of the history file. Follows the header in
+ * the index file, in the order of the history file.
+ */
+struct IndexBlock {
+  uint64_t offset;                 /* Offset of the first entry. */
+  uint64_t first_entry;            /* Number of entries before the block. */
+  uint32_t len;                    /* Number of bytes including newlines. */
+  uint32_t n_entries;              /* Number of entries in the block. */
+  uint64_t bloom[BLOOM_BITS / 64]; /* Trigrams of the entries. */
+};
+
+static const struct IndexHeader expected_header = {
+    INDEX_MAGIC, HISTORY_BLOCK_SIZE, BLOOM_BITS};
+
+static int history_fd = -1;
+static const char *history_map = NULL;
+static size_t history_mapped = 0;
+/* Size of the history file when it was last mapped */
+static size_t history_size = 0;
+
+static int index_fd = -1;
+static const char *index_map = NULL;
+static size_t index_mapped = 0;
+static const struct IndexBlock *blocks = NULL;
+static size_t n_blocks = 0;
+/* End of the last block and number of entries before it */
+static size_t indexed_end = 0;
+static long long indexed_entries = 0;
+
+/*
+ * Replaces the mapping map of *mapped bytes by a mapping of the first size
+ * bytes of fd. Returns the new mapping, or NULL if size is 0 or mapping fails.
+ */
+static const char *remap(int fd, const char *map, size_t *mapped,
+                         size_t size) {
+  if (map != NULL && size == *mapped) {
+    return map;
+  }
+  if (map != NULL) {
+    munmap((void *)map, *mapped);
+  }
+  *mapped = 0;
+  if (size == 0) {
+    return NULL;
+  }
+  void *new_map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (new_map == MAP_FAILED) {
+    return NULL;
+  }
+  *mapped = size;
+  return new_map;
+}
+
+/*
+ * Maps the history file as far as it has been written, including entries
+ * appended by other shells.
+ */
+static void map_history() {
+  struct stat st;
+  if (history_fd == -1 || fstat(history_fd, &st) == -1) {
+    history_size = 0;
+    return;
+  }
+  history_map = remap(history_fd, history_map, &history_mapped, st.st_size);
+  history_size = history_map != NULL ? history_mapped : 0;
+}
+
+static size_t count_newlines(const char *start, const char *end) {
+  size_t n = 0;
+  while (start < end && (start = memchr(start, '\n', end - start)) != NULL) {
+    n++;
+    start++;
+  }
+  return n;
+}
+
+static uint32_t hash_trigram(const char *trigram) {
+  const unsigned char *bytes = (const unsigned char *)trigram;
+  uint32_t value =
+      bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16;
+  return value * 0x9e3779b1u;
+}
+
+/*
+ * Sets the two bits of the trigram in bloom.
+ */
+static void add_trigram(uint64_t *bloom, const char *trigram) {
+  uint32_t hash = hash_trigram(trigram);
+  uint32_t bit1 = hash >> 21;
+  uint32_t bit2 = (hash >> 10) & (BLOOM_BITS - 1);
+  bloom[bit1 / 64] |= (uint64_t)1 << (bit1 % 64);
+  bloom[bit2 / 64] |= (uint64_t)1 << (bit2 % 64);
+}
+
+/*
+ * Fills in the block of entries from offset to the newline at end.
+ */
+static void index_block(struct IndexBlock *block, size_t offset,
+                        const char *end, long long first_entry) {
+  memset(block, 0, sizeof(struct IndexBlock));
+  block->offset = offset;
+  block->first_entry = first_entry;
+  block->len = end + 1 - (history_map + offset);
+
+  const char *entry = history_map + offset;
+  while (entry <= end) {
+    const char *entry_end = memchr(entry, '\n', end + 1 - entry);
+    for (const char *c = entry; c + 3 <= entry_end; c++) {
+      add_trigram(block->bloom, c);
+    }
+    block->n_entries++;
+    entry = entry_end + 1;
+  }
+}
+
+static void unmap_index() {
+  if (index_map != NULL) {
+    munmap((void *)index_map, index_mapped);
+  }
+  index_map = NULL;
+  index_mapped = 0;
+  blocks = NULL;
+  n_blocks = indexed_end = 0;
+  indexed_entries = 0;
+}
+
+/*
+ * Empties the index file, leaving only the header. The lock must be held.
+ * Closes the index if it can not be written, searches scan the whole history
+ * file then.
+ */
+static void reset_index() {
+  unmap_index();
+  if (ftruncate(index_fd, 0) == -1 ||
+      pwrite(index_fd, &expected_header, sizeof expected_header, 0) !=
+          sizeof expected_header) {
+    close(index_fd);
+    index_fd = -1;
+  }
+}
+
+/*
+ * Returns the number of whole blocks in the index file of size bytes, or -1
+ * if the index does not belong to the history file as it is now, e.g. because
+ * the history file has been truncated. The lock must be held.
+ */
+static long long check_index(size_t size) {
+  struct IndexHeader header;
+  if (size < sizeof header ||
+      pread(index_fd, &header, sizeof header, 0) != sizeof header ||
+      memcmp(&header, &expected_header, sizeof header) != 0) {
+    return -1;
+  }
+  long long n = (size - sizeof header) / sizeof(struct IndexBlock);
+  if (n > 0) {
+    struct IndexBlock last;
+    off_t position = sizeof header + (n - 1) * sizeof(struct IndexBlock);
+    if (pread(index_fd, &last, sizeof last, position) != sizeof last ||
+        last.offset + last.len > history_size ||
+        history_map[last.offset + last.len - 1] != '\n') {
+      return -1;
+    }
+  }
+  return n;
+}
+
+/*
+ * Maps the history file and the index, and adds blocks for the entries that
+ * were appended since the index was last updated, by any shell.
+ */
+static void update_index() {
+  map_history();
+  if (index_fd == -1) {
+    return;
+  }
+
+  flock(index_fd, LOCK_EX);
+  struct stat st;
+  long long n = fstat(index_fd, &st) == 0 ? check_index(st.st_size) : -1;
+  if (n == -1) {
+    reset_index();
+    n = 0;
+  }
+  if (index_fd == -1) {
+    return;
+  }
+  size_t size = sizeof(struct IndexHeader) + n * sizeof(struct IndexBlock);
+
+  /* Index the new entries, each block ending with the first entry that
+   * reaches the minimum size
+   */
+  size_t offset = 0;
+  long long entries = 0;
+  if (n > 0) {
+    struct IndexBlock last;
+    pread(index_fd, &last, sizeof last, size - sizeof last);
+    offset = last.offset + last.len;
+    entries = last.first_entry + last.n_entries;
+  }
+  struct IndexBlock *new_blocks = NULL;
+  int n_new = 0, max_new = 0;
+  while (history_size - offset >= HISTORY_BLOCK_SIZE) {
+    const char *end =
+        memchr(history_map + offset + HISTORY_BLOCK_SIZE - 1, '\n',
+               history_size - offset - HISTORY_BLOCK_SIZE + 1);
+    if (end == NULL) {
+      break;
+    }
+    if (n_new == max_new) {
+      max_new = max_new == 0 ? 64 : 2 * max_new;
+      new_blocks =
+          handled_realloc(new_blocks, sizeof(struct IndexBlock) * max_new);
+    }
+    index_block(&new_blocks[n_new], offset, end, entries);
+    offset += new_blocks[n_new].len;
+    entries += new_blocks[n_new].n_entries;
+    n_new++;
+  }
+  if (n_new > 0) {
+    size_t len = sizeof(struct IndexBlock) * n_new;
+    if (pwrite(index_fd, new_blocks, len, size) == (ssize_t)len) {
+      size += len;
+      n += n_new;
+    } else {
+      /* Drop a partially written block, the entries stay unindexed */
+      if (ftruncate(index_fd, size) == -1) {
+        reset_index();
+      }
+    }
+  }
+  free(new_blocks);
+  flock(index_fd, LOCK_UN);
+
+  index_map = remap(index_fd, index_map, &index_mapped, size);
+  if (index_map == NULL) {
+    unmap_index();
+    return;
+  }
+  blocks = (const struct IndexBlock *)(index_map + sizeof(struct IndexHeader));
+  n_blocks = n;
+  indexed_end = n > 0 ? blocks[n - 1].offset + blocks[n - 1].len : 0;
+  indexed_entries = n > 0 ? blocks[n - 1].first_entry + blocks[n - 1].n_entries
+                          : 0;
+}
+
+int open_history(const char *path) {
+  close_history();
+  history_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (history_fd == -1) {
+    return -1;
+  }
+  /* Without an index, searches scan the whole file */
+  size_t index_size = strlen(path) + 5;
+  char *index_path = handled_malloc(index_size);
+  snprintf(index_path, index_size, "%s.idx", path);
+  index_fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  free(index_path);
+  map_history();
+  return 0;
+}
+
+void close_history() {
+  if (history_map != NULL) {
+    munmap((void *)history_map, history_mapped);
+  }
+  unmap_index();
+  if (history_fd != -1) {
+    close(history_fd);
+  }
+  if (index_fd != -1) {
+    close(index_fd);
+  }
+  history_fd = index_fd = -1;
+  history_map = NULL;
+  history_mapped = history_size = 0;
+}
+
+void add_history_entry(const char *line) {
+  if (history_fd == -1 || line[0] == '\0') {
+    return;
+  }
+  /* A single write, so that entries of concurrent shells do not mix */
+  struct iovec parts[] = {{(void *)line, strlen(line)}, {"\n", 1}};
+  if (writev(history_fd, parts, 2) == -1) {
+    perror("psh: history");
+  }
+}
+
+void load_recent_history(int n, void (*add)(const char *line)) {
+  map_history();
+  if (history_size == 0 || n <= 0) {
+    return;
+  }
+  const char *end = history_map + history_size;
+  if (end[-1] == '\n') {
+    end--;
+  }
+  const char *start = end;
+  for (int i = 0; i < n && start > history_map; i++) {
+    const char *newline = memrchr(history_map, '\n', start - 1 - history_map);
+    start = newline != NULL ? newline + 1 : history_map;
+  }
+
+  char *line = NULL;
+  size_t max_len = 0;
+  while (start < end) {
+    const char *entry_end = memchr(start, '\n', end - start);
+    if (entry_end == NULL) {
+      entry_end = end;
+    }
+    size_t len = entry_end - start;
+    if (len + 1 > max_len) {
+      max_len = 2 * (len + 1);
+      line = handled_realloc(line, max_len);
+    }
+    memcpy(line, start, len);
+    line[len] = '\0';
+    add(line);
+    start = entry_end + 1;
+  }
+  free(line);
+}
+
+long long count_history() {
+  update_index();
+  const char *tail = history_map + indexed_end;
+  const char *end = history_map + history_size;
+  long long n = indexed_entries + count_newlines(tail, end);
+  /* An entry another shell is still writing */
+  if (end > tail && end[-1] != '\n') {
+    n++;
+  }
+  return n;
+}
+
+/*
+ * Calls visit with the entries from start to end, the first of which is
+ * number.
+ */
+static void visit_entries(const char *start, const char *end, long long number,
+                          HistoryVisitor visit, void *arg) {
+  while (start < end) {
+    const char *entry_end = memchr(start, '\n', end - start);
+    if (entry_end == NULL) {
+      entry_end = end;
+    }
+    visit(number++, start, entry_end - start, arg);
+    start = entry_end + 1;
+  }
+}
+
+void list_history(long long first, HistoryVisitor visit, void *arg) {
+  update_index();
+  if (first < 1) {
+    first = 1;
+  }
+
+  /* Find the block of entry first, or skip to the unindexed entries */
+  const char *start = history_map + indexed_end;
+  long long number = indexed_entries + 1;
+  if (first <= indexed_entries) {
+    size_t low = 0, high = n_blocks;
+    while (high - low > 1) {
+      size_t mid = low + (high - low) / 2;
+      if ((long long)blocks[mid].first_entry < first) {
+        low = mid;
+      } else {
+        high = mid;
+      }
+    }
+    start = history_map + blocks[low].offset;
+    number = blocks[low].first_entry + 1;
+  }
+  const char *end = history_map + history_size;
+  for (; number < first && start < end; number++) {
+    const char *newline = memchr(start, '\n', end - start);
+    start = newline != NULL ? newline + 1 : end;
+  }
+  visit_entries(start, end, number, visit, arg);
+}
+
+/*
+ * Calls visit with the entries from start to end that contain text, where
+ * start is the beginning of entry number.
+ */
+static void search_entries(const char *start, const char *end,
+                           long long number, const char *text, size_t len,
+                           HistoryVisitor visit, void *arg) {
+  const char *match;
+  while (start < end && (match = memmem(start, end - start, text, len))) {
+    const char *newline = memrchr(start, '\n', match - start);
+    const char *entry = newline != NULL ? newline + 1 : start;
+    number += count_newlines(start, entry);
+    const char *entry_end = memchr(match, '\n', end - match);
+    if (entry_end == NULL) {
+      entry_end = end;
+    }
+    visit(number++, entry, entry_end - entry, arg);
+    start = entry_end + 1;
+  }
+}
+
+void search_history(const char *text, HistoryVisitor visit, void *arg) {
+  size_t len = strlen(text);
+  if (len == 0) {
+    list_history(1, visit, arg);
+    return;
+  }
+  update_index();
+
+  /* Only the words of the filter with bits of the text are compared. Texts
+   * shorter than a trigram set no bits and all blocks are scanned.
+   */
+  uint64_t query[BLOOM_BITS / 64] = {0};
+  for (size_t i = 0; i + 3 <= len; i++) {
+    add_trigram(query, text + i);
+  }
+  int words[BLOOM_BITS / 64];
+  int n_words = 0;
+  for (int j = 0; j < BLOOM_BITS / 64; j++) {
+    if (query[j] != 0) {
+      words[n_words++] = j;
+    }
+  }
+
+  for (size_t i = 0; i < n_blocks; i++) {
+    const struct IndexBlock *block = &blocks[i];
+    int candidate = 1;
+    for (int j = 0; j < n_words && candidate; j++) {
+      candidate = (block->bloom[words[j]] & query[words[j]]) == query[words[j]];
+    }
+    if (candidate) {
+      const char *start = history_map + block->offset;
+      search_entries(start, start + block->len, block->first_entry + 1, text,
+                     len, visit, arg);
+    }
+  }
+  search_entries(history_map + indexed_end, history_map + history_size,
+                 indexed_entries + 1, text, len, visit, arg);
+}
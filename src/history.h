@@ -0,0 +1,87 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_HISTORY_H_
+#define PSH_HISTORY_H_
+
+#include <stddef.h>
+
+/*
+ * Persistent command history. Entries are appended as lines to a history file
+ * that is read through a shared memory mapping, so that neither opening nor
+ * searching it copies the file into memory.
+ *
+ * Searches go through an index kept next to the history file (with .idx
+ * appended to its name). It splits the file into blocks of whole entries of
+ * at least HISTORY_BLOCK_SIZE bytes and records a Bloom filter of the
+ * trigrams of each block, so that a search only scans the blocks that may
+ * contain all trigrams of the text it looks for. The index is brought up to
+ * date with the file lazily, by indexing only the entries appended since, and
+ * is shared by all shells using the same history file.
+ */
+
+/* Minimum number of bytes of the entries covered by one index block. */
+#define HISTORY_BLOCK_SIZE 1024
+
+/*
+ * Called with the number (starting at 1) and text of a history entry, which
+ * is not NUL terminated.
+ */
+typedef void (*HistoryVisitor)(long long number, const char *entry, size_t len,
+                               void *arg);
+
+/*
+ * Opens the history file at path, creating it if it does not exist. Returns 0
+ * on success and -1 if the file can not be opened; entries are not saved
+ * then.
+ */
+int open_history(const char *path);
+
+/*
+ * Closes the history file and its index.
+ */
+void close_history();
+
+/*
+ * Appends line to the history file.
+ */
+void add_history_entry(const char *line);
+
+/*
+ * Calls add with the last n entries of the history file, oldest first. Reads
+ * the file from its end, without bringing the index up to date.
+ */
+void load_recent_history(int n, void (*add)(const char *line));
+
+/*
+ * Returns the number of entries in the history file.
+ */
+long long count_history();
+
+/*
+ * Calls visit with entry first and all entries after it.
+ */
+void list_history(long long first, HistoryVisitor visit, void *arg);
+
+/*
+ * Calls visit with each entry that contains text, oldest first.
+ */
+void search_history(const char *text, HistoryVisitor visit, void *arg);
+
+#endif /* PSH_HISTORY_H_ */
@@ -0,0 +1,376 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "jobs.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "children.h"
+#include "picoshell.h"
+#include "utils.h"
+
+/* List of jobs ordered by id. */
+static struct Job *jobs = NULL;
+
+/* Terminal of the shell and process group of the shell while job control is
+ * enabled, -1 and 0 otherwise.
+ */
+static int terminal_fd = -1;
+static pid_t shell_pgid = 0;
+
+void init_job_control(int interactive) {
+  init_child_events();
+
+  if (!interactive || !isatty(0)) {
+    return;
+  }
+
+  /* Wait until the shell is in the foreground, if it was started in the
+   * background of another shell.
+   */
+  pid_t pgid;
+  while (tcgetpgrp(0) != (pgid = getpgrp())) {
+    kill(-pgid, SIGTTIN);
+  }
+
+  signal(SIGTSTP, SIG_IGN);
+  signal(SIGTTIN, SIG_IGN);
+  signal(SIGTTOU, SIG_IGN);
+
+  /* Fails for a session leader, which has its own group already */
+  setpgid(0, 0);
+  shell_pgid = getpgrp();
+  terminal_fd = fcntl(0, F_DUPFD_CLOEXEC, 10);
+  if (terminal_fd != -1) {
+    tcsetpgrp(terminal_fd, shell_pgid);
+  }
+}
+
+int job_terminal_fd() { return terminal_fd; }
+
+void give_terminal(pid_t pgid) {
+  if (terminal_fd != -1) {
+    tcsetpgrp(terminal_fd, pgid != 0 ? pgid : shell_pgid);
+  }
+}
+
+struct Job *add_job(pid_t pgid, const pid_t *pids, int n, const char *command,
+                    JobState state) {
+  struct Job *job = handled_malloc(sizeof(struct Job));
+  job->pgid = pgid;
+  job->processes = handled_malloc(sizeof(struct JobProcess) * (n > 0 ? n : 1));
+  job->n_processes = 0;
+  for (int i = 0; i < n; i++) {
+    if (pids[i] != 0) {
+      job->processes[job->n_processes++] =
+          (struct JobProcess){.pid = pids[i], .state = state, .status = 0};
+    }
+  }
+  job->command = strdup(command);
+  job->state = state;
+  job->changed = state == JOB_STOPPED;
+  job->next = NULL;
+
+  /* Append with the next id after the highest one in use */
+  struct Job **last = &jobs;
+  int id = 1;
+  while (*last != NULL) {
+    id = (*last)->id + 1;
+    last = &(*last)->next;
+  }
+  job->id = id;
+  *last = job;
+  return job;
+}
+
+static void remove_job(struct Job *job) {
+  for (struct Job **entry = &jobs; *entry != NULL; entry = &(*entry)->next) {
+    if (*entry == job) {
+      *entry = job->next;
+      break;
+    }
+  }
+  free(job->processes);
+  free(job->command);
+  free(job);
+}
+
+static void update_job_state(struct Job *job) {
+  JobState state = JOB_DONE;
+  for (int i = 0; i < job->n_processes; i++) {
+    if (job->processes[i].state == JOB_RUNNING) {
+      state = JOB_RUNNING;
+      break;
+    }
+    if (job->processes[i].state == JOB_STOPPED) {
+      state = JOB_STOPPED;
+    }
+  }
+  if (state != job->state) {
+    job->state = state;
+    job->changed = state != JOB_RUNNING;
+  }
+}
+
+int update_job_process(pid_t pid, int status) {
+  for (struct Job *job = jobs; job != NULL; job = job->next) {
+    for (int i = 0; i < job->n_processes; i++) {
+      struct JobProcess *process = &job->processes[i];
+      if (process->pid != pid) {
+        continue;
+      }
+      if (WIFSTOPPED(status)) {
+        process->state = JOB_STOPPED;
+      } else if (WIFCONTINUED(status)) {
+        process->state = JOB_RUNNING;
+      } else {
+        process->state = JOB_DONE;
+        process->status = decode_status(status);
+      }
+      update_job_state(job);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void reap_jobs() {
+  if (jobs == NULL) {
+    return;
+  }
+  int status;
+  pid_t pid;
+  while ((pid = wait_child(&status, NULL, 0)) > 0) {
+    update_job_process(pid, status);
+  }
+}
+
+/*
+ * Returns the marker of job in listings: + for the current job, i.e. the
+ * most recent one, - for the one before and a space otherwise.
+ */
+static char job_marker(const struct Job *job) {
+  if (job->next == NULL) {
+    return '+';
+  }
+  return job->next->next == NULL ? '-' : ' ';
+}
+
+int job_status(const struct Job *job) {
+  if (job->n_processes == 0) {
+    return 0;
+  }
+  int status = job->processes[job->n_processes - 1].status;
+  if (shell_options.pipefail) {
+    for (int i = job->n_processes - 1; i >= 0; i--) {
+      if (job->processes[i].status != 0) {
+        return job->processes[i].status;
+      }
+    }
+  }
+  return status;
+}
+
+/*
+ * Prints a line describing the state of job, e.g. "[1]+  Done  sleep 1".
+ */
+static void print_job(int fd, const struct Job *job) {
+  char state[32];
+  switch (job->state) {
+    case JOB_RUNNING:
+      strcpy(state, "Running");
+      break;
+    case JOB_STOPPED:
+      strcpy(state, "Stopped");
+      break;
+    case JOB_DONE:
+    default:
+      if (job_status(job) == 0) {
+        strcpy(state, "Done");
+      } else {
+        snprintf(state, sizeof state, "Exit %d", job_status(job));
+      }
+      break;
+  }
+  dprintf(fd, "[%d]%c  %-24s%s%s\n", job->id, job_marker(job), state,
+          job->command, job->state == JOB_RUNNING ? " &" : "");
+}
+
+void notify_jobs() {
+  struct Job *job = jobs;
+  while (job != NULL) {
+    struct Job *next = job->next;
+    if (job->changed) {
+      print_job(2, job);
+      job->changed = 0;
+    }
+    if (job->state == JOB_DONE) {
+      remove_job(job);
+    }
+    job = next;
+  }
+}
+
+void print_jobs(int fd) {
+  struct Job *job = jobs;
+  while (job != NULL) {
+    struct Job *next = job->next;
+    print_job(fd, job);
+    job->changed = 0;
+    if (job->state == JOB_DONE) {
+      remove_job(job);
+    }
+    job = next;
+  }
+}
+
+struct Job *find_job(const char *spec) {
+  if (jobs == NULL) {
+    return NULL;
+  }
+  struct Job *current = jobs;
+  struct Job *previous = NULL;
+  while (current->next != NULL) {
+    previous = current;
+    current = current->next;
+  }
+
+  if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 ||
+      strcmp(spec, "%") == 0) {
+    return current;
+  }
+  if (strcmp(spec, "%-") == 0) {
+    return previous != NULL ? previous : current;
+  }
+
+  char *end;
+  long number = strtol(spec[0] == '%' ? spec + 1 : spec, &end, 10);
+  if (*end != '\0' || end == spec) {
+    return NULL;
+  }
+  for (struct Job *job = jobs; job != NULL; job = job->next) {
+    if (spec[0] == '%' && job->id == number) {
+      return job;
+    }
+    for (int i = 0; spec[0] != '%' && i < job->n_processes; i++) {
+      if (job->processes[i].pid == number) {
+        return job;
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Blocks until no process of job is running any more, i.e. until the job is
+ * done or stopped.
+ */
+static void wait_for_job(struct Job *job) {
+  while (job->state == JOB_RUNNING) {
+    int status;
+    pid_t pid = wait_child(&status, NULL, -1);
+    if (pid == -1) {
+      /* None of the processes is watched any more */
+      for (int i = 0; i < job->n_processes; i++) {
+        job->processes[i].state = JOB_DONE;
+      }
+      update_job_state(job);
+      break;
+    }
+    update_job_process(pid, status);
+  }
+}
+
+int continue_job(struct Job *job, int foreground) {
+  if (job->state == JOB_DONE) {
+    int status = job_status(job);
+    remove_job(job);
+    return status;
+  }
+
+  for (int i = 0; i < job->n_processes; i++) {
+    if (job->processes[i].state == JOB_STOPPED) {
+      job->processes[i].state = JOB_RUNNING;
+    }
+  }
+  job->state = JOB_RUNNING;
+  job->changed = 0;
+
+  if (!foreground) {
+    fprintf(stderr, "[%d]%c %s &\n", job->id, job_marker(job), job->command);
+  } else {
+    fprintf(stderr, "%s\n", job->command);
+    give_terminal(job->pgid);
+  }
+
+  /* Without job control there is no process group to signal */
+  if (job->pgid != 0) {
+    kill(-job->pgid, SIGCONT);
+  } else {
+    for (int i = 0; i < job->n_processes; i++) {
+      kill(job->processes[i].pid, SIGCONT);
+    }
+  }
+  if (!foreground) {
+    return 0;
+  }
+
+  wait_for_job(job);
+  give_terminal(0);
+  if (job->state == JOB_STOPPED) {
+    fprintf(stderr, "\n");
+    print_job(2, job);
+    job->changed = 0;
+    return 128 + SIGTSTP;
+  }
+  int status = job_status(job);
+  if (status == 128 + SIGINT) {
+    fprintf(stderr, "\n");
+  }
+  remove_job(job);
+  return status;
+}
+
+int wait_job(struct Job *job) {
+  if (job != NULL) {
+    wait_for_job(job);
+    int status = job_status(job);
+    if (job->state == JOB_DONE) {
+      remove_job(job);
+    }
+    return status;
+  }
+
+  job = jobs;
+  while (job != NULL) {
+    struct Job *next = job->next;
+    wait_for_job(job);
+    if (job->state == JOB_DONE) {
+      remove_job(job);
+    }
+    job = next;
+  }
+  return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_JOBS_H_
+#define PSH_JOBS_H_
+
+#include <sys/types.h>
+
+/*
+ * Enum of the states of a job and of the processes it consists of.
+ */
+typedef enum {
+  JOB_RUNNING,
+  JOB_STOPPED,
+  JOB_DONE,
+} JobState;
+
+/*
+ * Holds a single process of a job.
+ */
+struct JobProcess {
+  pid_t pid;
+  JobState state;
+  int status; /* Exit status once the process is done. */
+};
+
+/*
+ * Holds a pipeline that runs in the background or has been stopped. Jobs are
+ * kept in a list ordered by id.
+ */
+struct Job {
+  int id;                        /* Job number, as in %1. */
+  pid_t pgid;                    /* Process group of the job, or 0 without
+                                    job control. */
+  int n_processes;               /* Number of processes of the job. */
+  struct JobProcess *processes;  /* The processes of the pipeline in order. */
+  char *command;                 /* Command line of the job for listings. */
+  JobState state;                /* Running if any process runs, stopped if
+                                    any is stopped, done otherwise. */
+  int changed;                   /* Whether the state changed since it was
+                                    last reported. */
+  struct Job *next;
+};
+
+/*
+ * Sets up the event loop for children, see children.h. If interactive is set
+ * and stdin is a terminal, also enables job control: the shell moves into its
+ * own process group, takes the terminal and ignores the job control signals,
+ * and pipelines run in process groups of their own.
+ */
+void init_job_control(int interactive);
+
+/*
+ * Returns the file descriptor of the terminal the shell controls, or -1 if
+ * job control is disabled.
+ */
+int job_terminal_fd();
+
+/*
+ * Makes pgid the foreground process group of the terminal, or the shell's own
+ * group if pgid is 0. Does nothing if job control is disabled.
+ */
+void give_terminal(pid_t pgid);
+
+/*
+ * Adds a job for the given processes of a pipeline, n of them, in state.
+ * Entries of pids that are 0 belong to stages that did not run as a process
+ * and are left out. Returns the new job.
+ */
+struct Job *add_job(pid_t pgid, const pid_t *pids, int n, const char *command,
+                    JobState state);
+
+/*
+ * Records the status of a process as returned by waitpid. Returns 1 if the
+ * process belongs to a job and 0 otherwise.
+ */
+int update_job_process(pid_t pid, int status);
+
+/*
+ * Records the state changes of the children of all jobs since the last call,
+ * without blocking. Does nothing if there are no jobs.
+ */
+void reap_jobs();
+
+/*
+ * Reports jobs that are done or stopped since they were last reported to
+ * stderr, and removes the jobs that are done.
+ */
+void notify_jobs();
+
+/*
+ * Returns the job given by spec, which is %n, %%, %+, %- or a pid of one of
+ * its processes, or the current job if spec is NULL. Returns NULL if there is
+ * no such job.
+ */
+struct Job *find_job(const char *spec);
+
+/*
+ * Returns the exit status of a job that is done: that of its last process,
+ * or with pipefail that of its last failed process.
+ */
+int job_status(const struct Job *job);
+
+/*
+ * Continues a stopped job, in the foreground or in the background. In the
+ * foreground, waits until the job is done or stopped again and returns its
+ * exit status. Returns 0 in the background.
+ */
+int continue_job(struct Job *job, int foreground);
+
+/*
+ * Waits until job is done or stopped, or until all jobs are if job is NULL,
+ * and removes the jobs that are done. Returns the exit status of the job, or 0
+ * for all jobs.
+ */
+int wait_job(struct Job *job);
+
+/*
+ * Lists all jobs with their state on fd and removes those that are done.
+ */
+void print_jobs(int fd);
+
+#endif /* PSH_JOBS_H_ */
@@ -0,0 +1,374 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "parallel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "children.h"
+#include "jobs.h"
+#include "picoshell.h"
+#include "reader.h"
+#include "spawn.h"
+#include "utils.h"
+#include "vars.h"
+
+/*
+ * Holds one of the job slots of parallel. The memory files of a slot are
+ * created once and reused by all commands that run in it.
+ */
+struct ParallelSlot {
+  pid_t pid;  /* Command running in the slot, or 0 if the slot is free. */
+  int out_fd; /* Memory file collecting the stdout of the command. */
+  int err_fd; /* Memory file collecting the stderr of the command. */
+};
+
+/*
+ * Holds what is shared by all commands started by one parallel invocation.
+ */
+struct ParallelRun {
+  char **template;               /* Command and arguments, NULL terminated. */
+  int template_len;              /* Number of tokens of the template. */
+  int has_placeholder;           /* Whether a token of template contains {}. */
+  const struct Builtin *builtin; /* Built-in the command names, or NULL. */
+  char *resolved;                /* Resolved path of an external command. */
+  int null_fd;                   /* /dev/null, the stdin of all commands. */
+  struct BuiltinIO *io;          /* Where the output is copied to. */
+  struct ParallelSlot *slots;
+  int n_slots;
+  int n_running;
+  int n_failed;
+};
+
+/*
+ * Copies the output collected in the memory file fd to out and empties fd
+ * for the next command of the slot.
+ */
+static void flush_output(int fd, int out) {
+  off_t len = lseek(fd, 0, SEEK_CUR);
+  off_t offset = 0;
+  while (offset < len) {
+    ssize_t n = sendfile(out, fd, &offset, len - offset);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1 && errno == EINVAL) {
+      /* out does not support sendfile, e.g. a file opened with O_APPEND */
+      char buffer[4096];
+      n = pread(fd, buffer, sizeof buffer, offset);
+      if (n > 0 && write(out, buffer, n) == n) {
+        offset += n;
+        continue;
+      }
+    }
+    if (n <= 0) {
+      break;
+    }
+  }
+  ftruncate(fd, 0);
+  lseek(fd, 0, SEEK_SET);
+}
+
+/*
+ * Returns the argv for item, allocated from arena: the template with every
+ * {} replaced by item, or with item appended if the template has no {}.
+ */
+static char **expand_template(struct ParallelRun *run, const char *item,
+                              struct Arena *arena) {
+  char **argv = arena_alloc(arena, sizeof(char *) * (run->template_len + 2));
+  size_t item_len = strlen(item);
+  for (int i = 0; i < run->template_len; i++) {
+    const char *token = run->template[i];
+    if (strstr(token, "{}") == NULL) {
+      argv[i] = run->template[i];
+      continue;
+    }
+
+    /* Each {} grows the token by item_len - 2 characters */
+    size_t n_placeholders = 0;
+    for (const char *p = token; (p = strstr(p, "{}")) != NULL; p += 2) {
+      n_placeholders++;
+    }
+    char *expanded = arena_alloc(
+        arena, strlen(token) + n_placeholders * item_len + 1);
+    char *end = expanded;
+    const char *p = token;
+    const char *placeholder;
+    while ((placeholder = strstr(p, "{}")) != NULL) {
+      memcpy(end, p, placeholder - p);
+      end += placeholder - p;
+      memcpy(end, item, item_len);
+      end += item_len;
+      p = placeholder + 2;
+    }
+    strcpy(end, p);
+    argv[i] = expanded;
+  }
+
+  int len = run->template_len;
+  if (!run->has_placeholder) {
+    argv[len++] = arena_strndup(arena, item, item_len);
+  }
+  argv[len] = NULL;
+  return argv;
+}
+
+/*
+ * Starts the command for item in slot. Returns 0 on success and -1 if the
+ * command could not be started.
+ */
+static int start_command(struct ParallelRun *run, struct ParallelSlot *slot,
+                         const char *item) {
+  struct Arena *arena = new_arena(256);
+  char **argv = expand_template(run, item, arena);
+
+  /* A command name that contains {} is resolved per item */
+  char *resolved = run->resolved;
+  const struct Builtin *builtin = run->builtin;
+  if (run->builtin == NULL && run->resolved == NULL) {
+    builtin = find_builtin(argv[0]);
+    resolved = builtin == NULL ? resolve_path(argv[0]) : NULL;
+    if (builtin == NULL && resolved == NULL) {
+      dprintf(run->io->err, "parallel: %s: command not found\n", argv[0]);
+      free_arena(arena);
+      return -1;
+    }
+  }
+
+  pid_t pid;
+  if (builtin != NULL) {
+    /* Built-ins run in a child, like the other commands */
+    pid = fork();
+    if (pid == 0) {
+      struct BuiltinIO io = {run->null_fd, slot->out_fd, slot->err_fd};
+      int argc = 0;
+      while (argv[argc] != NULL) {
+        argc++;
+      }
+      _exit(run_builtin(builtin, argc, argv, &io));
+    }
+  } else {
+    struct SpawnFileActions actions;
+    init_spawn_file_actions(&actions);
+    add_dup2_action(&actions, run->null_fd, 0);
+    add_dup2_action(&actions, slot->out_fd, 1);
+    add_dup2_action(&actions, slot->err_fd, 2);
+    pid = spawn_process(shell_spawn_backend(), resolved, argv,
+                        variables_envp(), &actions);
+    free_spawn_file_actions(&actions);
+  }
+
+  if (pid == -1) {
+    dprintf(run->io->err, "parallel: %s: %s\n", argv[0], strerror(errno));
+  }
+  if (resolved != run->resolved) {
+    free(resolved);
+  }
+  free_arena(arena);
+  if (pid == -1) {
+    return -1;
+  }
+  watch_child(pid);
+  slot->pid = pid;
+  run->n_running++;
+  return 0;
+}
+
+/*
+ * Waits until one of the commands finishes, writes out its output and frees
+ * its slot. Commands that stop or continue keep their slot. Children that do
+ * not belong to this run are passed on to the job table.
+ */
+static void finish_command(struct ParallelRun *run) {
+  while (1) {
+    int status;
+    pid_t pid = wait_child(&status, NULL, -1);
+    if (pid == -1) {
+      /* no children watched any more */
+      for (int i = 0; i < run->n_slots; i++) {
+        run->slots[i].pid = 0;
+      }
+      run->n_running = 0;
+      return;
+    }
+
+    struct ParallelSlot *slot = NULL;
+    for (int i = 0; i < run->n_slots; i++) {
+      if (run->slots[i].pid == pid) {
+        slot = &run->slots[i];
+      }
+    }
+    if (slot == NULL) {
+      update_job_process(pid, status);
+      continue;
+    }
+    if (WIFSTOPPED(status) || WIFCONTINUED(status)) {
+      /* The commands stop and continue with the job of parallel, only those
+       * that finished free their slot
+       */
+      continue;
+    }
+    flush_output(slot->out_fd, run->io->out);
+    flush_output(slot->err_fd, run->io->err);
+    if (decode_status(status) != 0) {
+      run->n_failed++;
+    }
+    slot->pid = 0;
+    run->n_running--;
+    return;
+  }
+}
+
+/*
+ * Runs the command for item as soon as a slot is free.
+ */
+static void run_item(struct ParallelRun *run, const char *item) {
+  if (run->n_running == run->n_slots) {
+    finish_command(run);
+  }
+  for (int i = 0; i < run->n_slots; i++) {
+    struct ParallelSlot *slot = &run->slots[i];
+    if (slot->pid != 0) {
+      continue;
+    }
+    if (slot->out_fd == -1) {
+      slot->out_fd = memfd_create("parallel-out", MFD_CLOEXEC);
+      slot->err_fd = memfd_create("parallel-err", MFD_CLOEXEC);
+    }
+    if (slot->out_fd == -1 || slot->err_fd == -1 ||
+        start_command(run, slot, item) == -1) {
+      run->n_failed++;
+    }
+    return;
+  }
+}
+
+int builtin_parallel(int argc, char **argv, struct BuiltinIO *io) {
+  long n_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    }
+    char *value = NULL;
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      value = argv[++i];
+    } else if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2] != '\0') {
+      value = argv[i] + 2;
+    }
+    char *end;
+    n_jobs = value != NULL ? strtol(value, &end, 10) : 0;
+    if (value == NULL || *end != '\0' || n_jobs < 1) {
+      dprintf(io->err,
+              "parallel: usage: parallel [-j jobs] command [arguments] "
+              "[::: items]\n");
+      return 255;
+    }
+  }
+  if (n_jobs < 1) {
+    n_jobs = 1;
+  }
+
+  /* The template ends at ::: or with the arguments */
+  int template_start = i;
+  while (i < argc && strcmp(argv[i], ":::") != 0) {
+    i++;
+  }
+  if (i == template_start) {
+    dprintf(io->err, "parallel: no command given\n");
+    return 255;
+  }
+  int items_start = i < argc ? i + 1 : -1;
+
+  struct ParallelRun run = {
+      .template = argv + template_start,
+      .template_len = i - template_start,
+      .io = io,
+      .n_slots = n_jobs,
+  };
+  char *terminator = argv[i];
+  argv[i] = NULL;
+  for (int j = 0; j < run.template_len; j++) {
+    if (strstr(run.template[j], "{}") != NULL) {
+      run.has_placeholder = 1;
+    }
+  }
+
+  /* Look up the command once for all items, unless it depends on them */
+  if (strstr(run.template[0], "{}") == NULL) {
+    run.builtin = find_builtin(run.template[0]);
+    if (run.builtin == NULL) {
+      run.resolved = resolve_path(run.template[0]);
+      if (run.resolved == NULL) {
+        dprintf(io->err, "parallel: %s: command not found\n",
+                run.template[0]);
+        argv[i] = terminator;
+        return 127;
+      }
+    }
+  }
+
+  run.null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  run.slots = handled_malloc(sizeof(struct ParallelSlot) * run.n_slots);
+  for (int j = 0; j < run.n_slots; j++) {
+    run.slots[j] = (struct ParallelSlot){.pid = 0, .out_fd = -1, .err_fd = -1};
+  }
+
+  if (items_start != -1) {
+    for (int j = items_start; j < argc; j++) {
+      run_item(&run, argv[j]);
+    }
+  } else {
+    /* Commands start while the items are still being read */
+    struct LineReader *reader = new_line_reader(io->in);
+    char *line;
+    while ((line = read_line(reader)) != NULL) {
+      run_item(&run, line);
+    }
+    free_line_reader(reader);
+  }
+  while (run.n_running > 0) {
+    finish_command(&run);
+  }
+
+  for (int j = 0; j < run.n_slots; j++) {
+    if (run.slots[j].out_fd != -1) {
+      close(run.slots[j].out_fd);
+    }
+    if (run.slots[j].err_fd != -1) {
+      close(run.slots[j].err_fd);
+    }
+  }
+  free(run.slots);
+  free(run.resolved);
+  close(run.null_fd);
+  argv[i] = terminator;
+
+  return run.n_failed > 100 ? 101 : run.n_failed;
+}
@@ -0,0 +1,43 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_PARALLEL_H_
+#define PSH_PARALLEL_H_
+
+#include "builtins.h"
+
+/*
+ * Implements the parallel built-in:
+ *
+ *   parallel [-j jobs] command [arguments] [::: items]
+ *
+ * Runs command once per item, with {} in the arguments replaced by the item,
+ * or with the item appended if no argument contains {}. Items are the
+ * arguments after ::: or else the lines read from io->in. At most jobs
+ * commands, by default one per online CPU, run at the same time.
+ *
+ * The stdout and stderr of each command are collected in memory files and
+ * written out in one piece when the command finishes, so that the output of
+ * different commands is never interleaved. The path of command is resolved
+ * once for all items. Returns the number of failed commands, or 101 if more
+ * than 100 failed.
+ */
+int builtin_parallel(int argc, char **argv, struct BuiltinIO *io);
+
+#endif /* PSH_PARALLEL_H_ */
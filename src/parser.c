@@ -26,6 +26,164 @@
 
 #include "utils.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+/* Extra bytes reserved in the arena of each ParsedInput, e.g. for the values
+ * of expanded variables.
+ */
+#define PARSED_INPUT_SLACK 256
+
+/*
+ * Returns the number of characters at the start of s, which holds len
+ * characters, before the first character that ends a run of plain word
+ * characters, i.e. a space, a pipe, an ampersand, a double quote or one of the
+ * redirection operators < and >. Returns len if there is none.
+ */
+typedef size_t (*ScanWordFunction)(const char *s, size_t len);
+
+static size_t scan_word_scalar(const char *s, size_t len) {
+  size_t i = 0;
+  while (i < len && s[i] != ' ' && s[i] != '|' && s[i] != '"' &&
+         s[i] != '&' && s[i] != '<' && s[i] != '>') {
+    i++;
+  }
+  return i;
+}
+
+#if defined(__x86_64__)
+/* SSE2 is part of the x86-64 baseline, so this needs no runtime check. < and
+ * > differ only in bit 1, so setting it matches both with one comparison.
+ */
+static size_t scan_word_sse2(const char *s, size_t len) {
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i pipe = _mm_set1_epi8('|');
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i ampersand = _mm_set1_epi8('&');
+  const __m128i angle = _mm_set1_epi8('>');
+  const __m128i bit_1 = _mm_set1_epi8(2);
+
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, pipe)),
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, ampersand)));
+    special = _mm_or_si128(
+        special, _mm_cmpeq_epi8(_mm_or_si128(chunk, bit_1), angle));
+    int mask = _mm_movemask_epi8(special);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + scan_word_scalar(s + i, len - i);
+}
+
+/*
+ * Returns the movemask of the special characters among the 16 at s. Compiled
+ * for AVX2, so that the instructions are VEX encoded like those of
+ * scan_word_avx2(). Legacy SSE instructions after 256-bit ones, e.g. those of
+ * scan_word_sse2(), pay for a transition of the upper register halves.
+ */
+__attribute__((target("avx2"))) static inline int special_mask_vex128(
+    const char *s) {
+  __m128i chunk = _mm_loadu_si128((const __m128i *)s);
+  __m128i special = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')),
+                   _mm_cmpeq_epi8(chunk, _mm_set1_epi8('|'))),
+      _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')),
+                   _mm_cmpeq_epi8(chunk, _mm_set1_epi8('&'))));
+  special = _mm_or_si128(
+      special, _mm_cmpeq_epi8(_mm_or_si128(chunk, _mm_set1_epi8(2)),
+                              _mm_set1_epi8('>')));
+  return _mm_movemask_epi8(special);
+}
+
+__attribute__((target("avx2"))) static size_t scan_word_avx2(const char *s,
+                                                              size_t len) {
+  /* Most tokens are short, so check the first 16 characters on their own
+   * before moving on to 32 at a time.
+   */
+  size_t i = 0;
+  if (len >= 16) {
+    int mask = special_mask_vex128(s);
+    if (mask != 0) {
+      return __builtin_ctz(mask);
+    }
+    i = 16;
+  }
+  if (i + 32 <= len) {
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i pipe = _mm256_set1_epi8('|');
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i ampersand = _mm256_set1_epi8('&');
+    const __m256i angle = _mm256_set1_epi8('>');
+    const __m256i bit_1 = _mm256_set1_epi8(2);
+    for (; i + 32 <= len; i += 32) {
+      __m256i chunk = _mm256_loadu_si256((const __m256i *)(s + i));
+      __m256i special = _mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space),
+                          _mm256_cmpeq_epi8(chunk, pipe)),
+          _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                          _mm256_cmpeq_epi8(chunk, ampersand)));
+      special = _mm256_or_si256(
+          special, _mm256_cmpeq_epi8(_mm256_or_si256(chunk, bit_1), angle));
+      unsigned int mask = _mm256_movemask_epi8(special);
+      if (mask != 0) {
+        return i + __builtin_ctz(mask);
+      }
+    }
+  }
+
+  /* The tail stays in VEX encoded and scalar code, see special_mask_vex128() */
+  if (i + 16 <= len) {
+    int mask = special_mask_vex128(s + i);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+    i += 16;
+  }
+  return i + scan_word_scalar(s + i, len - i);
+}
+#endif
+
+/* Selected on the first call of parse_input() unless set_parser_scanner() has
+ * been called before.
+ */
+static ScanWordFunction scan_word = NULL;
+
+int set_parser_scanner(ParserScanner scanner) {
+  switch (scanner) {
+    case SCANNER_SCALAR:
+      scan_word = scan_word_scalar;
+      return 0;
+#if defined(__x86_64__)
+    case SCANNER_SSE2:
+      scan_word = scan_word_sse2;
+      return 0;
+    case SCANNER_AVX2:
+      __builtin_cpu_init();
+      if (!__builtin_cpu_supports("avx2")) {
+        return -1;
+      }
+      scan_word = scan_word_avx2;
+      return 0;
+    case SCANNER_AUTO:
+      if (set_parser_scanner(SCANNER_AVX2) == 0) {
+        return 0;
+      }
+      return set_parser_scanner(SCANNER_SSE2);
+#else
+    case SCANNER_AUTO:
+      return set_parser_scanner(SCANNER_SCALAR);
+#endif
+    default:
+      return -1;
+  }
+}
+
 char *left_trim(char *ptr) {
   while (isspace(*ptr) && *ptr != '\0') {
     ptr++;
@@ -35,269 +193,412 @@ char *left_trim(char *ptr) {
 
 char *right_trim(char *ptr) {
   int pos = strlen(ptr);
-  while (isspace(ptr[--pos]))
-    ;
-  ptr[pos + 1] = '\0';
+  while (pos > 0 && isspace(ptr[pos - 1])) {
+    pos--;
+  }
+  ptr[pos] = '\0';
   return ptr;
 }
 
 char *trim(char *ptr) { return right_trim(left_trim(ptr)); }
 
-struct Token *new_token() {
-  struct Token *token = handled_malloc(sizeof(struct Token));
-
-  token->buffer = handled_malloc(100 * sizeof(char));
-  token->max_len = 100;
-
-  return token;
-}
+/*
+ * Creates a new ParsedInput with room for the parse of an input of input_len
+ * characters.
+ *
+ * Each token takes at least one input character and is followed by a space,
+ * a pipe, an ampersand or the end of the input, so there are at most
+ * (input_len + 1) / 2 tokens and commands, and the token characters including
+ * their NUL terminators fit into input_len + 1 bytes.
+ */
+struct ParsedInput *new_parsed_input(size_t input_len) {
+  size_t max_tokens = (input_len + 1) / 2 + 1;
+  size_t size = sizeof(struct ParsedInput) +
+                sizeof(struct Command) * max_tokens +
+                sizeof(char *) * 2 * max_tokens + 2 * max_tokens + input_len +
+                1 + PARSED_INPUT_SLACK;
+  struct Arena *arena = new_arena(size);
+
+  struct ParsedInput *parsed_input =
+      arena_alloc(arena, sizeof(struct ParsedInput));
+  parsed_input->arena = arena;
+  parsed_input->len = 0;
+  parsed_input->background = 0;
+  parsed_input->commands =
+      arena_alloc(arena, sizeof(struct Command) * max_tokens);
 
-void resize_token(struct Token *token, int new_max_len) {
-  token->buffer = handled_realloc(token->buffer, sizeof(char) * new_max_len);
-  token->max_len = new_max_len;
+  return parsed_input;
 }
 
-void free_token(struct Token *token) {
-  free(token->buffer);
-  free(token);
+void free_parsed_input(struct ParsedInput *parsed_input) {
+  if (parsed_input != NULL) {
+    /* the ParsedInput itself lives in its arena */
+    free_arena(parsed_input->arena);
+  }
 }
 
-struct Command *new_command() {
-  struct Command *command = handled_malloc(sizeof(struct Command));
-
-  command->tokens = handled_malloc(10 * sizeof(struct Token));
-  command->len = 0;
-  command->max_tokens = 10;
-
-  for (int i = 0; i < 10; i++) {
-    command->tokens[i] = new_token();
+void drop_tokens(struct Command *command, int n) {
+  command->tokens += n;
+  command->len -= n;
+  if (command->quoted != NULL) {
+    command->quoted += n;
   }
-
-  return command;
 }
 
-void resize_command(struct Command *command, int new_max_tokens) {
-  command->tokens =
-      handled_realloc(command->tokens, sizeof(struct Token *) * new_max_tokens);
-
-  for (int i = command->max_tokens; i < new_max_tokens; i++) {
-    command->tokens[i] = new_token();
+struct ParsedInput *copy_parsed_input(const struct ParsedInput *parsed_input) {
+  size_t n_pointers = 0, n_redirects = 0, n_chars = 0;
+  for (int i = 0; i < parsed_input->len; i++) {
+    struct Command *command = &parsed_input->commands[i];
+    n_pointers += command->len + 1;
+    for (int j = 0; j < command->len; j++) {
+      n_chars += strlen(command->tokens[j]) + 1;
+    }
+    n_redirects += command->n_redirects;
+    for (int j = 0; j < command->n_redirects; j++) {
+      n_chars += strlen(command->redirects[j].target) + 1;
+      if (command->redirects[j].body != NULL) {
+        n_chars += strlen(command->redirects[j].body) + 1;
+      }
+    }
   }
 
-  command->max_tokens = new_max_tokens;
-}
-
-void free_command(struct Command *command) {
-  if (command != NULL) {
-    for (int i = 0; i < command->max_tokens; i++) {
-      /* Free all allocated tokens, only the NULL termination is freed where it
-       * is set.
-       */
-      if (command->tokens[i] != NULL) {
-        free_token(command->tokens[i]);
+  /* Each of the six allocations below may be padded for alignment */
+  struct Arena *arena =
+      new_arena(sizeof(struct ParsedInput) +
+                sizeof(struct Command) * parsed_input->len +
+                sizeof(char *) * n_pointers + n_pointers +
+                sizeof(struct Redirect) * n_redirects + n_chars + 6 * 16 +
+                PARSED_INPUT_SLACK);
+  struct ParsedInput *copy = arena_alloc(arena, sizeof(struct ParsedInput));
+  copy->arena = arena;
+  copy->len = parsed_input->len;
+  copy->background = parsed_input->background;
+  copy->commands = arena_alloc(arena, sizeof(struct Command) * copy->len);
+  char **argv = arena_alloc(arena, sizeof(char *) * n_pointers);
+  unsigned char *quoted = arena_alloc(arena, n_pointers);
+  struct Redirect *redirects =
+      arena_alloc(arena, sizeof(struct Redirect) * n_redirects);
+  char *buffer = arena_alloc(arena, n_chars);
+
+  for (int i = 0; i < parsed_input->len; i++) {
+    struct Command *command = &parsed_input->commands[i];
+    copy->commands[i].len = command->len;
+    copy->commands[i].tokens = argv;
+    copy->commands[i].quoted = NULL;
+    if (command->quoted != NULL) {
+      memcpy(quoted, command->quoted, command->len);
+      copy->commands[i].quoted = quoted;
+    }
+    for (int j = 0; j < command->len; j++) {
+      *argv++ = buffer;
+      buffer = stpcpy(buffer, command->tokens[j]) + 1;
+    }
+    *argv++ = NULL;
+    quoted += command->len + 1;
+
+    copy->commands[i].n_redirects = command->n_redirects;
+    copy->commands[i].redirects = redirects;
+    for (int j = 0; j < command->n_redirects; j++) {
+      *redirects = command->redirects[j];
+      redirects->target = buffer;
+      buffer = stpcpy(buffer, command->redirects[j].target) + 1;
+      if (redirects->body != NULL) {
+        redirects->body = buffer;
+        buffer = stpcpy(buffer, command->redirects[j].body) + 1;
       }
+      redirects++;
     }
-    free(command->tokens);
-    free(command);
   }
+  return copy;
 }
 
-struct ParsedInput *new_parsed_input() {
-  struct ParsedInput *parsed_input = handled_malloc(sizeof(struct ParsedInput));
-
-  parsed_input->commands = handled_malloc(sizeof(struct Command *) * 10);
-
-  for (int i = 0; i < 10; i++) {
-    parsed_input->commands[i] = new_command();
+/*
+ * Returns whether the len characters at token are a file descriptor number,
+ * like the 2 in 2>file.
+ */
+static int is_fd_number(const char *token, size_t len) {
+  if (len == 0 || len > 4) {
+    return 0;
   }
-  parsed_input->max_commands = 10;
-  parsed_input->len = 0;
-
-  return parsed_input;
+  for (size_t i = 0; i < len; i++) {
+    if (!isdigit((unsigned char)token[i])) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
-void resize_parsed_input(struct ParsedInput *parsed_input,
-                         int new_max_commands) {
-  parsed_input->commands = handled_realloc(
-      parsed_input->commands, sizeof(struct Command *) * new_max_commands);
-
-  for (int i = parsed_input->max_commands; i < new_max_commands; i++) {
-    parsed_input->commands[i] = new_command();
+/*
+ * Appends a redirection to command and returns it. The redirections of all
+ * commands are stored back to back from *next on, which is allocated with
+ * room for max of them when the first one is added.
+ */
+static struct Redirect *add_redirect(struct ParsedInput *parsed_input,
+                                     struct Command *command,
+                                     struct Redirect **next, size_t max) {
+  if (*next == NULL) {
+    *next = arena_alloc(parsed_input->arena, sizeof(struct Redirect) * max);
   }
-  parsed_input->max_commands = new_max_commands;
+  if (command->n_redirects == 0) {
+    command->redirects = *next;
+  }
+  command->n_redirects++;
+  return (*next)++;
 }
 
-void free_parsed_input(struct ParsedInput *parsed_input) {
-  if (parsed_input != NULL) {
-    for (int i = 0; i < parsed_input->max_commands; i++) {
-      free_command(parsed_input->commands[i]);
+/*
+ * Reads the redirection operator at input[*i], i.e. <, >, >>, <&, >&, << or
+ * <<<, into redirect, for fd or for the default file descriptor of the
+ * operator if fd is -1. Advances *i to the last character of the operator.
+ */
+static void parse_redirect(const char *input, size_t *i, int fd,
+                           struct Redirect *redirect) {
+  char operator = input[*i];
+  RedirectType type = operator == '<' ? REDIRECT_INPUT : REDIRECT_OUTPUT;
+  if (input[*i + 1] == '&') {
+    type = REDIRECT_DUP;
+    (*i)++;
+  } else if (operator == '>' && input[*i + 1] == '>') {
+    type = REDIRECT_APPEND;
+    (*i)++;
+  } else if (operator == '<' && input[*i + 1] == '<') {
+    type = REDIRECT_HEREDOC;
+    (*i)++;
+    if (input[*i + 1] == '<') {
+      type = REDIRECT_HERESTRING;
+      (*i)++;
     }
-    free(parsed_input->commands);
-    free(parsed_input);
   }
+  redirect->type = type;
+  redirect->fd = fd != -1 ? fd : operator == '<' ? 0 : 1;
+  redirect->target = NULL;
+  redirect->quoted = 0;
+  redirect->body = NULL;
 }
 
-struct ParsedInput *parse_input(char *raw_input) {
-  struct ParsedInput *parsed_input = new_parsed_input();
+/*
+ * Starts the command at argv, whose quoted flags start at quoted.
+ */
+static void start_command(struct Command *command, char **argv,
+                          unsigned char *quoted) {
+  command->tokens = argv;
+  command->quoted = quoted;
+  command->len = 0;
+  command->n_redirects = 0;
+  command->redirects = NULL;
+}
 
+struct ParsedInput *parse_input(char *raw_input) {
   /* Ignore all leading and training whitespaces */
   char *input = trim(raw_input);
+  size_t input_len = strlen(input);
+
+  struct ParsedInput *parsed_input = new_parsed_input(input_len);
 
   /* No parsing necessary for empty input string */
-  if (strlen(input) == 0) {
+  if (input_len == 0) {
     return parsed_input;
   }
 
-  char current_char;
-
-  /* Start IN_WORD because we have trimmed, and string can't be empty */
-  ParserState next_state = IN_WORD;
-
-  int n_command = 0;
-  int n_token = 0;
-  int n_token_char = 0;
-
-  /* loop through all chars of the input */
-  for (int i = 0; i <= strlen(input); i++) {
-    /* reallocate larger (double size) buffers if necessary */
-    if (n_command == parsed_input->max_commands - 1) {
-      resize_parsed_input(parsed_input, 2 * parsed_input->max_commands);
-    }
+  /* Token characters are written back to back into buffer, the token pointers
+   * of all commands back to back into argv, each command NULL terminated.
+   */
+  size_t max_tokens = (input_len + 1) / 2 + 1;
+  char **argv =
+      arena_alloc(parsed_input->arena, sizeof(char *) * 2 * max_tokens);
+  char *buffer = arena_alloc(parsed_input->arena, input_len + 1);
+
+  /* quoted holds a flag for each slot of argv, see Command.quoted */
+  char **first_argv = argv;
+  unsigned char *quoted = arena_alloc(parsed_input->arena, 2 * max_tokens);
+
+  /* Each redirection takes at least two characters of the input. target is
+   * the redirection whose file name is being read, if any.
+   */
+  struct Redirect *redirects = NULL;
+  struct Redirect *target = NULL;
+
+  struct Command *command = &parsed_input->commands[0];
+  start_command(command, argv, quoted);
+
+  if (scan_word == NULL) {
+    set_parser_scanner(SCANNER_AUTO);
+  }
 
-    if (n_token == parsed_input->commands[n_command]->max_tokens - 1) {
-      resize_command(parsed_input->commands[n_command],
-                     2 * parsed_input->commands[n_command]->max_tokens);
-    }
+  char current_char;
 
-    if (n_token > -1 &&
-        n_token_char ==
-            parsed_input->commands[n_command]->tokens[n_token]->max_len - 1) {
-      resize_token(
-          parsed_input->commands[n_command]->tokens[n_token],
-          2 * parsed_input->commands[n_command]->tokens[n_token]->max_len);
-    }
+  /* Start in WHITESPACE, the first character starts the first token */
+  ParserState next_state = WHITESPACE;
 
+  /* loop through all chars of the input, including the terminating NUL */
+  for (size_t i = 0; i <= input_len; i++) {
     current_char = input[i];
     switch (next_state) {
-      case IN_WORD:
-        if (current_char == ' ') {
-          /* Terminate current word and switch to WHITESPACE state. */
-          parsed_input->commands[n_command]
-              ->tokens[n_token]
-              ->buffer[n_token_char] = '\0';
-          next_state = WHITESPACE;
-
-        } else if (current_char == '|') {
-          /* Terminate current word */
-          parsed_input->commands[n_command]
-              ->tokens[n_token]
-              ->buffer[n_token_char] = '\0';
-          /* Terminate tokens with NULL pointer, to signify end of command. Need
-           * to free token before overwriting pointer to it.
+      case IN_WORD: {
+        /* Copy the run of plain word characters up to the next character that
+         * changes the state at once.
+         */
+        size_t run = scan_word(input + i, input_len - i);
+        memcpy(buffer, input + i, run);
+        buffer += run;
+        i += run;
+        current_char = input[i];
+
+        if (current_char == '<' || current_char == '>') {
+          /* A number right before the operator is the descriptor it
+           * redirects, as in 2>file.
            */
-          free_token(parsed_input->commands[n_command]->tokens[n_token + 1]);
-          parsed_input->commands[n_command]->tokens[n_token + 1] = NULL;
-          /* Terminate current command */
-          parsed_input->commands[n_command]->len = n_token + 1;
-          n_token = -1;
-          n_command++;
-          /* Switch to PIPE state */
-          next_state = PIPE;
+          int fd = -1;
+          if (target == NULL && !quoted[argv - first_argv - 1] &&
+              is_fd_number(argv[-1], buffer - argv[-1])) {
+            *buffer = '\0';
+            fd = atoi(argv[-1]);
+            buffer = *--argv;
+            command->len--;
+          } else {
+            *buffer++ = '\0';
+          }
+          target = add_redirect(parsed_input, command, &redirects, max_tokens);
+          parse_redirect(input, &i, fd, target);
+          next_state = REDIRECT;
+        } else if (current_char == ' ' || current_char == '|' ||
+                   current_char == '&' || current_char == '\0') {
+          /* Terminate current word */
+          *buffer++ = '\0';
+          target = NULL;
+          if (current_char == ' ') {
+            next_state = WHITESPACE;
+            break;
+          }
+          if (command->len == 0) {
+            /* Only the file name of a redirection has been read */
+            printf("psh: parse error: redirection without a command\n");
+            free_parsed_input(parsed_input);
+            return NULL;
+          }
+          /* Terminate tokens with NULL pointer, to signify end of command. */
+          *argv++ = NULL;
+          parsed_input->len++;
+          if (current_char == '|') {
+            /* Start next command and switch to PIPE state */
+            command = &parsed_input->commands[parsed_input->len];
+            start_command(command, argv, quoted + (argv - first_argv));
+            next_state = PIPE;
+          } else if (current_char == '&') {
+            parsed_input->background = 1;
+            next_state = BACKGROUND;
+          }
         } else if (current_char == '"') {
+          if (target == NULL) {
+            quoted[argv - first_argv - 1] = 1;
+          } else {
+            target->quoted = 1;
+          }
           next_state = IN_WORD_QUOTED;
-        } else if (current_char == '\0') {
-          /* Terminate current word */
-          parsed_input->commands[n_command]
-              ->tokens[n_token]
-              ->buffer[n_token_char] = '\0';
-          /* Terminate tokens with NULL pointer, to signify end of command. Need
-           * to free token before overwriting pointer to it.
-           */
-          free_token(parsed_input->commands[n_command]->tokens[n_token + 1]);
-          parsed_input->commands[n_command]->tokens[n_token + 1] = NULL;
-          /* Terminate current command */
-          parsed_input->commands[n_command]->len = n_token + 1;
-
-        } else {
-          /* For all other chars, append to current word and stay in WORD state
-           */
-          parsed_input->commands[n_command]
-              ->tokens[n_token]
-              ->buffer[n_token_char] = current_char;
-          n_token_char++;
         }
         break;
+      }
+
+      case IN_WORD_QUOTED: {
+        /* Copy everything up to the closing quote at once */
+        const char *quote = memchr(input + i, '"', input_len - i);
+        size_t run =
+            quote != NULL ? (size_t)(quote - input) - i : input_len - i;
+        memcpy(buffer, input + i, run);
+        buffer += run;
+        i += run;
+        current_char = input[i];
 
-      case IN_WORD_QUOTED:
         if (current_char == '"') {
           next_state = IN_WORD;
-        } else if (current_char == '\0') {
+        } else {
+          printf("psh: parse error: unterminated quote\n");
           free_parsed_input(parsed_input);
           return NULL;
-        } else {
-          /* For all other chars append to current word and stay in
-           * IN_WORD_QUOTED state
-           */
-          parsed_input->commands[n_command]
-              ->tokens[n_token]
-              ->buffer[n_token_char] = current_char;
-          n_token_char++;
         }
         break;
+      }
 
-      case WHITESPACE:
+      case REDIRECT:
+        /* The next word is the file name of the redirection */
         if (current_char == ' ') {
-          continue;
-        } else if (current_char == '|') {
-          /* Terminate tokens with NULL pointer, to signify end of command. Need
-           * to free token before overwriting pointer to it.
-           */
-          free_token(parsed_input->commands[n_command]->tokens[n_token + 1]);
-          parsed_input->commands[n_command]->tokens[n_token + 1] = NULL;
-          /* Terminate current command */
-          parsed_input->commands[n_command]->len = n_token + 1;
-          n_token = -1;
-          n_command++;
-          /* Switch to PIPE state */
-          next_state = PIPE;
-        } else if (current_char == '"') {
-          /* Start new word with current_char. */
-          n_token++;
-          n_token_char = 0;
+          break;
+        }
+        if (current_char == '|' || current_char == '&' ||
+            current_char == '<' || current_char == '>' ||
+            current_char == '\0') {
+          char near[2] = {current_char, '\0'};
+          printf("psh: parse error near %s\n",
+                 current_char == '\0' ? "newline" : near);
+          free_parsed_input(parsed_input);
+          return NULL;
+        }
+        target->target = buffer;
+        if (current_char == '"') {
+          target->quoted = 1;
           next_state = IN_WORD_QUOTED;
         } else {
-          /* Start new word with current_char. */
-          n_token++;
-          n_token_char = 0;
-          parsed_input->commands[n_command]
-              ->tokens[n_token]
-              ->buffer[n_token_char] = current_char;
-          n_token_char++;
+          *buffer++ = current_char;
           next_state = IN_WORD;
         }
         break;
 
+      case WHITESPACE:
       case PIPE:
         if (current_char == ' ') {
           next_state = WHITESPACE;
-        } else if (current_char == '|') {
-          printf("psh: parse error near ||\n\n");
+        } else if (current_char == '|' && next_state == PIPE) {
+          printf("psh: parse error near ||\n");
           free_parsed_input(parsed_input);
           return NULL;
-        } else if (current_char == '"') {
-          /* Start new command with new word with current_char. */
-          n_token++;
-          n_token_char = 0;
-          next_state = IN_WORD_QUOTED;
+        } else if (current_char == '<' || current_char == '>') {
+          target = add_redirect(parsed_input, command, &redirects, max_tokens);
+          parse_redirect(input, &i, -1, target);
+          next_state = REDIRECT;
+        } else if (current_char == '|' || current_char == '&' ||
+                   current_char == '\0') {
+          if (command->len == 0) {
+            /* A pipe or & needs a command before it */
+            if (command->n_redirects > 0) {
+              printf("psh: parse error: redirection without a command\n");
+            } else {
+              printf("psh: parse error near %s\n",
+                     current_char == '&' ? "&" : "|");
+            }
+            free_parsed_input(parsed_input);
+            return NULL;
+          }
+          /* Terminate tokens with NULL pointer, to signify end of command. */
+          *argv++ = NULL;
+          parsed_input->len++;
+          if (current_char == '|') {
+            command = &parsed_input->commands[parsed_input->len];
+            start_command(command, argv, quoted + (argv - first_argv));
+            next_state = PIPE;
+          } else if (current_char == '&') {
+            parsed_input->background = 1;
+            next_state = BACKGROUND;
+          }
         } else {
-          /* Start new command with new word with current_char. */
-          n_token++;
-          n_token_char = 0;
-          parsed_input->commands[n_command]
-              ->tokens[n_token]
-              ->buffer[n_token_char] = current_char;
-          n_token_char++;
-          next_state = IN_WORD;
+          /* Start new word with current_char. */
+          *argv++ = buffer;
+          command->len++;
+          quoted[argv - first_argv - 1] = current_char == '"';
+          if (current_char == '"') {
+            next_state = IN_WORD_QUOTED;
+          } else {
+            *buffer++ = current_char;
+            next_state = IN_WORD;
+          }
+        }
+        break;
+
+      case BACKGROUND:
+        /* & can only end the input */
+        if (current_char != ' ' && current_char != '\0') {
+          printf("psh: parse error near &\n");
+          free_parsed_input(parsed_input);
+          return NULL;
         }
         break;
 
@@ -305,7 +606,6 @@ struct ParsedInput *parse_input(char *raw_input) {
         break;
     }
   }
-  parsed_input->len = n_command + 1;
 
   return parsed_input;
 }
@@ -20,6 +20,8 @@
 #ifndef PSH_PARSER_H_
 #define PSH_PARSER_H_
 
+#include "arena.h"
+
 /*
  * Enum of the finite state machine parser states.
  */
@@ -28,26 +30,70 @@ typedef enum {
   IN_WORD,
   WHITESPACE,
   PIPE,
+  BACKGROUND,
+  REDIRECT,
 } ParserState;
 
 /*
- * Holds a single token in a char array.
+ * Enum of the implementations that parse_input() can use to find the end of a
+ * run of plain word characters. SCANNER_AUTO selects the fastest one the CPU
+ * supports.
+ */
+typedef enum {
+  SCANNER_AUTO,
+  SCANNER_SCALAR,
+  SCANNER_SSE2,
+  SCANNER_AVX2,
+} ParserScanner;
+
+/*
+ * Enum of the kinds of I/O redirection.
  */
-struct Token {
-  char *buffer; /* Holds the token characters. */
-  int max_len;  /* Number of chars allocated. */
+typedef enum {
+  REDIRECT_INPUT,  /* n<file, n defaults to 0. */
+  REDIRECT_OUTPUT, /* n>file, n defaults to 1. */
+  REDIRECT_APPEND, /* n>>file, n defaults to 1. */
+  REDIRECT_DUP,    /* n>&m or n<&m, which make n a copy of m, or close n if
+                      m is -. */
+  REDIRECT_HEREDOC,    /* n<<word, a here-document ending at the line word,
+                          n defaults to 0. */
+  REDIRECT_HERESTRING, /* n<<<word, which passes word and a newline, n
+                          defaults to 0. */
+} RedirectType;
+
+/*
+ * Holds a single redirection of a command.
+ */
+struct Redirect {
+  RedirectType type;
+  int fd;       /* File descriptor that is redirected. */
+  char *target; /* File name, or for REDIRECT_DUP the file descriptor that is
+                   copied, or for REDIRECT_HEREDOC the delimiter. Variables in
+                   it are expanded like in tokens, except in a delimiter. */
+  int quoted;   /* Whether target contained double quotes, which keep the
+                   body of a here-document from being expanded. */
+  char *body;   /* REDIRECT_HEREDOC: the lines of the here-document, each
+                   ending with a newline, or NULL until they have been read,
+                   see heredoc.h. */
 };
 
 /*
- * Holds a single command as an array of tokens.
+ * Holds a single command as a NULL terminated array of tokens.
  *
  * Tokens are separated by whitespace, e.g the command "ls -la" consists of the
- * tokens "ls" and "-la".
+ * tokens "ls" and "-la". Since the array is NULL terminated, it can directly be
+ * passed to execve as argv.
  */
 struct Command {
-  int max_tokens;        /* Number of tokens allocated. */
-  int len;               /* Number of tokens stored. */
-  struct Token **tokens; /* Holds pointers to the tokens of the command. */
+  int len;       /* Number of tokens stored, excluding the NULL terminator. */
+  char **tokens; /* Holds pointers to the tokens of the command. */
+  unsigned char *quoted; /* quoted[i] is set if token i contained double
+                            quotes, which keep glob characters from being
+                            expanded (see wildcard.h), or NULL if none
+                            did. */
+  int n_redirects;            /* Number of redirections. */
+  struct Redirect *redirects; /* Redirections in the order in which they are
+                                 applied, after the pipes. */
 };
 
 /*
@@ -56,19 +102,20 @@ struct Command {
  * After parsing the input with parse_input() which returns a pointer to
  * ParsedInput. This can be passed on to execute_input() to actually run the
  * input.
+ *
+ * All memory belonging to the parsed input, including the commands, the token
+ * pointer arrays and the characters of the tokens, lives in a single arena.
+ * The characters of all tokens are stored back to back in one buffer.
  */
 struct ParsedInput {
-  int max_commands; /* Number of commands allocated. */
-  int len;          /* Number of commands stored. */
-  struct Command **
-      commands; /* Holds pointers to the commands that are connected by pipes */
+  struct Arena *arena; /* Owns all memory of the parsed input. */
+  int len;             /* Number of commands stored. */
+  struct Command
+      *commands;  /* Holds the commands that are connected by pipes. */
+  int background; /* Whether the input ends with &, i.e. the pipeline runs in
+                     the background. */
 };
 
-/*
- * Creates new ParsedInput.
- */
-struct ParsedInput *new_parsed_input();
-
 /*
  * Frees memory allocated to hold ParsedInput.
  *
@@ -77,12 +124,17 @@ struct ParsedInput *new_parsed_input();
 void free_parsed_input(struct ParsedInput *parsed_input);
 
 /*
- * Reallocates more memory to resize token->buffer.
- *
- * token: Pointer to the token to be resized.
- * new_max_len: New number of characters to be stored in token->buffer.
+ * Removes the first n tokens of command, e.g. a leading keyword.
+ */
+void drop_tokens(struct Command *command, int n);
+
+/*
+ * Returns a copy of parsed_input in an arena of its own, which can be modified
+ * and freed independently of the original, e.g. to run a cached pipeline
+ * without parsing its line again. The copy is made with a single call to
+ * malloc.
  */
-void resize_token(struct Token *token, int new_max_len);
+struct ParsedInput *copy_parsed_input(const struct ParsedInput *parsed_input);
 
 /*
  * Parses the input line buffer into a ParsedInput struct.
@@ -92,7 +144,25 @@ void resize_token(struct Token *token, int new_max_len);
  * separated by pipes (i.e. |). Each command in turn is a sequence of whitespace
  * separated (one or multiple) tokens. Characters inside a pair of double quotes
  * are interpreted as a single token, even if they include whitespace.
+ * Redirections (<, >, >>, >& or <&, << and <<<, optionally preceded by a
+ * file descriptor number as in 2>&1) and the word after them are taken out of
+ * the tokens and stored in the command's redirects. The bodies of
+ * here-documents follow on the next lines and are not part of raw_input.
+ *
+ * Runs of plain characters are located with SIMD instructions where available
+ * (see set_parser_scanner()) and copied at once, so parsing takes linear time
+ * in the length of the input. The memory for the result is sized from the
+ * length of the input up front, so parsing a line costs a single call to
+ * malloc, and one more if it has redirections. Returns NULL and prints an
+ * error if the input can not be parsed.
  */
 struct ParsedInput *parse_input(char *raw_input);
 
+/*
+ * Selects the implementation parse_input() uses to scan for special
+ * characters. All of them produce identical results. Returns 0 on success and
+ * -1 if the implementation is not supported on this machine.
+ */
+int set_parser_scanner(ParserScanner scanner);
+
 #endif /* PSH_PARSER_H_ */
@@ -17,43 +17,430 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <ctype.h>
 #include <errno.h>
-#include <readline/history.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "builtins.h"
+#include "children.h"
+#include "command_hash.h"
+#include "heredoc.h"
+#include "jobs.h"
 #include "parser.h"
+#include "picoshell.h"
+#include "pipeline_cache.h"
+#include "script.h"
+#include "spawn.h"
 #include "utils.h"
+#include "vars.h"
+#include "wildcard.h"
 
-void resolve_env_variables(struct Command *command) {
+#ifndef PSH_DEFAULT_POSIX_SPAWN
+#define PSH_DEFAULT_POSIX_SPAWN 1
+#endif
+
+#ifndef PSH_DEFAULT_SPAWN_SERVER
+#define PSH_DEFAULT_SPAWN_SERVER 0
+#endif
+
+struct ShellOptions shell_options = {
+    .posix_spawn = PSH_DEFAULT_POSIX_SPAWN,
+    .spawn_server = PSH_DEFAULT_SPAWN_SERVER};
+
+SpawnBackend shell_spawn_backend() {
+  if (shell_options.spawn_server) {
+    return SPAWN_SERVER;
+  }
+  return shell_options.posix_spawn ? SPAWN_POSIX_SPAWN : SPAWN_FORK;
+}
+
+/* Exit status of the most recently executed pipeline. */
+static int last_status = 0;
+
+/* Called before a stage that may read the shell's stdin, see set_stdin_hook */
+static void (*stdin_hook)(void *arg) = NULL;
+static void *stdin_hook_arg = NULL;
+
+/*
+ * Holds a piece of an expanded token, i.e. a literal part of the token or the
+ * value of a variable.
+ */
+struct Piece {
+  const char *str;
+  size_t len;
+};
+
+/* Maximum number of pieces collected before they are joined. */
+#define MAX_PIECES 32
+
+/* Lowest file descriptor the shell keeps the files of redirections and saved
+ * descriptors at, and the first one a redirection can neither redirect nor
+ * refer to, so that it can not replace them.
+ */
+#define REDIRECT_MIN_FD 10
+
+/*
+ * Appends a piece to pieces. If pieces is full, the pieces collected so far are
+ * joined into a single one in arena first.
+ */
+static void add_piece(struct Piece *pieces, int *n_pieces, size_t *len,
+                      const char *str, size_t str_len, struct Arena *arena) {
+  if (str_len == 0) {
+    return;
+  }
+  if (*n_pieces == MAX_PIECES) {
+    char *joined = arena_alloc(arena, *len);
+    char *end = joined;
+    for (int i = 0; i < *n_pieces; i++) {
+      end = mempcpy(end, pieces[i].str, pieces[i].len);
+    }
+    pieces[0] = (struct Piece){joined, *len};
+    *n_pieces = 1;
+  }
+  pieces[(*n_pieces)++] = (struct Piece){str, str_len};
+  *len += str_len;
+}
+
+/*
+ * Returns token with the variables in it expanded, token itself if it does not
+ * contain any. Scans token once, collecting literal parts and values as
+ * pieces, which are copied into arena with a single allocation at the end.
+ */
+static char *expand_token(char *token, struct Arena *arena) {
+  char *dollar = strchr(token, '$');
+  if (dollar == NULL) {
+    return token;
+  }
+
+  struct Piece pieces[MAX_PIECES];
+  int n_pieces = 0;
+  size_t len = 0;
+  char status[12], pid[12];
+  const char *literal = token;
+  while (dollar != NULL) {
+    const char *name = dollar + 1;
+    const char *value = NULL;
+    const char *after = NULL;
+    if (*name == '?') {
+      snprintf(status, sizeof status, "%d", last_status);
+      value = status;
+      after = name + 1;
+    } else if (*name == '$') {
+      snprintf(pid, sizeof pid, "%d", getpid());
+      value = pid;
+      after = name + 1;
+    } else if (*name == '{') {
+      const char *close = strchr(name + 1, '}');
+      if (close != NULL && is_variable_name(name + 1, close - name - 1)) {
+        value = lookup_variable(name + 1, close - name - 1);
+        after = close + 1;
+      }
+    } else {
+      const char *end = name;
+      while (isalnum((unsigned char)*end) || *end == '_') {
+        end++;
+      }
+      if (is_variable_name(name, end - name)) {
+        value = lookup_variable(name, end - name);
+        after = end;
+      }
+    }
+
+    /* A $ that is not followed by a name stays as it is */
+    if (after == NULL) {
+      dollar = strchr(dollar + 1, '$');
+      continue;
+    }
+    add_piece(pieces, &n_pieces, &len, literal, dollar - literal, arena);
+    if (value != NULL) {
+      add_piece(pieces, &n_pieces, &len, value, strlen(value), arena);
+    }
+    literal = after;
+    dollar = strchr(after, '$');
+  }
+  add_piece(pieces, &n_pieces, &len, literal, strlen(literal), arena);
+
+  char *expanded = arena_alloc(arena, len + 1);
+  char *end = expanded;
+  for (int i = 0; i < n_pieces; i++) {
+    end = mempcpy(end, pieces[i].str, pieces[i].len);
+  }
+  *end = '\0';
+  return expanded;
+}
+
+/*
+ * Expands the variables in the tokens of command, or only in those tokens i
+ * for which has_variables[i] is set unless has_variables is NULL, and in the
+ * file names of its redirections.
+ */
+static void expand_command(struct Command *command,
+                           const unsigned char *has_variables,
+                           struct Arena *arena) {
   for (int i = 0; i < command->len; i++) {
-    /* if token starts with $, check if env variable exists and replace token
-     * with resolved value. If variable does not exist, resolve to empty string.
-     */
-    if (command->tokens[i]->buffer[0] == '$') {
-      char *env_var = getenv(&(command->tokens[i]->buffer[1]));
-      if (env_var != NULL) {
-        if (command->tokens[i]->max_len < strlen(env_var)) {
-          resize_token(command->tokens[i], strlen(env_var) + 1);
-        }
-        strcpy(command->tokens[i]->buffer, env_var);
+    if (has_variables == NULL || has_variables[i]) {
+      command->tokens[i] = expand_token(command->tokens[i], arena);
+    }
+  }
+  for (int i = 0; i < command->n_redirects; i++) {
+    struct Redirect *redirect = &command->redirects[i];
+    if (redirect->type != REDIRECT_HEREDOC) {
+      redirect->target = expand_token(redirect->target, arena);
+    } else if (!redirect->quoted && redirect->body != NULL) {
+      redirect->body = expand_token(redirect->body, arena);
+    }
+  }
+}
+
+void resolve_env_variables(struct Command *command, struct Arena *arena) {
+  expand_command(command, NULL, arena);
+}
+
+/*
+ * Returns the number of leading tokens of command that assign a variable, i.e.
+ * that have the form NAME=value.
+ */
+static int count_assignments(struct Command *command) {
+  int n = 0;
+  while (n < command->len) {
+    char *equals = strchr(command->tokens[n], '=');
+    if (equals == NULL ||
+        !is_variable_name(command->tokens[n], equals - command->tokens[n])) {
+      break;
+    }
+    n++;
+  }
+  return n;
+}
+
+/*
+ * Sets the variables of n assignments of the form NAME=value in the shell.
+ */
+static void assign_variables(char **assignments, int n) {
+  for (int i = 0; i < n; i++) {
+    char *equals = strchr(assignments[i], '=');
+    *equals = '\0';
+    set_variable(assignments[i], equals + 1);
+    *equals = '=';
+  }
+}
+
+/*
+ * Returns the largest pipe capacity an unprivileged process may set, read
+ * from /proc/sys/fs/pipe-max-size once.
+ */
+static int max_pipe_size() {
+  static int max_size = 0;
+  if (max_size == 0) {
+    max_size = 1 << 20;
+    FILE *file = fopen("/proc/sys/fs/pipe-max-size", "re");
+    if (file != NULL) {
+      int size;
+      if (fscanf(file, "%d", &size) == 1 && size > 0) {
+        max_size = size;
+      }
+      fclose(file);
+    }
+  }
+  return max_size;
+}
+
+/*
+ * Returns the pipe capacity given by value, a number of bytes with an optional
+ * K or M suffix, clamped to max_pipe_size(). Returns 0 if value is NULL or not
+ * a size, which leaves pipes at the kernel's default capacity.
+ */
+static int parse_pipe_size(const char *value) {
+  if (value == NULL) {
+    return 0;
+  }
+  char *end;
+  long long size = strtoll(value, &end, 10);
+  if (end == value || size <= 0) {
+    return 0;
+  }
+  int shift = 0;
+  if (*end == 'k' || *end == 'K') {
+    shift = 10;
+    end++;
+  } else if (*end == 'm' || *end == 'M') {
+    shift = 20;
+    end++;
+  }
+  if (*end != '\0') {
+    return 0;
+  }
+  /* Clamped before the shift, which could overflow otherwise */
+  if (size > max_pipe_size() >> shift) {
+    return max_pipe_size();
+  }
+  return size << shift;
+}
+
+/*
+ * Sets the capacity of the n_pipes pipes in pipefds to size bytes, which the
+ * kernel rounds up to a power of two of pages. A pipe stays at its capacity
+ * if that fails, e.g. once the user's pipes exceed pipe-user-pages-soft.
+ */
+static void resize_pipes(const int *pipefds, int n_pipes, int size) {
+  for (int i = 0; size > 0 && i < n_pipes; i++) {
+    if (pipefds[2 * i] != -1) {
+      fcntl(pipefds[2 * i], F_SETPIPE_SZ, size);
+    }
+  }
+}
+
+/*
+ * Opens the files of the redirections of command and appends the operations
+ * that set them up in the child to actions. The shell opens the files itself,
+ * close-on-exec and at REDIRECT_MIN_FD or above, so that a file that can not
+ * be opened is reported before anything runs and every spawn backend only has
+ * to dup2() it into place. The descriptors are stored in opened, one for each
+ * redirection or -1, for close_redirect_files(). Returns 0 on success, or
+ * prints an error and returns -1.
+ */
+static int add_redirect_actions(const struct Command *command,
+                                struct SpawnFileActions *actions,
+                                int *opened) {
+  for (int i = 0; i < command->n_redirects; i++) {
+    opened[i] = -1;
+  }
+  for (int i = 0; i < command->n_redirects; i++) {
+    const struct Redirect *redirect = &command->redirects[i];
+    /* The opened files and the descriptors saved for built-ins live there */
+    if (redirect->fd >= REDIRECT_MIN_FD) {
+      printf("psh: %d: bad file descriptor\n", redirect->fd);
+      return -1;
+    }
+    if (redirect->type == REDIRECT_DUP) {
+      char *end;
+      long fd = strtol(redirect->target, &end, 10);
+      if (strcmp(redirect->target, "-") == 0) {
+        add_close_action(actions, redirect->fd);
+      } else if (end != redirect->target && *end == '\0' && fd >= 0 &&
+                 fd < REDIRECT_MIN_FD) {
+        add_dup2_action(actions, fd, redirect->fd);
       } else {
-        command->tokens[i]->buffer[0] = '\0';
+        printf("psh: %s: bad file descriptor\n", redirect->target);
+        return -1;
       }
-    };
-  };
+      continue;
+    }
+
+    const char *name = redirect->target;
+    int fd;
+    if (redirect->type == REDIRECT_HEREDOC ||
+        redirect->type == REDIRECT_HERESTRING) {
+      name = "here-document";
+      fd = open_heredoc(redirect);
+    } else {
+      int flags = O_RDONLY;
+      if (redirect->type == REDIRECT_OUTPUT) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+      } else if (redirect->type == REDIRECT_APPEND) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+      }
+      fd = open(redirect->target, flags | O_CLOEXEC, 0666);
+    }
+    if (fd != -1 && fd < REDIRECT_MIN_FD) {
+      int moved = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_MIN_FD);
+      close(fd);
+      fd = moved;
+    }
+    if (fd == -1) {
+      printf("psh: %s: %s\n", name, strerror(errno));
+      return -1;
+    }
+    opened[i] = fd;
+    add_dup2_action(actions, fd, redirect->fd);
+  }
+  return 0;
+}
+
+/*
+ * Closes the files add_redirect_actions() opened for n redirections, once the
+ * child has its copies.
+ */
+static void close_redirect_files(const int *opened, int n) {
+  for (int i = 0; i < n; i++) {
+    if (opened[i] != -1) {
+      close(opened[i]);
+    }
+  }
+}
+
+/*
+ * Holds a file descriptor of the shell that a redirection replaces while a
+ * built-in runs in the shell, and the copy it is restored from, or -1 if it
+ * was closed.
+ */
+struct SavedFd {
+  int fd;
+  int copy;
 };
 
+/*
+ * Puts back the n descriptors saved by redirect_shell_fds(), in reverse
+ * order.
+ */
+static void restore_shell_fds(const struct SavedFd *saved, int n) {
+  for (int i = n - 1; i >= 0; i--) {
+    if (saved[i].copy != -1) {
+      dup2(saved[i].copy, saved[i].fd);
+      close(saved[i].copy);
+    } else {
+      close(saved[i].fd);
+    }
+  }
+}
+
+/*
+ * Applies actions to the shell itself, for a built-in that runs in the shell.
+ * Each descriptor that is replaced is saved in saved first, which needs room
+ * for actions->len entries, for restore_shell_fds(). Returns the number of
+ * saved descriptors, or -1 after printing an error, in which case they have
+ * been restored already.
+ */
+static int redirect_shell_fds(const struct SpawnFileActions *actions,
+                              struct SavedFd *saved) {
+  int n_saved = 0;
+  for (int i = 0; i < actions->len; i++) {
+    const struct SpawnFileAction *action = &actions->actions[i];
+    int is_saved = 0;
+    for (int j = 0; j < n_saved; j++) {
+      is_saved |= saved[j].fd == action->fd;
+    }
+    if (!is_saved) {
+      saved[n_saved].fd = action->fd;
+      saved[n_saved].copy =
+          fcntl(action->fd, F_DUPFD_CLOEXEC, REDIRECT_MIN_FD);
+      n_saved++;
+    }
+    if (action->type == SPAWN_ACTION_CLOSE) {
+      close(action->fd);
+    } else if (dup2(action->src_fd, action->fd) == -1) {
+      int dup_errno = errno;
+      restore_shell_fds(saved, n_saved);
+      printf("psh: %d: %s\n", action->src_fd, strerror(dup_errno));
+      return -1;
+    }
+  }
+  return n_saved;
+}
+
 char *resolve_path(char *executable) {
   /* If command is a built-in, return it as is */
-  char *builtins[] = {"cd", "exit", "pwd"};
-  for (int i = 0; i < 3; i++) {
-    if (strcmp(executable, builtins[i]) == 0) {
-      char *command_copy = strdup(executable);
-      return command_copy;
-    }
+  if (find_builtin(executable) != NULL) {
+    return strdup(executable);
   }
 
   char *resolved;
@@ -61,202 +448,847 @@ char *resolve_path(char *executable) {
     /* if command contains / expand to absolute path */
     resolved = realpath(executable, NULL);
   } else {
-    /* otherwise iterate through colon separated paths in PATH env variable and
-     * check if file can be found. If yes return full path, otherwise return
-     * NULL.
+    /* otherwise look up the command in the hash table, which searches the
+     * colon separated paths in the PATH env variable on a miss. If found return
+     * a copy of the full path, otherwise return NULL.
      */
-    char *path_original = getenv("PATH");
-    char *path = strdup(path_original);
-    char *ptr = strtok(path, ":");
-    while (ptr != NULL) {
-      char *full_path =
-          handled_malloc(sizeof(char) * (strlen(ptr) + strlen(executable) + 2));
-      strcpy(full_path, ptr);
-      if (full_path[strlen(full_path) - 1] != '/') {
-        strcat(full_path, "/");
-      }
-      strcat(full_path, executable);
-      if (access(full_path, F_OK) == 0) {
-        free(path);
-        return full_path;
-      }
-      ptr = strtok(NULL, ":");
-      free(full_path);
-    }
-    free(path);
-    resolved = NULL;
+    const char *full_path = hash_lookup(executable);
+    resolved = full_path != NULL ? strdup(full_path) : NULL;
   }
   return resolved;
 }
 
-char *getprompt() {
-  char hostname[30];
-  gethostname(hostname, sizeof hostname);
-  char *user = getlogin();
-
-  /* assemble prompt, nothing fancy :) */
-  char *prompt = handled_malloc(sizeof(char) * (strlen(user) + 35));
-  strcpy(prompt, user);
-  strcat(prompt, "@");
-  strcat(prompt, hostname);
-  strcat(prompt, "~> ");
-
-  return prompt;
-}
-
-void change_dir(char *dir) {
-  char *newpwd = realpath(dir, NULL);
-  char *oldpwd = getenv("PWD");
+int change_dir(char *dir) {
   int res = chdir(dir);
   if (res == 0) {
-    /* If chdir was successful, update PWD and OLDPWD and chdir */
-    setenv("OLDPWD", oldpwd, 1);
-    setenv("PWD", newpwd, 1);
+    /* If chdir was successful, update PWD and OLDPWD. PWD is taken from the
+     * kernel, which resolves dir like realpath would, but also when a
+     * component of the new directory can not be read.
+     */
+    char *oldpwd = get_variable("PWD") != NULL ? strdup(get_variable("PWD"))
+                                               : NULL;
+    char *newpwd = getcwd(NULL, 0);
+    if (oldpwd != NULL) {
+      set_variable("OLDPWD", oldpwd);
+    }
+    if (newpwd != NULL) {
+      set_variable("PWD", newpwd);
+    }
+    free(oldpwd);
+    free(newpwd);
+    /* Relative paths of cached pipelines now point elsewhere */
+    invalidate_command_paths();
   } else {
     switch (errno) {
       case ENOTDIR:
-        printf("cd: not a directory: %s\n", dir);
+        fprintf(stderr, "cd: not a directory: %s\n", dir);
         break;
       case ENOENT:
-        printf("cd: no such file or directory: %s\n", dir);
+        fprintf(stderr, "cd: no such file or directory: %s\n", dir);
         break;
       case EACCES:
-        printf("cd: permission denied: %s\n", dir);
+        fprintf(stderr, "cd: permission denied: %s\n", dir);
         break;
       default:
-        printf("cd: error %i occurred: %s\n", errno, dir);
+        fprintf(stderr, "cd: error %i occurred: %s\n", errno, dir);
     }
   }
-  free(newpwd);
+  return res == 0 ? 0 : 1;
 }
 
-void execute_input(char *input) {
-  if (input[0] == '\0') {
-    free(input);
-    return;
+void set_stdin_hook(void (*hook)(void *arg), void *arg) {
+  stdin_hook = hook;
+  stdin_hook_arg = arg;
+}
+
+/*
+ * Returns whether command redirects file descriptor fd.
+ */
+static int redirects_fd(const struct Command *command, int fd) {
+  for (int i = 0; i < command->n_redirects; i++) {
+    if (command->redirects[i].fd == fd) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int last_exit_status() { return last_status; }
+
+void set_last_exit_status(int status) { last_status = status; }
+
+int decode_status(int status) {
+  if (WIFEXITED(status)) {
+    return WEXITSTATUS(status);
+  } else if (WIFSIGNALED(status)) {
+    return 128 + WTERMSIG(status);
+  } else if (WIFSTOPPED(status)) {
+    return 128 + WSTOPSIG(status);
+  }
+  return status;
+}
+
+/*
+ * Holds the wall time and resource usage of one stage of a timed pipeline.
+ */
+struct StageTimes {
+  long long start;      /* Monotonic time the stage was started at in ns. */
+  long long end;        /* Monotonic time the stage was reaped at in ns. */
+  struct rusage usage;  /* Resource usage of the stage. */
+};
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double timeval_seconds(const struct timeval *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void subtract_timeval(struct timeval *tv, const struct timeval *other) {
+  tv->tv_sec -= other->tv_sec;
+  tv->tv_usec -= other->tv_usec;
+  if (tv->tv_usec < 0) {
+    tv->tv_sec--;
+    tv->tv_usec += 1000000;
+  }
+}
+
+/* Turns the usage counters of the shell into the usage between two samples.
+ * ru_maxrss is a high water mark and is kept as it is.
+ */
+static void subtract_rusage(struct rusage *usage,
+                            const struct rusage *before) {
+  subtract_timeval(&usage->ru_utime, &before->ru_utime);
+  subtract_timeval(&usage->ru_stime, &before->ru_stime);
+  usage->ru_nvcsw -= before->ru_nvcsw;
+  usage->ru_nivcsw -= before->ru_nivcsw;
+}
+
+/*
+ * Prints the wall time, CPU time, peak RSS and context switches of each stage
+ * and of the whole pipeline to stderr.
+ */
+static void print_times(struct ParsedInput *parsed_input,
+                        struct StageTimes *times, int n_stages,
+                        long long pipeline_ns) {
+  fprintf(stderr, "\n%-5s %-16s %10s %10s %10s %12s %8s %8s\n", "stage",
+          "command", "real", "user", "sys", "maxrss", "vcsw", "ivcsw");
+
+  double user = 0, sys = 0;
+  long maxrss = 0, nvcsw = 0, nivcsw = 0;
+  for (int i = 0; i < n_stages; i++) {
+    struct rusage *usage = &times[i].usage;
+    fprintf(stderr, "%-5d %-16.16s %9.3fs %9.3fs %9.3fs %10ldKB %8ld %8ld\n",
+            i, parsed_input->commands[i].tokens[0],
+            (times[i].end - times[i].start) / 1e9,
+            timeval_seconds(&usage->ru_utime),
+            timeval_seconds(&usage->ru_stime), usage->ru_maxrss,
+            usage->ru_nvcsw, usage->ru_nivcsw);
+    user += timeval_seconds(&usage->ru_utime);
+    sys += timeval_seconds(&usage->ru_stime);
+    maxrss = usage->ru_maxrss > maxrss ? usage->ru_maxrss : maxrss;
+    nvcsw += usage->ru_nvcsw;
+    nivcsw += usage->ru_nivcsw;
   }
+  fprintf(stderr, "%-22s %9.3fs %9.3fs %9.3fs %10ldKB %8ld %8ld\n", "total",
+          pipeline_ns / 1e9, user, sys, maxrss, nvcsw, nivcsw);
+}
 
-  /* Add input to readline history. */
-  add_history(input);
+/*
+ * Holds a built-in that runs on a helper thread as a stage of a pipeline.
+ */
+struct BuiltinThread {
+  pthread_t thread;
+  const struct Builtin *builtin;
+  int argc;
+  char **argv;
+  struct BuiltinIO io;
+  int status;               /* Exit status, once the thread is joined. */
+  struct StageTimes *times; /* Times of the stage, or NULL if not timed. */
+};
 
-  struct ParsedInput *parsed_input = parse_input(input);
+static void close_builtin_io(struct BuiltinIO *io) {
+  if (io->in != 0) {
+    close(io->in);
+  }
+  if (io->out != 1) {
+    close(io->out);
+  }
+}
+
+static void *builtin_thread_main(void *arg) {
+  struct BuiltinThread *builtin_thread = arg;
+  builtin_thread->status =
+      run_builtin(builtin_thread->builtin, builtin_thread->argc,
+                  builtin_thread->argv, &builtin_thread->io);
+
+  /* The stage owns its ends of the pipes, closing them signals EOF to the
+   * next stage.
+   */
+  close_builtin_io(&builtin_thread->io);
+  if (builtin_thread->times != NULL) {
+    builtin_thread->times->end = now_ns();
+    getrusage(RUSAGE_THREAD, &builtin_thread->times->usage);
+  }
+  return NULL;
+}
+
+/*
+ * Starts the built-in on a helper thread. SIGPIPE is blocked on the thread,
+ * so that writing to a pipe whose reader has exited fails with EPIPE instead
+ * of killing the shell. Returns 0 on success and -1 otherwise.
+ */
+static int start_builtin_thread(struct BuiltinThread *builtin_thread) {
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  int res = pthread_create(&builtin_thread->thread, NULL, builtin_thread_main,
+                           builtin_thread);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return res == 0 ? 0 : -1;
+}
+
+/*
+ * Runs the built-in in a forked child, for built-ins that change the state of
+ * the shell and must not do so from a pipeline, for background pipelines and
+ * for built-ins with redirections. The child joins process group pgroup
+ * unless it is -1, see SpawnFileActions.pgroup, resets the signals of the
+ * shell, closes all pipe ends except those in io and applies redirects on top
+ * of io. Returns the pid of the
+ * child or -1 on failure.
+ */
+static pid_t fork_builtin(const struct Builtin *builtin, int argc, char **argv,
+                          struct BuiltinIO *io,
+                          const struct SpawnFileActions *redirects,
+                          int *pipefds, int n_pipefds, pid_t pgroup) {
+  pid_t pid = fork();
+  if (pid > 0 && pgroup != -1) {
+    setpgid(pid, pgroup != 0 ? pgroup : pid);
+  }
+  if (pid != 0) {
+    return pid;
+  }
+  if (pgroup != -1) {
+    setpgid(0, pgroup);
+  }
+  /* The built-in stops with its job like any other command */
+  reset_child_signals();
+  for (int i = 0; i < n_pipefds; i++) {
+    if (pipefds[i] != -1 && pipefds[i] != io->in && pipefds[i] != io->out) {
+      close(pipefds[i]);
+    }
+  }
+  if (redirects->len > 0) {
+    /* Redirections refer to the descriptors of the process, so the pipe ends
+     * are moved into place first
+     */
+    if ((io->in != 0 && dup2(io->in, 0) == -1) ||
+        (io->out != 1 && dup2(io->out, 1) == -1) ||
+        apply_spawn_file_actions(redirects) == -1) {
+      dprintf(2, "psh: %s: %s\n", argv[0], strerror(errno));
+      _exit(1);
+    }
+    *io = (struct BuiltinIO){0, 1, 2};
+  }
+  _exit(run_builtin(builtin, argc, argv, io));
+}
+
+/*
+ * Runs a built-in with redirections in the shell, with the descriptors of the
+ * shell redirected while it runs. opened has room for the descriptors of the
+ * redirected files. Returns the exit status of the built-in.
+ */
+static int run_redirected_builtin(const struct Builtin *builtin,
+                                  struct Command *command, int *opened,
+                                  struct BuiltinIO *io) {
+  struct SpawnFileActions actions;
+  init_spawn_file_actions(&actions);
+  int status = 1;
+  if (add_redirect_actions(command, &actions, opened) == 0) {
+    struct SavedFd *saved =
+        handled_malloc(sizeof(struct SavedFd) * actions.len);
+    int n_saved = redirect_shell_fds(&actions, saved);
+    close_redirect_files(opened, command->n_redirects);
+    if (n_saved != -1) {
+      status = run_builtin(builtin, command->len, command->tokens, io);
+      restore_shell_fds(saved, n_saved);
+    }
+    free(saved);
+  } else {
+    close_redirect_files(opened, command->n_redirects);
+  }
+  free_spawn_file_actions(&actions);
+  return status;
+}
+
+/*
+ * Returns the pipeline as a string for job listings, the tokens and
+ * redirections separated by spaces and the commands by pipes.
+ */
+static char *pipeline_text(struct ParsedInput *parsed_input) {
+  size_t len = 1;
+  for (int i = 0; i < parsed_input->len; i++) {
+    struct Command *command = &parsed_input->commands[i];
+    for (int j = 0; j < command->len; j++) {
+      len += strlen(command->tokens[j]) + 3;
+    }
+    for (int j = 0; j < command->n_redirects; j++) {
+      len += strlen(command->redirects[j].target) + 16;
+    }
+  }
+  char *text = handled_malloc(len);
+  char *end = text;
+  for (int i = 0; i < parsed_input->len; i++) {
+    struct Command *command = &parsed_input->commands[i];
+    if (i > 0) {
+      end = stpcpy(end, " | ");
+    }
+    for (int j = 0; j < command->len; j++) {
+      if (j > 0) {
+        *end++ = ' ';
+      }
+      end = stpcpy(end, command->tokens[j]);
+    }
+    for (int j = 0; j < command->n_redirects; j++) {
+      const struct Redirect *redirect = &command->redirects[j];
+      static const char *operators[] = {"<", ">", ">>", ">&", "<<", "<<<"};
+      int default_fd = operators[redirect->type][0] == '<' ? 0 : 1;
+      *end++ = ' ';
+      if (redirect->fd != default_fd) {
+        end += sprintf(end, "%d", redirect->fd);
+      }
+      end = stpcpy(stpcpy(end, operators[redirect->type]), redirect->target);
+    }
+  }
+  *end = '\0';
+  return text;
+}
+
+/* A pipeline whose here-documents are being read, and its cached version */
+static struct ParsedInput *waiting_input = NULL;
+static struct CachedPipeline *waiting_cached = NULL;
+
+int execute_input(char *input) {
+  /* Collect background jobs that finished in the meantime */
+  reap_jobs();
+
+  /* The lines after a << redirection are the body of its here-document. The
+   * input they belong to runs once all of its here-documents are complete, a
+   * script with an empty line that lets it finish.
+   */
+  char empty[] = "";
+  if (heredoc_pending()) {
+    if (read_heredoc_line(input)) {
+      return SCRIPT_INCOMPLETE;
+    }
+    if (waiting_input != NULL) {
+      struct ParsedInput *parsed_input = waiting_input;
+      waiting_input = NULL;
+      return run_pipeline(parsed_input, waiting_cached);
+    }
+    input = empty;
+  }
+
+  /* Lines with ; or compound commands like if and while are compiled as a
+   * script, which may continue on the following lines.
+   */
+  if (script_pending() || is_script_line(input)) {
+    int status = execute_script_line(input);
+    if (status != SCRIPT_INCOMPLETE) {
+      last_status = status;
+    }
+    return status;
+  }
+
+  if (input[0] == '\0') {
+    return last_status;
+  }
+
+  /* A line that ran before is copied from the pipeline cache instead of
+   * being parsed again. Otherwise parse_input modifies the line, so the key is
+   * copied first.
+   */
+  struct CachedPipeline *cached = find_cached_pipeline(input);
+  struct ParsedInput *parsed_input;
+  if (cached != NULL) {
+    parsed_input = copy_parsed_input(cached->parsed_input);
+  } else {
+    char *line = strdup(input);
+    parsed_input = parse_input(input);
+    if (parsed_input != NULL && parsed_input->len > 0) {
+      cached = cache_pipeline(line, parsed_input);
+    } else {
+      free(line);
+    }
+  }
 
   /* Do nothing if parsing fails */
   if (parsed_input == NULL) {
-    free(input);
-    return;
+    last_status = 2;
+    return last_status;
+  }
+  if (expect_heredocs(parsed_input) > 0) {
+    waiting_input = parsed_input;
+    waiting_cached = cached;
+    return SCRIPT_INCOMPLETE;
+  }
+  return run_pipeline(parsed_input, cached);
+}
+
+int input_pending() { return script_pending() || heredoc_pending(); }
+
+void discard_input() {
+  discard_heredocs();
+  if (waiting_input != NULL) {
+    printf("psh: parse error: unexpected end of input\n");
+    free_parsed_input(waiting_input);
+    waiting_input = NULL;
+  }
+  discard_script();
+}
+
+int run_pipeline(struct ParsedInput *parsed_input,
+                 struct CachedPipeline *cached) {
+  /* Nothing to run for input that consists of whitespace only */
+  if (parsed_input->len == 0) {
+    free_parsed_input(parsed_input);
+    return last_status;
+  }
+
+  /* A leading time reports the resource usage of the pipeline */
+  struct StageTimes *times = NULL;
+  long long pipeline_start = 0;
+  if (strcmp(parsed_input->commands[0].tokens[0], "time") == 0) {
+    drop_tokens(&parsed_input->commands[0], 1);
+    if (parsed_input->commands[0].len == 0) {
+      if (parsed_input->len > 1) {
+        printf("psh: parse error near |\n");
+        last_status = 2;
+      } else {
+        /* time without a pipeline times nothing */
+        fprintf(stderr, "\nreal\t0.000s\n");
+      }
+      free_parsed_input(parsed_input);
+      return last_status;
+    }
+    times = handled_malloc(sizeof(struct StageTimes) * parsed_input->len);
+    memset(times, 0, sizeof(struct StageTimes) * parsed_input->len);
+    pipeline_start = now_ns();
   }
 
   /* setup pipes */
   int n_pipes = parsed_input->len - 1;
   int *pipefds = malloc(sizeof(int) * 2 * n_pipes);
   for (int n_pipe = 0; n_pipe < n_pipes; n_pipe++) {
-    pipe(pipefds + n_pipe * 2);
+    pipe2(pipefds + n_pipe * 2, O_CLOEXEC);
+  }
+  if (n_pipes > 0) {
+    resize_pipes(pipefds, n_pipes,
+                 parse_pipe_size(get_variable("PSH_PIPE_SIZE")));
   }
 
-  /* loop over the commands in the input (which are all piped together) */
+  /* pids[n_command] holds the child running that stage, or 0 if the stage did
+   * not fork (built-in). statuses[n_command] holds the exit status of each
+   * stage once it is known.
+   */
+  pid_t *pids = handled_malloc(sizeof(pid_t) * parsed_input->len);
+  int *statuses = handled_malloc(sizeof(int) * parsed_input->len);
+  int n_started = 0;
+
+  /* threads[n_command] holds the helper thread of a built-in stage, which is
+   * only joined if running[n_command] is set.
+   */
+  struct BuiltinThread *threads =
+      handled_malloc(sizeof(struct BuiltinThread) * parsed_input->len);
+  int *running = handled_malloc(sizeof(int) * parsed_input->len);
+
+  /* With job control, the pipeline runs in a process group of its own, led by
+   * its first process. pgid is 0 until that has been started, and -1 without
+   * job control, see SpawnFileActions.pgroup. A pipeline in the foreground
+   * gets the terminal.
+   */
+  int background = parsed_input->background;
+  int terminal_fd = background ? -1 : job_terminal_fd();
+  pid_t pgid = job_terminal_fd() != -1 ? 0 : -1;
+
+  /* Fork all stages of the pipeline before waiting on any of them, so that
+   * they run concurrently and data streams through the pipes. Waiting after
+   * each fork would deadlock as soon as a stage writes more than the pipe
+   * buffer can hold.
+   */
   for (int n_command = 0; n_command < parsed_input->len; n_command++) {
-    resolve_env_variables(parsed_input->commands[n_command]);
+    pids[n_command] = 0;
+    statuses[n_command] = 0;
+    running[n_command] = 0;
+    n_started = n_command + 1;
+
+    /* Leading assignments, e.g. X=1 in X=1 cmd, are recognized before
+     * expansion, so that a value can not turn into an assignment.
+     */
+    struct Command *command = &parsed_input->commands[n_command];
+    int n_assignments = count_assignments(command);
+
+    /* Of a cached pipeline only the tokens that contain a $ are expanded. The
+     * time prefix has been dropped from the tokens of the first command.
+     */
+    const unsigned char *has_variables = NULL;
+    if (cached != NULL) {
+      has_variables = cached->commands[n_command].has_variables +
+                      (n_command == 0 && times != NULL);
+    }
+    expand_command(command, has_variables, parsed_input->arena);
+    char **assignments = command->tokens;
 
-    /* For built-in commands, psh does not fork. Piping has no effect for
-     * built-in commands, they are just executed in order. That means, if
-     * built-ins are combined with regular commands they break the pipe.
+    /* PSH_PIPE_SIZE in front of the first command sizes the pipes of this
+     * pipeline, before any data has been written to them.
      */
-    if (strcmp(parsed_input->commands[n_command]->tokens[0]->buffer, "exit") ==
-        0) {
-      /* exit */
-      exit(EXIT_SUCCESS);
-    } else if (strcmp(parsed_input->commands[n_command]->tokens[0]->buffer,
-                      "cd") == 0) {
-      /* cd */
-      if (parsed_input->commands[n_command]->len == 2) {
-        change_dir(parsed_input->commands[n_command]->tokens[1]->buffer);
+    for (int i = 0; n_command == 0 && n_pipes > 0 && i < n_assignments; i++) {
+      if (strncmp(assignments[i], "PSH_PIPE_SIZE=", 14) == 0) {
+        resize_pipes(pipefds, n_pipes, parse_pipe_size(assignments[i] + 14));
+      }
+    }
+    int assignments_only = n_assignments == command->len;
+    if (!assignments_only) {
+      drop_tokens(command, n_assignments);
+      expand_globs(command, parsed_input->arena);
+    }
+
+    /* Built-ins run in the shell, so their usage is that of the shell */
+    struct rusage usage_before;
+    if (times != NULL) {
+      times[n_command].start = now_ns();
+      getrusage(RUSAGE_SELF, &usage_before);
+    }
+
+    /* Built-ins run in the shell without creating a process. In a pipeline,
+     * built-ins that do not change the state of the shell run on a helper
+     * thread that reads from and writes to the pipes. Others, and all
+     * built-ins of background pipelines, run in a forked child, so that e.g.
+     * cd in a pipeline does not affect the shell.
+     */
+    const struct Builtin *builtin =
+        !assignments_only ? find_builtin(command->tokens[0]) : NULL;
+
+    /* Of the built-ins only those that start commands read their input or
+     * let commands read it
+     */
+    if (stdin_hook != NULL && n_command == 0 && !assignments_only &&
+        (builtin == NULL || builtin->starts_commands) &&
+        !redirects_fd(command, 0)) {
+      stdin_hook(stdin_hook_arg);
+    }
+    struct BuiltinIO io = {0, 1, 2};
+    int *opened = command->n_redirects > 0
+                      ? arena_alloc(parsed_input->arena,
+                                    sizeof(int) * command->n_redirects)
+                      : NULL;
+    if (n_command != 0) {
+      io.in = pipefds[2 * n_command - 2];
+    }
+    if (n_command != parsed_input->len - 1) {
+      io.out = pipefds[2 * n_command + 1];
+    }
+
+    if (assignments_only) {
+      /* Assignments on their own set shell variables, but like built-ins they
+       * do not affect the shell from a pipeline or the background.
+       */
+      if (parsed_input->len == 1 && !background) {
+        assign_variables(assignments, n_assignments);
+      }
+    } else if (builtin != NULL && parsed_input->len == 1 && !background &&
+               !(builtin->starts_commands && pgid != -1)) {
+      /* Output of earlier built-ins must not end up after that of this one */
+      fflush(stdout);
+      statuses[n_command] =
+          command->n_redirects == 0
+              ? run_builtin(builtin, command->len, command->tokens, &io)
+              : run_redirected_builtin(builtin, command, opened, &io);
+    } else if (builtin != NULL) {
+      fflush(stdout);
+      struct BuiltinThread *builtin_thread = &threads[n_command];
+      *builtin_thread = (struct BuiltinThread){
+          .builtin = builtin,
+          .argc = command->len,
+          .argv = command->tokens,
+          .io = io,
+          .times = times != NULL ? &times[n_command] : NULL};
+      /* Redirections replace descriptors, which threads share with the
+       * shell, so such built-ins are forked instead. So are they under job
+       * control: a thread is not part of the pipeline's process group, so
+       * Ctrl-Z would not stop it, and the shell would wait for a thread that
+       * blocks on a pipe whose reader is stopped.
+       */
+      if (builtin->in_thread && !background && pgid == -1 &&
+          command->n_redirects == 0 &&
+          start_builtin_thread(builtin_thread) == 0) {
+        /* The thread closes its pipe ends, the parent must not */
+        running[n_command] = 1;
+        if (io.in != 0) {
+          pipefds[2 * n_command - 2] = -1;
+        }
+        if (io.out != 1) {
+          pipefds[2 * n_command + 1] = -1;
+        }
+      } else {
+        struct SpawnFileActions redirects;
+        init_spawn_file_actions(&redirects);
+        int redirected =
+            add_redirect_actions(command, &redirects, opened) == 0;
+        pid_t pid = redirected ? fork_builtin(builtin, command->len,
+                                              command->tokens, &io, &redirects,
+                                              pipefds, 2 * n_pipes, pgid)
+                               : 0;
+        free_spawn_file_actions(&redirects);
+        close_redirect_files(opened, command->n_redirects);
+        if (!redirected) {
+          statuses[n_command] = 1;
+        } else if (pid == -1) {
+          printf("psh: %s: %s\n", command->tokens[0], strerror(errno));
+          statuses[n_command] = 126;
+          pid = 0;
+        } else if (pgid == 0) {
+          pgid = pid;
+          give_terminal(terminal_fd != -1 ? pgid : 0);
+        }
+        if (pid != 0) {
+          watch_child(pid);
+        }
+        pids[n_command] = pid;
       }
-      continue;
-    } else if (strcmp(parsed_input->commands[n_command]->tokens[0]->buffer,
-                      "pwd") == 0) {
-      /* pwd */
-      char *pwd = getenv("PWD");
-      printf("%s\n", pwd);
-      continue;
     } else {
-      /* From here on command is a regular one. First resolve its path. */
-      char *resolved =
-          resolve_path(parsed_input->commands[n_command]->tokens[0]->buffer);
+      /* From here on command is a regular one. First resolve its path, which
+       * a cached pipeline remembers unless the name contains a variable.
+       */
+      int remember_path = cached != NULL && !has_variables[n_assignments];
+      const char *path = remember_path
+                             ? cached_command_path(cached, n_command)
+                             : NULL;
+      char *resolved = path != NULL ? strdup(path)
+                                    : resolve_path(command->tokens[0]);
+      if (resolved != NULL && path == NULL && remember_path) {
+        remember_command_path(cached, n_command, resolved);
+      }
       if (resolved == NULL) {
-        printf("psh: no such file or directory %s\n",
-               parsed_input->commands[n_command]->tokens[0]->buffer);
-        free(resolved);
+        printf("psh: no such file or directory %s\n", command->tokens[0]);
+        statuses[n_command] = 127;
         break;
       }
 
-      pid_t pid = fork();
+      /* Output of earlier built-ins must not end up after that of the child */
+      fflush(stdout);
 
-      if (pid == 0) {
-        /* child process */
+      /* connect stdin and stdout of the child to the pipe, then apply the
+       * redirections on top
+       */
+      struct SpawnFileActions actions;
+      init_spawn_file_actions(&actions);
+      if (n_command != 0) {
+        add_dup2_action(&actions, pipefds[2 * n_command - 2], 0);
+      }
+      if (n_command != parsed_input->len - 1) {
+        add_dup2_action(&actions, pipefds[2 * n_command + 1], 1);
+      }
+      set_spawn_pgroup(&actions, pgid, terminal_fd);
+      int redirected = add_redirect_actions(command, &actions, opened) == 0;
 
-        /* change file descriptors to connect stdin and stdout to the pipe */
-        if (n_command != 0) {
-          dup2(pipefds[2 * n_command - 2], 0);
-        }
+      /* execute non-builtin command. The tokens of the command are NULL
+       * terminated and can be passed as argv as they are. The pipes are
+       * created with O_CLOEXEC, so the child does not need to close the ends
+       * it does not use. Assignments in front of the command only go to its
+       * environment.
+       */
+      pid_t pid = 0;
+      if (redirected) {
+        char **envp = n_assignments > 0
+                          ? variables_envp_with(assignments, n_assignments,
+                                                parsed_input->arena)
+                          : variables_envp();
+        pid = spawn_process(shell_spawn_backend(), resolved, command->tokens,
+                            envp, &actions);
+      }
+      free_spawn_file_actions(&actions);
+      close_redirect_files(opened, command->n_redirects);
 
-        if (n_command != parsed_input->len - 1) {
-          dup2(pipefds[2 * n_command + 1], 1);
+      if (!redirected) {
+        statuses[n_command] = 1;
+      } else if (pid == -1) {
+        int spawn_errno = errno;
+        printf("psh: %s: %s\n", command->tokens[0], strerror(spawn_errno));
+        if (path != NULL) {
+          /* The executable may have been removed since it was resolved */
+          invalidate_command_paths();
         }
-        extern char **environ;
+        statuses[n_command] = spawn_errno == EACCES ? 126 : 127;
+        pid = 0;
+      } else if (pgid == 0) {
+        pgid = pid;
+        give_terminal(terminal_fd != -1 ? pgid : 0);
+      }
+      if (pid != 0) {
+        watch_child(pid);
+      }
+      pids[n_command] = pid;
+      free(resolved);
+    }
 
-        for (int i = 0; i < 2 * n_pipes; i++) {
-          close(pipefds[i]);
-        }
+    if (times != NULL && pids[n_command] == 0 && !running[n_command]) {
+      times[n_command].end = now_ns();
+      getrusage(RUSAGE_SELF, &times[n_command].usage);
+      subtract_rusage(&times[n_command].usage, &usage_before);
+    }
 
-        /* collect tokens pointers in array as required for calling execve */
-        char **tokens = handled_malloc(
-            sizeof(char *) * (parsed_input->commands[n_command]->len + 1));
-        for (int i = 0; i < parsed_input->commands[n_command]->len + 1; i++) {
-          if (parsed_input->commands[n_command]->tokens[i] != NULL) {
-            tokens[i] = parsed_input->commands[n_command]->tokens[i]->buffer;
-          } else {
-            tokens[i] = NULL;
-            break;
-          }
-        }
+    /* The stage now owns its ends of the pipes, so close them in the parent.
+     * Otherwise readers further down the pipeline never see EOF.
+     */
+    if (n_command < parsed_input->len - 1 &&
+        pipefds[2 * n_command + 1] != -1) {
+      close(pipefds[2 * n_command + 1]);
+      pipefds[2 * n_command + 1] = -1;
+    }
+    if (n_command != 0 && pipefds[2 * n_command - 2] != -1) {
+      close(pipefds[2 * n_command - 2]);
+      pipefds[2 * n_command - 2] = -1;
+    }
+  }
 
-        /* execute non-builtin command */
-        execve(resolved, tokens, environ);
-        free(tokens);
-        free(resolved);
+  /* If the pipeline was cut short, close the pipes no stage was started for */
+  for (int i = 0; i < 2 * n_pipes; i++) {
+    if (pipefds[i] != -1) {
+      close(pipefds[i]);
+    }
+  }
 
-        /* execve does not return when successful, so this will only be
-         * reached if it errors.
-         */
-        _exit(127);
-      } else if (pid == -1) {
-        perror("fork");
-        exit(EXIT_FAILURE);
-      } else {
-        /* parent process */
+  /* A background pipeline becomes a job that is reaped later */
+  if (background) {
+    char *text = pipeline_text(parsed_input);
+    struct Job *job =
+        add_job(pgid > 0 ? pgid : 0, pids, n_started, text, JOB_RUNNING);
+    if (job_terminal_fd() != -1) {
+      fprintf(stderr, "[%d] %d\n", job->id,
+              job->n_processes > 0 ? job->processes[job->n_processes - 1].pid
+                                   : 0);
+    }
+    free(text);
+    free(times);
+    free(pids);
+    free(statuses);
+    free(threads);
+    free(running);
+    free(pipefds);
+    free_parsed_input(parsed_input);
+    last_status = 0;
+    return last_status;
+  }
 
-        /* for all but the last command close the write end of the pipe in the
-         * parent.
-         */
-        if (n_command < parsed_input->len - 1) {
-          close(pipefds[2 * n_command + 1]);
+  /* Reap all children of the pipeline after the last one has been forked, in
+   * the order in which they finish. Children of background jobs that finish
+   * in the meantime are recorded in the job table. If a stage is stopped,
+   * e.g. with Ctrl-Z, the rest of the pipeline becomes a stopped job.
+   */
+  int stopped = 0;
+  int n_running = 0;
+  for (int n_command = 0; n_command < n_started; n_command++) {
+    if (pids[n_command] != 0) {
+      n_running++;
+    }
+  }
+  while (n_running > 0 && !stopped) {
+    int status;
+    struct rusage usage;
+    pid_t pid = wait_child(&status, &usage, -1);
+    if (pid == -1) {
+      /* None of the stages is watched any more */
+      break;
+    }
+    int found = 0;
+    for (int n_command = 0; n_command < n_started; n_command++) {
+      if (pids[n_command] == pid) {
+        found = 1;
+        if (WIFCONTINUED(status)) {
+          /* Continued by someone else, the stage keeps running */
+          break;
+        }
+        statuses[n_command] = decode_status(status);
+        if (times != NULL) {
+          times[n_command].end = now_ns();
+          times[n_command].usage = usage;
         }
-        if (n_command != 0) {
-          close(pipefds[2 * n_command - 2]);
+        if (WIFSTOPPED(status) && pgid > 0) {
+          stopped = 1;
+        } else {
+          pids[n_command] = 0;
+          n_running--;
         }
+        break;
+      }
+    }
+    if (!found) {
+      update_job_process(pid, status);
+    }
+  }
 
-        int status;
-        if (waitpid(pid, &status, WUNTRACED | WCONTINUED) == -1) {
-          perror("waitpid");
-          exit(EXIT_FAILURE);
-        };
-      };
-      free(resolved);
-    };
+  if (pgid > 0) {
+    give_terminal(0);
+    /* The shell does not see the Ctrl-C, end the line of ^C for it */
+    for (int n_command = 0; n_command < n_started; n_command++) {
+      if (statuses[n_command] == 128 + SIGINT) {
+        fprintf(stderr, "\n");
+        break;
+      }
+    }
+  }
+  if (stopped) {
+    /* The processes that have not been reaped yet make up the job */
+    char *text = pipeline_text(parsed_input);
+    add_job(pgid, pids, n_started, text, JOB_STOPPED);
+    free(text);
+    fprintf(stderr, "\n");
+    notify_jobs();
+  }
+
+  /* Built-ins on helper threads finish once their output has been read.
+   * Without job control no stage can be stopped, so they always do.
+   */
+  for (int n_command = 0; n_command < n_started; n_command++) {
+    if (running[n_command]) {
+      pthread_join(threads[n_command].thread, NULL);
+      statuses[n_command] = threads[n_command].status;
+    }
+  }
+
+  if (times != NULL) {
+    print_times(parsed_input, times, n_started, now_ns() - pipeline_start);
+    free(times);
+  }
+
+  /* The status of a pipeline is the status of its last stage. With pipefail,
+   * it is the status of the last stage that failed instead.
+   */
+  last_status = statuses[n_started - 1];
+  if (shell_options.pipefail) {
+    for (int n_command = n_started - 1; n_command >= 0; n_command--) {
+      if (statuses[n_command] != 0) {
+        last_status = statuses[n_command];
+        break;
+      }
+    }
+  }
+  if (stopped) {
+    last_status = 128 + SIGTSTP;
   }
 
+  free(pids);
+  free(statuses);
+  free(threads);
+  free(running);
   free(pipefds);
-  free(input);
   free_parsed_input(parsed_input);
+  fflush(stdout);
+
+  return last_status;
 }
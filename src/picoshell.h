@@ -21,39 +21,112 @@
 #define PSH_PICOSHELL_H_
 
 #include "parser.h"
+#include "pipeline_cache.h"
+#include "spawn.h"
 
 /*
- * Resolves environment variables by replacing tokens starting with $ by the
- * value of the corresponding environment variable if it exists. Otherwise
- * replaces it with the empty string.
+ * Shell options that can be toggled with the set built-in, e.g.
+ * set -o pipefail.
  */
-void resolve_env_variables(struct Command *command);
+struct ShellOptions {
+  int pipefail;    /* Pipeline status is the last non-zero status of any
+                      stage. */
+  int posix_spawn;  /* Launch commands with posix_spawn instead of fork. The
+                       default is set with the PSH_POSIX_SPAWN build option. */
+  int spawn_server; /* Launch commands through the spawn server, see
+                       spawn_server.h. The default is set with the
+                       PSH_SPAWN_SERVER build option. */
+};
+
+extern struct ShellOptions shell_options;
+
+/*
+ * Returns the spawn backend selected by the shell options.
+ */
+SpawnBackend shell_spawn_backend();
+
+/*
+ * Expands the variables $NAME, ${NAME}, $? (exit status of the last pipeline)
+ * and $$ (pid of the shell) anywhere in the tokens of command, e.g.
+ * foo$HOME/bar or ${X}y, see vars.h. Unset variables expand to the empty
+ * string, a $ that is not followed by a name is kept. Each token is scanned
+ * once; tokens without variables are left as they are, expanded ones are
+ * allocated from arena.
+ */
+void resolve_env_variables(struct Command *command, struct Arena *arena);
 
 /*
  * Resolves full path of executable. If executable contains / it calls realpath
  * to expand the path. If executable does not contain /, e.g. "ls", resolve_path
- * searches the paths in the PATH environment variable. If successful, the
+ * searches the paths in the PATH environment variable, remembering the result
+ * in the command hash table (see command_hash.h). If successful, the
  * executable is replaced with the full path , e.g. "/usr/bin/ls", otherwise the
  * NULL pointer is returned.
  */
 char *resolve_path(char *executable);
 
 /*
- * Generates the prompt in the format:
- * username@host~>
- * and returns a pointer to it.
+ * Calls chdir and updates PWD and OLDPWD environment variables if chdir is
+ * successful. Returns 0 on success and 1 otherwise.
  */
-char *getprompt();
+int change_dir(char *dir);
 
 /*
- * Calls chdir and updates PWD and OLDPWD environment variables if chdir is
- * successful.
+ * Sets a function that is called with arg before a pipeline starts a stage
+ * that may read the shell's stdin, i.e. a command whose stdin is neither a
+ * pipe nor redirected, or NULL for none. Lets a buffered reader of stdin give
+ * back the input it has read ahead only when a command can read it.
+ */
+void set_stdin_hook(void (*hook)(void *arg), void *arg);
+
+/*
+ * Returns the exit status of the most recently executed pipeline.
+ */
+int last_exit_status();
+
+/*
+ * Sets the exit status of the most recently executed pipeline, e.g. to that of
+ * a compound command.
+ */
+void set_last_exit_status(int status);
+
+/*
+ * Decodes a status as returned by waitpid into an exit status, i.e. the exit
+ * code for normally terminated processes and 128 + the signal number for
+ * processes that were killed or stopped by a signal.
+ */
+int decode_status(int status);
+
+/*
+ * Executes one line of input. All stages of a pipeline run concurrently and
+ * the exit status of the last stage is returned (see ShellOptions.pipefail).
+ * The input is modified while parsing it, but remains owned by the caller.
+ *
+ * Lines with ; or compound commands are compiled and run as a script, see
+ * script.h. If a compound command is not closed by the end of the line,
+ * SCRIPT_INCOMPLETE is returned and the next lines continue it. The same
+ * holds for the bodies of here-documents, see heredoc.h.
+ */
+int execute_input(char *input);
+
+/*
+ * Returns whether the following lines continue the input, i.e. whether a
+ * script is being compiled or here-documents are being read.
+ */
+int input_pending();
+
+/*
+ * Drops input that has not been completed, e.g. at the end of the input, and
+ * prints an error.
  */
-void change_dir(struct Command *command);
+void discard_input();
 
 /*
- * Executes one line of input.
+ * Runs the pipeline parsed_input and frees it. cached holds the variable flags
+ * and the resolved paths of the pipeline (see pipeline_cache.h), or is NULL.
+ * Returns the exit status, which also becomes the status of the last pipeline.
  */
-void execute_input(char *input);
+int run_pipeline(struct ParsedInput *parsed_input,
+                 struct CachedPipeline *cached);
 
 #endif /* PSH_PICOSHELL_H_ */
\ No newline at end of file
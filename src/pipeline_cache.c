@@ -0,0 +1,204 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "utils.h"
+#include "vars.h"
+
+/* Number of hash buckets, twice the number of pipelines that can be cached. */
+#define N_BUCKETS (2 * PIPELINE_CACHE_SIZE)
+
+static struct CachedPipeline *buckets[N_BUCKETS];
+static struct CachedPipeline *newest = NULL;
+static struct CachedPipeline *oldest = NULL;
+static int n_pipelines = 0;
+
+static long long hits = 0;
+static long long misses = 0;
+static long long evictions = 0;
+
+/* Resolved paths are valid as long as they belong to the current epoch, which
+ * is advanced whenever they may have become stale. path_value is the PATH they
+ * were resolved with.
+ */
+static unsigned long path_epoch = 1;
+static char *path_value = NULL;
+
+static unsigned int hash_line(const char *line) {
+  /* 32 bit FNV-1a */
+  unsigned int hash = 2166136261u;
+  while (*line != '\0') {
+    hash ^= (unsigned char)*line++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void unlink_pipeline(struct CachedPipeline *pipeline) {
+  if (pipeline->newer != NULL) {
+    pipeline->newer->older = pipeline->older;
+  } else {
+    newest = pipeline->older;
+  }
+  if (pipeline->older != NULL) {
+    pipeline->older->newer = pipeline->newer;
+  } else {
+    oldest = pipeline->newer;
+  }
+}
+
+static void push_newest(struct CachedPipeline *pipeline) {
+  pipeline->newer = NULL;
+  pipeline->older = newest;
+  if (newest != NULL) {
+    newest->newer = pipeline;
+  } else {
+    oldest = pipeline;
+  }
+  newest = pipeline;
+}
+
+/*
+ * Removes pipeline from the cache and frees it.
+ */
+static void remove_pipeline(struct CachedPipeline *pipeline) {
+  struct CachedPipeline **link = &buckets[pipeline->hash % N_BUCKETS];
+  while (*link != pipeline) {
+    link = &(*link)->next_in_bucket;
+  }
+  *link = pipeline->next_in_bucket;
+  unlink_pipeline(pipeline);
+  n_pipelines--;
+  free_cached_pipeline(pipeline);
+}
+
+struct CachedPipeline *find_cached_pipeline(const char *line) {
+  unsigned int hash = hash_line(line);
+  for (struct CachedPipeline *pipeline = buckets[hash % N_BUCKETS];
+       pipeline != NULL; pipeline = pipeline->next_in_bucket) {
+    if (pipeline->hash == hash && strcmp(pipeline->line, line) == 0) {
+      if (pipeline != newest) {
+        unlink_pipeline(pipeline);
+        push_newest(pipeline);
+      }
+      hits++;
+      return pipeline;
+    }
+  }
+  misses++;
+  return NULL;
+}
+
+struct CachedPipeline *new_cached_pipeline(struct ParsedInput *parsed_input) {
+  struct ParsedInput *copy = copy_parsed_input(parsed_input);
+  struct CachedPipeline *pipeline =
+      arena_alloc(copy->arena, sizeof(struct CachedPipeline));
+  pipeline->line = NULL;
+  pipeline->hash = 0;
+  pipeline->parsed_input = copy;
+  pipeline->commands =
+      arena_alloc(copy->arena, sizeof(struct CachedCommand) * copy->len);
+  for (int i = 0; i < copy->len; i++) {
+    struct Command *command = &copy->commands[i];
+    struct CachedCommand *cached_command = &pipeline->commands[i];
+    cached_command->has_variables = arena_alloc(copy->arena, command->len);
+    for (int j = 0; j < command->len; j++) {
+      cached_command->has_variables[j] =
+          strchr(command->tokens[j], '$') != NULL;
+    }
+    cached_command->path = NULL;
+    cached_command->path_epoch = 0;
+  }
+  pipeline->next_in_bucket = NULL;
+  pipeline->newer = NULL;
+  pipeline->older = NULL;
+  return pipeline;
+}
+
+void free_cached_pipeline(struct CachedPipeline *pipeline) {
+  for (int i = 0; i < pipeline->parsed_input->len; i++) {
+    free(pipeline->commands[i].path);
+  }
+  free(pipeline->line);
+  /* Everything else lives in the arena of the parse */
+  free_parsed_input(pipeline->parsed_input);
+}
+
+struct CachedPipeline *cache_pipeline(char *line,
+                                      struct ParsedInput *parsed_input) {
+  if (n_pipelines == PIPELINE_CACHE_SIZE) {
+    remove_pipeline(oldest);
+    evictions++;
+  }
+
+  struct CachedPipeline *pipeline = new_cached_pipeline(parsed_input);
+  pipeline->line = line;
+  pipeline->hash = hash_line(line);
+  unsigned int bucket = pipeline->hash % N_BUCKETS;
+  pipeline->next_in_bucket = buckets[bucket];
+  buckets[bucket] = pipeline;
+  push_newest(pipeline);
+  n_pipelines++;
+  return pipeline;
+}
+
+const char *cached_command_path(struct CachedPipeline *pipeline,
+                                int n_command) {
+  /* Start a new epoch if PATH has changed since paths were resolved */
+  const char *path = get_variable("PATH");
+  if (path == NULL) {
+    path = "";
+  }
+  if (path_value == NULL || strcmp(path, path_value) != 0) {
+    free(path_value);
+    path_value = strdup(path);
+    path_epoch++;
+  }
+
+  struct CachedCommand *command = &pipeline->commands[n_command];
+  return command->path_epoch == path_epoch ? command->path : NULL;
+}
+
+void remember_command_path(struct CachedPipeline *pipeline, int n_command,
+                           const char *path) {
+  struct CachedCommand *command = &pipeline->commands[n_command];
+  free(command->path);
+  command->path = strdup(path);
+  command->path_epoch = path_epoch;
+}
+
+void invalidate_command_paths() { path_epoch++; }
+
+void clear_pipeline_cache() {
+  while (oldest != NULL) {
+    remove_pipeline(oldest);
+  }
+}
+
+void print_pipeline_cache(int fd) {
+  dprintf(fd,
+          "cache: %d/%d pipelines, %lld hits, %lld misses, %lld evictions\n",
+          n_pipelines, PIPELINE_CACHE_SIZE, hits, misses, evictions);
+}
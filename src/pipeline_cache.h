@@ -0,0 +1,117 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_PIPELINE_CACHE_H_
+#define PSH_PIPELINE_CACHE_H_
+
+#include "parser.h"
+
+/* Maximum number of pipelines kept in the cache. */
+#define PIPELINE_CACHE_SIZE 128
+
+/*
+ * Holds what is remembered about one command of a cached pipeline.
+ */
+struct CachedCommand {
+  unsigned char *has_variables; /* has_variables[i] is set if token i contains
+                                   a $ and must be expanded on every run. */
+  char *path;                   /* Full path of the executable, or NULL if it
+                                   has not been resolved yet. */
+  unsigned long path_epoch;     /* Epoch path was resolved in. */
+};
+
+/*
+ * Holds a line that has been run before, together with its parse and the
+ * resolved executables of its commands. Cached pipelines are kept in a hash
+ * table keyed by the line and in a list ordered by last use, so that the least
+ * recently used one is evicted when the cache is full.
+ */
+struct CachedPipeline {
+  char *line;                      /* The line exactly as it was read, or
+                                      NULL if not part of the cache. */
+  unsigned int hash;               /* Hash of line. */
+  struct ParsedInput *parsed_input; /* Parse of the line before expansion,
+                                       see copy_parsed_input(). */
+  struct CachedCommand *commands;  /* One per command of parsed_input. */
+  struct CachedPipeline *next_in_bucket;
+  struct CachedPipeline *newer;    /* Neighbours in the list ordered by */
+  struct CachedPipeline *older;    /* last use. */
+};
+
+/*
+ * Returns the cached pipeline of line and marks it as most recently used, or
+ * returns NULL if line is not cached. Counts a hit or a miss.
+ */
+struct CachedPipeline *find_cached_pipeline(const char *line);
+
+/*
+ * Adds line, which must have been allocated with malloc and is owned by the
+ * cache from now on, with a copy of parsed_input, its parse, evicting the
+ * least recently used pipeline if the cache is full. Returns the new cached
+ * pipeline, which stays valid until the next call of cache_pipeline() or
+ * clear_pipeline_cache().
+ */
+struct CachedPipeline *cache_pipeline(char *line,
+                                      struct ParsedInput *parsed_input);
+
+/*
+ * Returns a new cached pipeline for a copy of parsed_input that is not part of
+ * the cache, e.g. for a pipeline of a compiled script (see script.h), which
+ * must be freed with free_cached_pipeline().
+ */
+struct CachedPipeline *new_cached_pipeline(struct ParsedInput *parsed_input);
+
+/*
+ * Frees a pipeline returned by new_cached_pipeline().
+ */
+void free_cached_pipeline(struct CachedPipeline *pipeline);
+
+/*
+ * Returns the full path of the executable of command n_command of pipeline, or
+ * NULL if it has not been resolved since paths were last invalidated.
+ */
+const char *cached_command_path(struct CachedPipeline *pipeline,
+                                int n_command);
+
+/*
+ * Remembers path as the full path of the executable of command n_command of
+ * pipeline.
+ */
+void remember_command_path(struct CachedPipeline *pipeline, int n_command,
+                           const char *path);
+
+/*
+ * Forgets the resolved executables of all cached pipelines, e.g. after the
+ * working directory changed, which relative paths depend on, or after hash -r.
+ * Changes of PATH are detected by the cache itself.
+ */
+void invalidate_command_paths();
+
+/*
+ * Removes all pipelines from the cache.
+ */
+void clear_pipeline_cache();
+
+/*
+ * Prints the number of cached pipelines, hits, misses and evictions to the
+ * file descriptor fd.
+ */
+void print_pipeline_cache(int fd);
+
+#endif /* PSH_PIPELINE_CACHE_H_ */
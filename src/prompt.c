@@ -0,0 +1,577 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "prompt.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "picoshell.h"
+#include "utils.h"
+#include "vars.h"
+
+/* Segments shown if PSH_PROMPT is not set. */
+#define DEFAULT_SEGMENTS "user cwd vcs duration status"
+
+/* Maximum number of segments in PSH_PROMPT. */
+#define MAX_SEGMENTS 16
+
+/*
+ * Holds the text of a prompt while it is assembled.
+ */
+struct PromptText {
+  size_t len;
+  char data[1024];
+};
+
+/*
+ * Holds a single entry of the segment table.
+ */
+struct PromptSegment {
+  const char *name;                         /* Name used in PSH_PROMPT. */
+  void (*render)(struct PromptText *text);  /* Appends the segment. */
+  int slow;                                 /* Whether it is computed by the
+                                               worker. */
+};
+
+/*
+ * Holds what the worker computes the slow segments for. Replaced by the main
+ * thread before each prompt.
+ */
+struct PromptRequest {
+  char *cwd;            /* Working directory. */
+  char *git;            /* Full path of git, or NULL. */
+  char *envp[5];        /* Environment of git. */
+  long long generation; /* Number of the request. */
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int worker_started = 0;
+static struct PromptRequest request;
+/* Generation of the request the values below were computed for */
+static long long done_generation = 0;
+/* Directory and text of the vcs segment */
+static char *vcs_cwd = NULL;
+static char vcs_text[256];
+
+/* Written to by the worker when a value has changed */
+static int update_pipe[2] = {-1, -1};
+
+/* Prompt returned last, to tell whether an update changes it */
+static char *last_prompt = NULL;
+static long long command_duration = 0;
+
+static void append(struct PromptText *text, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(text->data + text->len, sizeof text->data - text->len,
+                    format, args);
+  va_end(args);
+  if (n > 0) {
+    text->len += n;
+    if (text->len >= sizeof text->data) {
+      text->len = sizeof text->data - 1;
+    }
+  }
+}
+
+static void render_user(struct PromptText *text) {
+  static char user_host[128];
+  if (user_host[0] == '\0') {
+    char hostname[64];
+    gethostname(hostname, sizeof hostname);
+    hostname[sizeof hostname - 1] = '\0';
+    const char *user = getlogin();
+    if (user == NULL) {
+      /* no controlling terminal or utmp entry, e.g. in containers */
+      user = get_variable("USER");
+    }
+    if (user == NULL) {
+      user = "psh";
+    }
+    snprintf(user_host, sizeof user_host, "%s@%s", user, hostname);
+  }
+  append(text, "%s", user_host);
+}
+
+static void render_cwd(struct PromptText *text) {
+  char *cwd = NULL;
+  const char *pwd = get_variable("PWD");
+  if (pwd == NULL) {
+    pwd = cwd = getcwd(NULL, 0);
+  }
+  if (pwd == NULL) {
+    return;
+  }
+  const char *home = get_variable("HOME");
+  size_t home_len = home != NULL ? strlen(home) : 0;
+  if (home_len > 1 && strncmp(pwd, home, home_len) == 0 &&
+      (pwd[home_len] == '/' || pwd[home_len] == '\0')) {
+    append(text, "~%s", pwd + home_len);
+  } else {
+    append(text, "%s", pwd);
+  }
+  free(cwd);
+}
+
+static void render_vcs(struct PromptText *text) {
+  pthread_mutex_lock(&lock);
+  /* A value computed for another directory would be misleading */
+  if (vcs_cwd != NULL && request.cwd != NULL &&
+      strcmp(vcs_cwd, request.cwd) == 0) {
+    append(text, "%s", vcs_text);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void render_duration(struct PromptText *text) {
+  long long seconds = command_duration / 1000000000;
+  if (seconds >= 60) {
+    append(text, "%lldm%02llds", seconds / 60, seconds % 60);
+  } else if (seconds >= 1) {
+    append(text, "%.1fs", command_duration / 1e9);
+  }
+}
+
+static void render_status(struct PromptText *text) {
+  if (last_exit_status() != 0) {
+    append(text, "[%d]", last_exit_status());
+  }
+}
+
+static const struct PromptSegment segments[] = {
+    {"user", render_user, 0},
+    {"cwd", render_cwd, 0},
+    {"vcs", render_vcs, 1},
+    {"duration", render_duration, 0},
+    {"status", render_status, 0},
+};
+
+/*
+ * Stores the segments named in PSH_PROMPT in selected and returns their
+ * number. Unknown names are skipped.
+ */
+static int select_segments(const struct PromptSegment **selected) {
+  const char *names = get_variable("PSH_PROMPT");
+  if (names == NULL) {
+    names = DEFAULT_SEGMENTS;
+  }
+  int n = 0;
+  while (*names != '\0' && n < MAX_SEGMENTS) {
+    size_t len = strcspn(names, " \t");
+    for (size_t i = 0; i < sizeof segments / sizeof segments[0]; i++) {
+      if (len > 0 && strlen(segments[i].name) == len &&
+          strncmp(segments[i].name, names, len) == 0) {
+        selected[n++] = &segments[i];
+      }
+    }
+    names += len;
+    names += strspn(names, " \t");
+  }
+  return n;
+}
+
+static char *compose_prompt(const struct PromptSegment **selected, int n) {
+  struct PromptText text = {.len = 0};
+  for (int i = 0; i < n; i++) {
+    size_t before = text.len;
+    if (text.len > 0) {
+      append(&text, " ");
+    }
+    size_t start = text.len;
+    selected[i]->render(&text);
+    /* Drop the separator of empty segments */
+    if (text.len == start) {
+      text.len = before;
+    }
+  }
+  text.data[text.len] = '\0';
+  append(&text, "> ");
+  return strdup(text.data);
+}
+
+static long long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Runs git status in worktree. Returns 1 if tracked files were modified, 0
+ * if not and -1 if that can not be told in time.
+ */
+static int git_dirty(const char *git, const char *worktree,
+                     char *const envp[]) {
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) == -1) {
+    return -1;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, pipefd[1], 1);
+  posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+  /* A process group of its own keeps Ctrl-C at the prompt away from git */
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t signals;
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  sigfillset(&signals);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP |
+                                      POSIX_SPAWN_SETSIGMASK |
+                                      POSIX_SPAWN_SETSIGDEF);
+
+  char *argv[] = {"git",         "-C",
+                  (char *)worktree, "status",
+                  "--porcelain", "--untracked-files=no",
+                  NULL};
+  pid_t pid;
+  int res = posix_spawn(&pid, git, &actions, &attr, argv, envp);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  close(pipefd[1]);
+  if (res != 0) {
+    close(pipefd[0]);
+    return -1;
+  }
+
+  /* Any output means modified files, there is no need to read the rest */
+  int dirty = -1;
+  long long deadline = now_ms() + PROMPT_TIMEOUT_MS;
+  struct pollfd fd = {.fd = pipefd[0], .events = POLLIN};
+  while (now_ms() < deadline) {
+    int n = poll(&fd, 1, deadline - now_ms());
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == 1) {
+      char c;
+      dirty = read(pipefd[0], &c, 1) == 1;
+    }
+    break;
+  }
+  close(pipefd[0]);
+  if (dirty != 0) {
+    kill(pid, SIGKILL);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) == pid && dirty == 0 &&
+      !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+    dirty = -1;
+  }
+  return dirty;
+}
+
+/*
+ * Looks for the repository containing cwd and writes the vcs segment to text.
+ */
+static void compute_vcs(const char *cwd, const char *git, char *const envp[],
+                        char *text, size_t size) {
+  text[0] = '\0';
+  size_t len = strlen(cwd);
+  char *dir = handled_malloc(len + 1);
+  memcpy(dir, cwd, len + 1);
+  size_t git_dir_size = len + PATH_MAX + 16;
+  char *git_dir = handled_malloc(git_dir_size);
+
+  /* Find the closest directory with a .git directory or file */
+  int found = 0;
+  while (!found) {
+    snprintf(git_dir, git_dir_size, "%s/.git", dir);
+    struct stat st;
+    int exists = stat(git_dir, &st) == 0;
+    if (exists && S_ISDIR(st.st_mode)) {
+      found = 1;
+    } else if (exists && S_ISREG(st.st_mode)) {
+      /* Work trees and submodules point to their git directory */
+      FILE *file = fopen(git_dir, "re");
+      char line[PATH_MAX];
+      if (file != NULL && fgets(line, sizeof line, file) != NULL &&
+          strncmp(line, "gitdir: ", 8) == 0) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[8] == '/') {
+          strcpy(git_dir, line + 8);
+        } else {
+          sprintf(git_dir, "%s/%s", dir, line + 8);
+        }
+        found = 1;
+      }
+      if (file != NULL) {
+        fclose(file);
+      }
+    }
+    if (!found) {
+      char *slash = strrchr(dir, '/');
+      if (slash == NULL || dir[1] == '\0') {
+        break;
+      }
+      /* The parent of /home is /, which is left as an empty string */
+      *slash = '\0';
+    }
+  }
+
+  if (found) {
+    char head[256] = "";
+    strcat(git_dir, "/HEAD");
+    FILE *file = fopen(git_dir, "re");
+    if (file != NULL) {
+      if (fgets(head, sizeof head, file) == NULL) {
+        head[0] = '\0';
+      }
+      fclose(file);
+    }
+    head[strcspn(head, "\n")] = '\0';
+
+    const char *branch = head;
+    if (strncmp(head, "ref: refs/heads/", 16) == 0) {
+      branch = head + 16;
+    } else if (strncmp(head, "ref: ", 5) == 0) {
+      branch = head + 5;
+    } else {
+      /* detached, show the abbreviated commit */
+      head[7] = '\0';
+    }
+    int dirty = git != NULL ? git_dirty(git, dir[0] != '\0' ? dir : "/", envp)
+                            : -1;
+    snprintf(text, size, dirty == 1 ? "(%s*)" : "(%s)", branch);
+  }
+  free(git_dir);
+  free(dir);
+}
+
+static void *worker_main(void *arg) {
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (request.generation == done_generation) {
+      pthread_cond_wait(&request_cond, &lock);
+    }
+    long long generation = request.generation;
+    char *cwd = strdup(request.cwd);
+    char *git = request.git != NULL ? strdup(request.git) : NULL;
+    char *envp[5] = {NULL};
+    for (int i = 0; request.envp[i] != NULL; i++) {
+      envp[i] = strdup(request.envp[i]);
+    }
+    pthread_mutex_unlock(&lock);
+
+    char text[sizeof vcs_text];
+    compute_vcs(cwd, git, envp, text, sizeof text);
+
+    pthread_mutex_lock(&lock);
+    int changed = vcs_cwd == NULL || strcmp(vcs_cwd, cwd) != 0 ||
+                  strcmp(vcs_text, text) != 0;
+    free(vcs_cwd);
+    vcs_cwd = cwd;
+    strcpy(vcs_text, text);
+    done_generation = generation;
+    pthread_cond_broadcast(&done_cond);
+    if (changed) {
+      char c = 0;
+      ssize_t res = write(update_pipe[1], &c, 1);
+      (void)res;
+    }
+
+    free(git);
+    for (int i = 0; envp[i] != NULL; i++) {
+      free(envp[i]);
+    }
+  }
+  return NULL;
+}
+
+static void start_worker() {
+  if (pipe2(update_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+    return;
+  }
+  /* Signals are left to the main thread, whose reads they interrupt */
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &saved);
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, worker_main, NULL) == 0) {
+    pthread_detach(thread);
+    worker_started = 1;
+  }
+  pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+/*
+ * Returns the full path of git, or NULL if it is not in PATH. Searched again
+ * only when PATH changes, without going through the hash table so that hash
+ * lists only the user's commands.
+ */
+static const char *find_git() {
+  static char *searched_path = NULL;
+  static char *git = NULL;
+  const char *path = get_variable("PATH");
+  if (path == NULL) {
+    path = "";
+  }
+  if (searched_path != NULL && strcmp(searched_path, path) == 0) {
+    return git;
+  }
+  free(searched_path);
+  free(git);
+  searched_path = strdup(path);
+  git = NULL;
+
+  const char *start = path;
+  while (git == NULL) {
+    size_t len = strcspn(start, ":");
+    if (len > 0) {
+      char *candidate = handled_malloc(len + sizeof "/git");
+      memcpy(candidate, start, len);
+      strcpy(candidate + len, "/git");
+      if (access(candidate, X_OK) == 0) {
+        git = candidate;
+      } else {
+        free(candidate);
+      }
+    }
+    if (start[len] == '\0') {
+      break;
+    }
+    start += len + 1;
+  }
+  return git;
+}
+
+static char *env_entry(const char *name) {
+  const char *value = get_variable(name);
+  if (value == NULL) {
+    return NULL;
+  }
+  size_t size = strlen(name) + strlen(value) + 2;
+  char *entry = handled_malloc(size);
+  snprintf(entry, size, "%s=%s", name, value);
+  return entry;
+}
+
+/*
+ * Hands the current directory to the worker and waits for it until the
+ * deadline.
+ */
+static void refresh_slow_segments() {
+  if (!worker_started) {
+    start_worker();
+  }
+  if (!worker_started) {
+    return;
+  }
+
+  char *cwd = NULL;
+  const char *pwd = get_variable("PWD");
+  if (pwd == NULL) {
+    pwd = cwd = getcwd(NULL, 0);
+  }
+  const char *git = find_git();
+
+  pthread_mutex_lock(&lock);
+  free(request.cwd);
+  free(request.git);
+  for (int i = 0; request.envp[i] != NULL; i++) {
+    free(request.envp[i]);
+  }
+  request.cwd = strdup(pwd != NULL ? pwd : "/");
+  request.git = git != NULL ? strdup(git) : NULL;
+  int n = 0;
+  request.envp[n++] = strdup("GIT_OPTIONAL_LOCKS=0");
+  char *entry;
+  if ((entry = env_entry("HOME")) != NULL) {
+    request.envp[n++] = entry;
+  }
+  if ((entry = env_entry("PATH")) != NULL) {
+    request.envp[n++] = entry;
+  }
+  request.envp[n] = NULL;
+  long long generation = ++request.generation;
+  pthread_cond_signal(&request_cond);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += PROMPT_DEADLINE_MS * 1000000L;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000;
+  deadline.tv_nsec %= 1000000000;
+  while (done_generation != generation &&
+         pthread_cond_timedwait(&done_cond, &lock, &deadline) == 0) {
+  }
+  pthread_mutex_unlock(&lock);
+  free(cwd);
+}
+
+static void drain_updates() {
+  char buffer[64];
+  while (update_pipe[0] != -1 &&
+         read(update_pipe[0], buffer, sizeof buffer) > 0) {
+  }
+}
+
+char *render_prompt() {
+  const struct PromptSegment *selected[MAX_SEGMENTS];
+  int n = select_segments(selected);
+  for (int i = 0; i < n; i++) {
+    if (selected[i]->slow) {
+      drain_updates();
+      refresh_slow_segments();
+      break;
+    }
+  }
+
+  char *prompt = compose_prompt(selected, n);
+  free(last_prompt);
+  last_prompt = strdup(prompt);
+  return prompt;
+}
+
+int prompt_update_fd() { return update_pipe[0]; }
+
+char *update_prompt() {
+  drain_updates();
+  const struct PromptSegment *selected[MAX_SEGMENTS];
+  char *prompt = compose_prompt(selected, select_segments(selected));
+  if (last_prompt != NULL && strcmp(prompt, last_prompt) == 0) {
+    free(prompt);
+    return NULL;
+  }
+  free(last_prompt);
+  last_prompt = strdup(prompt);
+  return prompt;
+}
+
+void set_command_duration(long long ns) { command_duration = ns; }
@@ -0,0 +1,71 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_PROMPT_H_
+#define PSH_PROMPT_H_
+
+/*
+ * The prompt is made of segments, selected and ordered by the space separated
+ * names in PSH_PROMPT:
+ *
+ *   user      user@host
+ *   cwd       working directory, with the home directory shown as ~
+ *   vcs       git branch, followed by * if tracked files were modified
+ *   duration  wall time of the last command line if it took 1s or longer
+ *   status    exit status of the last command line if it is not 0
+ *
+ * Empty segments are left out and the prompt ends with "> ". By default all
+ * segments are shown in the order above.
+ *
+ * Segments that have to run commands, i.e. vcs, are computed on a background
+ * worker. render_prompt() waits for it for at most PROMPT_DEADLINE_MS and
+ * shows the value computed for the same directory before otherwise. When the
+ * worker finishes later, prompt_update_fd() becomes readable and
+ * update_prompt() returns the prompt with the new value.
+ */
+
+/* Milliseconds render_prompt() waits for slow segments. */
+#define PROMPT_DEADLINE_MS 20
+
+/* Milliseconds after which the command of a slow segment is killed. */
+#define PROMPT_TIMEOUT_MS 2000
+
+/*
+ * Returns the prompt for the next line, which the caller frees.
+ */
+char *render_prompt();
+
+/*
+ * Returns a file descriptor that becomes readable when a slow segment has a
+ * new value, or -1 if no slow segment is shown.
+ */
+int prompt_update_fd();
+
+/*
+ * Returns the prompt with the values slow segments have now, if it differs
+ * from the prompt returned last, or NULL otherwise. The caller frees it.
+ */
+char *update_prompt();
+
+/*
+ * Records the wall time of the last command line for the duration segment.
+ */
+void set_command_duration(long long ns);
+
+#endif /* PSH_PROMPT_H_ */
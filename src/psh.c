@@ -17,21 +17,276 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <readline/history.h>
 #include <readline/readline.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "children.h"
+#include "completion.h"
+#include "history.h"
+#include "jobs.h"
 #include "picoshell.h"
+#include "prompt.h"
+#include "reader.h"
+#include "spawn_server.h"
+#include "utils.h"
+#include "vars.h"
 
-int main() {
-  /* Configure readline to auto-complete paths when the tab key is hit. */
+/* Number of history entries kept in memory unless HISTSIZE is set. */
+#define DEFAULT_HISTSIZE 1000
+
+/*
+ * Returns whether line is empty or a comment, e.g. the #! line of a script.
+ */
+static int is_comment(const char *line) {
+  while (*line == ' ' || *line == '\t') {
+    line++;
+  }
+  return *line == '#';
+}
+
+/*
+ * Returns the exit status of the input, which ends with status, the status of
+ * the last executed line. Input that ends within a compound command, e.g. an if
+ * without fi, or within a here-document is an error.
+ */
+static int finish_input(int status) {
+  if (input_pending()) {
+    discard_input();
+    return 2;
+  }
+  return status;
+}
+
+/*
+ * Gives back the input the reader of stdin has read ahead, for a command that
+ * reads stdin itself.
+ */
+static void sync_stdin(void *reader) { sync_line_reader(reader); }
+
+/*
+ * Executes the lines read from fd without readline and history. Returns the
+ * exit status of the last executed line.
+ */
+static int run_batch(int fd) {
+  struct LineReader *reader = new_line_reader(fd);
+  int status = 0;
+
+  /* Commands that read stdin must see the input after the current line */
+  if (fd == 0) {
+    set_stdin_hook(sync_stdin, reader);
+  }
+
+  char *line;
+  while ((line = read_line(reader)) != NULL) {
+    /* The lines of a here-document are taken as they are */
+    if (!input_pending() && is_comment(line)) {
+      continue;
+    }
+    status = execute_input(line);
+  }
+
+  set_stdin_hook(NULL, NULL);
+  free_line_reader(reader);
+  return finish_input(status);
+}
+
+/*
+ * Executes the newline separated commands passed with -c. Returns the exit
+ * status of the last executed line.
+ */
+static int run_string(const char *commands) {
+  char *copy = strdup(commands);
+  char *rest = copy;
+  int status = 0;
+
+  char *line;
+  while ((line = strsep(&rest, "\n")) != NULL) {
+    if (input_pending() || !is_comment(line)) {
+      status = execute_input(line);
+    }
+  }
+
+  free(copy);
+  return finish_input(status);
+}
+
+/*
+ * Reads a character like readline's own rl_getc(), and redraws the prompt
+ * while waiting if a slow prompt segment gets a new value. Background jobs
+ * are reaped as soon as they change their state.
+ */
+static int read_key(FILE *stream) {
+  while (1) {
+    /* Only the children of jobs change their state at the prompt */
+    int child_fd = find_job(NULL) != NULL ? child_event_fd() : -1;
+    struct pollfd fds[] = {{.fd = fileno(stream), .events = POLLIN},
+                           {.fd = prompt_update_fd(), .events = POLLIN},
+                           {.fd = child_fd, .events = POLLIN}};
+    if (poll(fds, 3, -1) == -1) {
+      if (errno != EINTR) {
+        return rl_getc(stream);
+      }
+      rl_check_signals();
+      continue;
+    }
+    if (fds[2].revents & POLLIN) {
+      reap_jobs();
+    }
+    if ((fds[1].revents & POLLIN) && !input_pending() &&
+        !RL_ISSTATE(RL_STATE_ISEARCH | RL_STATE_NSEARCH)) {
+      char *prompt = update_prompt();
+      if (prompt != NULL) {
+        rl_clear_visible_line();
+        rl_set_prompt(prompt);
+        rl_forced_update_display();
+        free(prompt);
+      }
+    }
+    if (fds[0].revents != 0) {
+      return rl_getc(stream);
+    }
+  }
+}
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Completes command names from the index of completion.c where a command name
+ * is expected. Elsewhere, and if no command matches, readline falls back to
+ * completing file names.
+ */
+static char **complete_line(const char *text, int start, int end) {
+  if (strchr(text, '/') != NULL || !completes_command(rl_line_buffer, start)) {
+    return NULL;
+  }
+  return rl_completion_matches(text, complete_command);
+}
+
+/*
+ * Opens the history file HISTFILE, ~/.psh_history by default, and loads its
+ * last HISTSIZE entries into readline, which keeps at most that many in
+ * memory.
+ */
+static void start_history() {
+  const char *size = get_variable("HISTSIZE");
+  int max_entries = size != NULL ? atoi(size) : DEFAULT_HISTSIZE;
+  if (max_entries <= 0) {
+    max_entries = DEFAULT_HISTSIZE;
+  }
+  stifle_history(max_entries);
+
+  const char *file = get_variable("HISTFILE");
+  char *default_file = NULL;
+  if (file == NULL) {
+    const char *home = get_variable("HOME");
+    if (home == NULL) {
+      return;
+    }
+    size_t file_size = strlen(home) + sizeof "/.psh_history";
+    default_file = handled_malloc(file_size);
+    snprintf(default_file, file_size, "%s/.psh_history", home);
+    file = default_file;
+  }
+  if (open_history(file) == 0) {
+    load_recent_history(max_entries, add_history);
+  }
+  free(default_file);
+}
+
+/*
+ * Reads lines with readline and executes them until the end of the input.
+ * Returns the exit status of the last executed line.
+ */
+static int run_interactive() {
+  /* Configure readline to auto-complete commands and paths when the tab key
+   * is hit.
+   */
   rl_bind_key('\t', rl_complete);
+  rl_attempted_completion_function = complete_line;
+  rl_getc_function = read_key;
+  start_history();
 
-  char *prompt = getprompt();
+  int status = 0;
 
   while (1) {
-    /* Main execution loop reading input lines and executing them. */
+    /* Main execution loop reading input lines and executing them. Jobs that
+     * finished or stopped since the last prompt are reported first.
+     */
+    reap_jobs();
+    notify_jobs();
+    char *prompt = input_pending() ? strdup("> ") : render_prompt();
     char *input = readline(prompt);
-    execute_input(input);
+    free(prompt);
+    if (input == NULL) {
+      /* end of input, e.g. Ctrl-D, which also drops an unfinished script or
+       * here-document
+       */
+      printf("\n");
+      if (input_pending()) {
+        status = finish_input(status);
+        continue;
+      }
+      break;
+    }
+    if (input[0] != '\0') {
+      add_history(input);
+      add_history_entry(input);
+    }
+    long long start = now_ns();
+    status = execute_input(input);
+    set_command_duration(now_ns() - start);
+    free(input);
+  }
+
+  close_history();
+  return status;
+}
+
+int main(int argc, char **argv) {
+  /* Start the spawn server while the shell is as small as it gets */
+  if (shell_options.spawn_server) {
+    start_spawn_server();
+  }
+
+  int interactive = argc == 1 && isatty(0);
+  init_job_control(interactive);
+
+  if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+    if (argc < 3) {
+      fprintf(stderr, "psh: -c: option requires an argument\n");
+      return 2;
+    }
+    return run_string(argv[2]);
+  }
+
+  if (argc > 1) {
+    /* Run a script. O_CLOEXEC keeps it from leaking into commands. */
+    int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      fprintf(stderr, "psh: %s: %s\n", argv[1], strerror(errno));
+      return 127;
+    }
+    int status = run_batch(fd);
+    close(fd);
+    return status;
+  }
+
+  if (!isatty(0)) {
+    /* Commands piped into psh */
+    return run_batch(0);
   }
 
-  return 0;
+  return run_interactive();
 }
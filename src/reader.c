@@ -0,0 +1,119 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "reader.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/* Size of the chunks input is read in. */
+#define READ_CHUNK_SIZE 65536
+
+struct LineReader *new_line_reader(int fd) {
+  struct LineReader *reader = handled_malloc(sizeof(struct LineReader));
+  reader->fd = fd;
+  /* One extra byte, so the last line can always be NUL terminated */
+  reader->buffer = handled_malloc(READ_CHUNK_SIZE + 1);
+  reader->size = READ_CHUNK_SIZE;
+  reader->start = 0;
+  reader->end = 0;
+  reader->eof = 0;
+  return reader;
+}
+
+void free_line_reader(struct LineReader *reader) {
+  if (reader != NULL) {
+    free(reader->buffer);
+    free(reader);
+  }
+}
+
+/*
+ * Reads the next chunk, after moving the incomplete line at the end of the
+ * buffer to its start. Grows the buffer if the incomplete line fills all of it.
+ * Returns the number of bytes read, 0 at the end of the input and -1 on error.
+ */
+static ssize_t fill_buffer(struct LineReader *reader) {
+  if (reader->start > 0) {
+    memmove(reader->buffer, reader->buffer + reader->start,
+            reader->end - reader->start);
+    reader->end -= reader->start;
+    reader->start = 0;
+  }
+  if (reader->end == reader->size) {
+    reader->size *= 2;
+    reader->buffer = handled_realloc(reader->buffer, reader->size + 1);
+  }
+
+  ssize_t n_read;
+  do {
+    n_read = read(reader->fd, reader->buffer + reader->end,
+                  reader->size - reader->end);
+  } while (n_read == -1 && errno == EINTR);
+
+  if (n_read > 0) {
+    reader->end += n_read;
+  }
+  return n_read;
+}
+
+char *read_line(struct LineReader *reader) {
+  size_t scanned = reader->start;
+  while (1) {
+    char *newline =
+        memchr(reader->buffer + scanned, '\n', reader->end - scanned);
+    if (newline != NULL) {
+      char *line = reader->buffer + reader->start;
+      *newline = '\0';
+      reader->start = newline - reader->buffer + 1;
+      return line;
+    }
+
+    if (reader->eof) {
+      break;
+    }
+    /* Remember how far we have scanned, relative to the unconsumed input */
+    scanned = reader->end - reader->start;
+    ssize_t n_read = fill_buffer(reader);
+    if (n_read <= 0) {
+      reader->eof = 1;
+    }
+  }
+
+  /* Last line of the input without a trailing newline */
+  if (reader->start < reader->end) {
+    char *line = reader->buffer + reader->start;
+    reader->buffer[reader->end] = '\0';
+    reader->start = reader->end;
+    return line;
+  }
+  return NULL;
+}
+
+void sync_line_reader(struct LineReader *reader) {
+  off_t unread = reader->end - reader->start;
+  if (unread > 0 && lseek(reader->fd, -unread, SEEK_CUR) != -1) {
+    reader->start = 0;
+    reader->end = 0;
+  }
+}
@@ -0,0 +1,63 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_READER_H_
+#define PSH_READER_H_
+
+#include <stddef.h>
+
+/*
+ * Holds the state of a buffered line reader. Input is read in large chunks,
+ * so reading a script costs one read() per chunk rather than per line.
+ */
+struct LineReader {
+  int fd;         /* File descriptor lines are read from. */
+  char *buffer;   /* Holds the chunk that is currently consumed. */
+  size_t size;    /* Number of bytes allocated for buffer. */
+  size_t start;   /* Offset of the first byte not yet returned. */
+  size_t end;     /* Offset after the last byte read into buffer. */
+  int eof;        /* Whether read() has reported the end of the input. */
+};
+
+/*
+ * Creates a new line reader for fd. The reader does not take ownership of fd.
+ */
+struct LineReader *new_line_reader(int fd);
+
+/*
+ * Frees the memory allocated for the line reader.
+ */
+void free_line_reader(struct LineReader *reader);
+
+/*
+ * Returns the next line without its trailing newline, or NULL at the end of
+ * the input or if reading fails. The line is stored in the reader's buffer,
+ * may be modified by the caller and stays valid until the next call.
+ */
+char *read_line(struct LineReader *reader);
+
+/*
+ * Moves the file offset of fd back to the start of the first line not yet
+ * returned and discards the buffered input, if fd is seekable. Required
+ * before running commands that share fd as their stdin, so that they see the
+ * input that follows the current line.
+ */
+void sync_line_reader(struct LineReader *reader);
+
+#endif /* PSH_READER_H_ */
@@ -0,0 +1,456 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "script.h"
+
+#include <ctype.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heredoc.h"
+#include "picoshell.h"
+#include "utils.h"
+#include "vars.h"
+#include "wildcard.h"
+
+/*
+ * Enum of the parts of a compound command that commands are added to.
+ */
+typedef enum {
+  PART_CONDITION,
+  PART_THEN,
+  PART_ELSE,
+  PART_HEADER,
+  PART_BODY,
+} NodePart;
+
+/*
+ * Holds a compound command that has been opened but not closed yet.
+ */
+struct Frame {
+  struct Node *node;
+  NodePart part;       /* Part the following commands belong to. */
+  struct Node **tail;  /* Link the next command of the part goes to, or NULL
+                          if the part can not hold commands. */
+};
+
+/*
+ * Holds a script while it is compiled. Frames form a stack of the compound
+ * commands that are open, innermost last.
+ */
+struct Script {
+  struct Arena *arena;    /* Owns the nodes and the words of for loops. */
+  struct Node *commands;  /* Top level commands of the script. */
+  struct Node **tail;     /* Link the next top level command goes to. */
+  struct Frame *frames;
+  int n_frames;
+  int max_frames;
+};
+
+/* Words that start or continue a compound command, if they come first. */
+static const char *keywords[] = {"if",    "then", "elif", "else", "fi",
+                                 "while", "until", "do",  "done", "for"};
+static const int n_keywords = 10;
+
+/* Script whose compound commands have not all been closed yet. */
+static struct Script *script = NULL;
+
+/* Set when a pipeline was interrupted with Ctrl-C, which ends the script. */
+static int interrupted = 0;
+
+static int is_keyword(const char *word, size_t len) {
+  for (int i = 0; i < n_keywords; i++) {
+    if (strlen(keywords[i]) == len && memcmp(word, keywords[i], len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int is_script_line(const char *line) {
+  if (strchr(line, ';') != NULL) {
+    return 1;
+  }
+  while (isspace((unsigned char)*line)) {
+    line++;
+  }
+  return is_keyword(line, strcspn(line, " \t|&\""));
+}
+
+int script_pending() { return script != NULL; }
+
+static struct Script *new_script() {
+  struct Script *new = handled_malloc(sizeof(struct Script));
+  new->arena = new_arena(1024);
+  new->commands = NULL;
+  new->tail = &new->commands;
+  new->frames = NULL;
+  new->n_frames = 0;
+  new->max_frames = 0;
+  return new;
+}
+
+static void free_nodes(struct Node *node) {
+  while (node != NULL) {
+    if (node->pipeline != NULL) {
+      free_cached_pipeline(node->pipeline);
+    }
+    free_nodes(node->condition);
+    free_nodes(node->body);
+    free_nodes(node->otherwise);
+    node = node->next;
+  }
+}
+
+static void free_script(struct Script *old) {
+  free_nodes(old->commands);
+  free_arena(old->arena);
+  free(old->frames);
+  free(old);
+}
+
+static struct Node *new_node(NodeType type) {
+  struct Node *node = arena_alloc(script->arena, sizeof(struct Node));
+  memset(node, 0, sizeof(struct Node));
+  node->type = type;
+  return node;
+}
+
+static struct Frame *top_frame() {
+  return script->n_frames > 0 ? &script->frames[script->n_frames - 1] : NULL;
+}
+
+static void push_frame(struct Node *node, NodePart part, struct Node **tail) {
+  if (script->n_frames == script->max_frames) {
+    script->max_frames = script->max_frames == 0 ? 8 : 2 * script->max_frames;
+    script->frames = handled_realloc(
+        script->frames, sizeof(struct Frame) * script->max_frames);
+  }
+  script->frames[script->n_frames++] = (struct Frame){node, part, tail};
+}
+
+static int parse_error(const char *near) {
+  printf("psh: parse error near %s\n", near);
+  return -1;
+}
+
+/*
+ * Appends node to the innermost open part. Returns 0 on success and -1 if that
+ * part can not hold commands, e.g. the header of a for loop before its do.
+ */
+static int append_node(struct Node *node, const char *word) {
+  struct Frame *frame = top_frame();
+  struct Node ***tail = frame != NULL ? &frame->tail : &script->tail;
+  if (*tail == NULL) {
+    return parse_error(word);
+  }
+  **tail = node;
+  *tail = &node->next;
+  return 0;
+}
+
+static int add_pipeline(struct ParsedInput *parsed_input) {
+  struct Node *node = new_node(NODE_PIPELINE);
+  if (append_node(node, parsed_input->commands[0].tokens[0]) != 0) {
+    return -1;
+  }
+  node->pipeline = new_cached_pipeline(parsed_input);
+  /* The bodies of its here-documents follow the line */
+  expect_heredocs(node->pipeline->parsed_input);
+  return 0;
+}
+
+/*
+ * Compiles the header of a for loop, NAME [in WORD...], given as command.
+ */
+static int compile_for(struct Command *command) {
+  if (command->len == 0 || !is_variable_name(command->tokens[0],
+                                             strlen(command->tokens[0]))) {
+    return parse_error(command->len > 0 ? command->tokens[0] : "for");
+  }
+  if (command->len > 1 && strcmp(command->tokens[1], "in") != 0) {
+    return parse_error(command->tokens[1]);
+  }
+
+  struct Node *node = new_node(NODE_FOR);
+  if (append_node(node, "for") != 0) {
+    return -1;
+  }
+  node->name = arena_strndup(script->arena, command->tokens[0],
+                             strlen(command->tokens[0]));
+  node->words.len = command->len > 1 ? command->len - 2 : 0;
+  node->words.tokens =
+      arena_alloc(script->arena, sizeof(char *) * (node->words.len + 1));
+  node->words.quoted = arena_alloc(script->arena, node->words.len + 1);
+  for (int i = 0; i < node->words.len; i++) {
+    char *word = command->tokens[i + 2];
+    node->words.tokens[i] = arena_strndup(script->arena, word, strlen(word));
+    node->words.quoted[i] =
+        command->quoted != NULL && command->quoted[i + 2];
+  }
+  node->words.tokens[node->words.len] = NULL;
+  push_frame(node, PART_HEADER, NULL);
+  return 0;
+}
+
+/*
+ * Compiles keyword, which has been removed from the front of parsed_input.
+ * What remains of parsed_input is the command that follows the keyword, e.g.
+ * the condition after if, which is left for the caller.
+ */
+static int compile_keyword(const char *keyword,
+                           struct ParsedInput *parsed_input) {
+  struct Command *rest = &parsed_input->commands[0];
+  if (rest->len == 0 && parsed_input->len > 1) {
+    return parse_error("|");
+  }
+  int is_for = strcmp(keyword, "for") == 0;
+  if (is_for && parsed_input->len > 1) {
+    return parse_error("|");
+  }
+  if (parsed_input->background && (rest->len == 0 || is_for)) {
+    return parse_error("&");
+  }
+
+  struct Frame *frame = top_frame();
+  NodeType type = frame != NULL ? frame->node->type : NODE_PIPELINE;
+  NodePart part = frame != NULL ? frame->part : PART_CONDITION;
+  int is_loop = type == NODE_WHILE || type == NODE_UNTIL || type == NODE_FOR;
+
+  if (strcmp(keyword, "if") == 0 || strcmp(keyword, "while") == 0 ||
+      strcmp(keyword, "until") == 0) {
+    struct Node *node = new_node(keyword[0] == 'i'   ? NODE_IF
+                                 : keyword[0] == 'w' ? NODE_WHILE
+                                                     : NODE_UNTIL);
+    if (append_node(node, keyword) != 0) {
+      return -1;
+    }
+    push_frame(node, PART_CONDITION, &node->condition);
+  } else if (strcmp(keyword, "then") == 0) {
+    if (type != NODE_IF || part != PART_CONDITION ||
+        frame->node->condition == NULL) {
+      return parse_error(keyword);
+    }
+    frame->part = PART_THEN;
+    frame->tail = &frame->node->body;
+  } else if (strcmp(keyword, "elif") == 0 || strcmp(keyword, "else") == 0) {
+    if (type != NODE_IF || part != PART_THEN || frame->node->body == NULL) {
+      return parse_error(keyword);
+    }
+    if (keyword[2] == 'i') {
+      /* elif continues with an if in the else part, closed by the same fi */
+      struct Node *node = new_node(NODE_IF);
+      frame->node->otherwise = node;
+      *frame = (struct Frame){node, PART_CONDITION, &node->condition};
+    } else {
+      frame->part = PART_ELSE;
+      frame->tail = &frame->node->otherwise;
+    }
+  } else if (strcmp(keyword, "fi") == 0) {
+    if (type != NODE_IF || (part != PART_THEN && part != PART_ELSE) ||
+        (part == PART_THEN ? frame->node->body
+                           : frame->node->otherwise) == NULL) {
+      return parse_error(keyword);
+    }
+    script->n_frames--;
+  } else if (strcmp(keyword, "do") == 0) {
+    if (!is_loop ||
+        (type == NODE_FOR ? part != PART_HEADER
+                          : part != PART_CONDITION ||
+                                frame->node->condition == NULL)) {
+      return parse_error(keyword);
+    }
+    frame->part = PART_BODY;
+    frame->tail = &frame->node->body;
+  } else if (strcmp(keyword, "done") == 0) {
+    if (!is_loop || part != PART_BODY || frame->node->body == NULL) {
+      return parse_error(keyword);
+    }
+    script->n_frames--;
+  } else {
+    /* The header takes up the rest of the command */
+    int res = compile_for(rest);
+    rest->len = 0;
+    return res;
+  }
+
+  /* Closing keywords stand alone, the others can be followed by a command */
+  if (rest->len > 0 &&
+      (strcmp(keyword, "fi") == 0 || strcmp(keyword, "done") == 0)) {
+    return parse_error(rest->tokens[0]);
+  }
+  return 0;
+}
+
+/*
+ * Compiles text, one of the ; separated parts of a line.
+ */
+static int compile_segment(char *text) {
+  struct ParsedInput *parsed_input = parse_input(text);
+  if (parsed_input == NULL) {
+    return -1;
+  }
+
+  /* Keywords can follow each other, e.g. in then if or do done */
+  int res = 0;
+  struct Command *first = &parsed_input->commands[0];
+  while (res == 0 && parsed_input->len > 0 && first->len > 0 &&
+         is_keyword(first->tokens[0], strlen(first->tokens[0]))) {
+    const char *keyword = first->tokens[0];
+    drop_tokens(first, 1);
+    res = compile_keyword(keyword, parsed_input);
+  }
+  if (res == 0 && parsed_input->len > 0 && first->len > 0) {
+    res = add_pipeline(parsed_input);
+  }
+  free_parsed_input(parsed_input);
+  return res;
+}
+
+/*
+ * Splits line at each ; outside of double quotes and compiles the parts.
+ */
+static int compile_line(char *line) {
+  char *segment = line;
+  int quoted = 0;
+  for (char *c = line;; c++) {
+    if (*c == '"') {
+      quoted = !quoted;
+    } else if ((*c == ';' && !quoted) || *c == '\0') {
+      char end = *c;
+      *c = '\0';
+      if (compile_segment(segment) != 0) {
+        return -1;
+      }
+      if (end == '\0') {
+        return 0;
+      }
+      segment = c + 1;
+    }
+  }
+}
+
+static int run_commands(struct Node *node);
+
+static int run_node(struct Node *node) {
+  int status = 0;
+  switch (node->type) {
+    case NODE_PIPELINE:
+      /* Run a copy, the compiled pipeline is reused by the next iteration */
+      status = run_pipeline(copy_parsed_input(node->pipeline->parsed_input),
+                            node->pipeline);
+      if (status == 128 + SIGINT) {
+        interrupted = 1;
+      }
+      break;
+
+    case NODE_IF:
+      status = run_commands(node->condition);
+      if (interrupted) {
+        break;
+      }
+      if (status == 0) {
+        status = run_commands(node->body);
+      } else {
+        /* Without an else part the status of an if is 0 */
+        status = run_commands(node->otherwise);
+      }
+      break;
+
+    case NODE_WHILE:
+    case NODE_UNTIL:
+      while (!interrupted) {
+        int condition = run_commands(node->condition);
+        if (interrupted || (condition == 0) != (node->type == NODE_WHILE)) {
+          break;
+        }
+        status = run_commands(node->body);
+      }
+      break;
+
+    case NODE_FOR: {
+      /* The words are expanded once, before the first iteration */
+      struct Arena *arena = new_arena(256);
+      struct Command words = {.len = node->words.len,
+                              .quoted = node->words.quoted};
+      words.tokens = arena_alloc(arena, sizeof(char *) * (words.len + 1));
+      memcpy(words.tokens, node->words.tokens,
+             sizeof(char *) * (words.len + 1));
+      resolve_env_variables(&words, arena);
+      expand_globs(&words, arena);
+      for (int i = 0; i < words.len && !interrupted; i++) {
+        set_variable(node->name, words.tokens[i]);
+        status = run_commands(node->body);
+      }
+      free_arena(arena);
+      break;
+    }
+  }
+
+  /* $? after a compound command is its status */
+  if (node->type != NODE_PIPELINE) {
+    set_last_exit_status(status);
+  }
+  return status;
+}
+
+/*
+ * Runs the list of commands starting with node and returns the status of the
+ * last one, or 0 if the list is empty.
+ */
+static int run_commands(struct Node *node) {
+  int status = 0;
+  for (; node != NULL && !interrupted; node = node->next) {
+    status = run_node(node);
+  }
+  return status;
+}
+
+int execute_script_line(char *line) {
+  if (script == NULL) {
+    script = new_script();
+  }
+  if (compile_line(line) != 0) {
+    discard_heredocs();
+    free_script(script);
+    script = NULL;
+    return 2;
+  }
+  if (script->n_frames > 0 || heredoc_pending()) {
+    return SCRIPT_INCOMPLETE;
+  }
+
+  /* The script is complete, detach it before running it */
+  struct Script *complete = script;
+  script = NULL;
+  interrupted = 0;
+  int status = run_commands(complete->commands);
+  free_script(complete);
+  return status;
+}
+
+void discard_script() {
+  if (script != NULL) {
+    printf("psh: parse error: unexpected end of input\n");
+    free_script(script);
+    script = NULL;
+  }
+}
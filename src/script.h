@@ -0,0 +1,90 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_SCRIPT_H_
+#define PSH_SCRIPT_H_
+
+#include "arena.h"
+#include "parser.h"
+#include "pipeline_cache.h"
+
+/* Returned by execute_script_line() while a compound command is open. */
+#define SCRIPT_INCOMPLETE -1
+
+/*
+ * Enum of the kinds of nodes a script is compiled into.
+ */
+typedef enum {
+  NODE_PIPELINE,
+  NODE_IF,
+  NODE_WHILE,
+  NODE_UNTIL,
+  NODE_FOR,
+} NodeType;
+
+/*
+ * Holds one command of a compiled script. Lists of commands, e.g. the body of
+ * a loop, are linked through next.
+ *
+ * Each pipeline is parsed once while compiling and kept together with the
+ * tokens that need expansion and the resolved executables, see
+ * pipeline_cache.h. Running a loop body only copies the parsed pipelines.
+ */
+struct Node {
+  NodeType type;
+  struct CachedPipeline *pipeline; /* NODE_PIPELINE: the pipeline to run. */
+  struct Node *condition;  /* NODE_IF, NODE_WHILE, NODE_UNTIL: the commands
+                              whose status decides. */
+  struct Node *body;       /* Then part of an if, body of a loop. */
+  struct Node *otherwise;  /* Else part of an if, an if for elif, or NULL. */
+  char *name;              /* NODE_FOR: name of the loop variable. */
+  struct Command words;    /* NODE_FOR: the words iterated over, expanded
+                              and globbed each time the loop starts. */
+  struct Node *next;       /* Next command of the same list. */
+};
+
+/*
+ * Returns whether line has to be compiled as a script rather than run as a
+ * single pipeline, i.e. if it contains a ; or starts with a keyword like if or
+ * while.
+ */
+int is_script_line(const char *line);
+
+/*
+ * Adds line to the script being compiled. Once all compound commands opened so
+ * far are closed, e.g. an if by its fi, the script runs and its exit status is
+ * returned. Until then nothing runs and SCRIPT_INCOMPLETE is returned, so that
+ * the caller can read continuation lines. Returns 2 and drops the script if
+ * line can not be compiled.
+ */
+int execute_script_line(char *line);
+
+/*
+ * Returns whether a script is being compiled, i.e. whether the following lines
+ * continue it.
+ */
+int script_pending();
+
+/*
+ * Drops a script whose compound commands have not been closed, e.g. at the end
+ * of the input, and prints an error.
+ */
+void discard_script();
+
+#endif /* PSH_SCRIPT_H_ */
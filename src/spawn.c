@@ -0,0 +1,229 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "spawn.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "spawn_server.h"
+#include "utils.h"
+
+void init_spawn_file_actions(struct SpawnFileActions *actions) {
+  actions->actions = handled_malloc(sizeof(struct SpawnFileAction) * 4);
+  actions->max_len = 4;
+  actions->len = 0;
+  actions->pgroup = -1;
+  actions->terminal_fd = -1;
+}
+
+void free_spawn_file_actions(struct SpawnFileActions *actions) {
+  free(actions->actions);
+  actions->actions = NULL;
+  actions->max_len = 0;
+  actions->len = 0;
+}
+
+static struct SpawnFileAction *append_action(
+    struct SpawnFileActions *actions) {
+  /* reallocate larger (double size) buffer if necessary */
+  if (actions->len == actions->max_len) {
+    actions->max_len *= 2;
+    actions->actions =
+        handled_realloc(actions->actions,
+                        sizeof(struct SpawnFileAction) * actions->max_len);
+  }
+  return &actions->actions[actions->len++];
+}
+
+void add_dup2_action(struct SpawnFileActions *actions, int src_fd, int fd) {
+  struct SpawnFileAction *action = append_action(actions);
+  action->type = SPAWN_ACTION_DUP2;
+  action->fd = fd;
+  action->src_fd = src_fd;
+}
+
+void add_close_action(struct SpawnFileActions *actions, int fd) {
+  struct SpawnFileAction *action = append_action(actions);
+  action->type = SPAWN_ACTION_CLOSE;
+  action->fd = fd;
+  action->src_fd = -1;
+}
+
+void set_spawn_pgroup(struct SpawnFileActions *actions, pid_t pgroup,
+                      int terminal_fd) {
+  actions->pgroup = pgroup;
+  actions->terminal_fd = terminal_fd;
+}
+
+/* Signals that are ignored by an interactive shell for job control */
+static const int job_control_signals[] = {SIGTSTP, SIGTTIN, SIGTTOU};
+
+void reset_child_signals(void) {
+  for (int i = 0; i < 3; i++) {
+    signal(job_control_signals[i], SIG_DFL);
+  }
+  sigset_t no_signals;
+  sigemptyset(&no_signals);
+  sigprocmask(SIG_SETMASK, &no_signals, NULL);
+}
+
+int apply_spawn_file_actions(const struct SpawnFileActions *actions) {
+  if (actions->pgroup != -1) {
+    if (setpgid(0, actions->pgroup) == -1) {
+      return -1;
+    }
+    /* SIGTTOU is still ignored here, so this does not stop the child */
+    if (actions->terminal_fd != -1) {
+      tcsetpgrp(actions->terminal_fd, getpgrp());
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    signal(job_control_signals[i], SIG_DFL);
+  }
+
+  for (int i = 0; i < actions->len; i++) {
+    const struct SpawnFileAction *action = &actions->actions[i];
+    switch (action->type) {
+      case SPAWN_ACTION_DUP2:
+        if (action->src_fd == action->fd) {
+          /* dup2 is a no-op here, but the fd must survive execve */
+          if (fcntl(action->fd, F_SETFD, 0) == -1) {
+            return -1;
+          }
+        } else if (dup2(action->src_fd, action->fd) == -1) {
+          return -1;
+        }
+        break;
+      case SPAWN_ACTION_CLOSE:
+        close(action->fd);
+        break;
+      default:
+        break;
+    }
+  }
+  return 0;
+}
+
+static pid_t fork_exec(const char *path, char *const argv[],
+                       char *const envp[],
+                       const struct SpawnFileActions *actions) {
+  pid_t pid = fork();
+  if (pid > 0 && actions->pgroup != -1) {
+    /* Also set the group in the parent, whichever runs first wins the race */
+    setpgid(pid, actions->pgroup != 0 ? actions->pgroup : pid);
+  }
+  if (pid == 0) {
+    /* child process, which must not inherit the blocked SIGCHLD */
+    reset_child_signals();
+    if (apply_spawn_file_actions(actions) == 0) {
+      execve(path, argv, envp);
+    }
+    /* execve does not return when successful, so this will only be reached if
+     * it errors.
+     */
+    _exit(127);
+  }
+  return pid;
+}
+
+static pid_t posix_spawn_exec(const char *path, char *const argv[],
+                              char *const envp[],
+                              const struct SpawnFileActions *actions) {
+  posix_spawn_file_actions_t file_actions;
+  posix_spawn_file_actions_init(&file_actions);
+
+#if __GLIBC_PREREQ(2, 35)
+  /* glibc 2.35 and later can hand over the terminal in the child, after it
+   * has joined its process group.
+   */
+  if (actions->pgroup != -1 && actions->terminal_fd != -1) {
+    posix_spawn_file_actions_addtcsetpgrp_np(&file_actions,
+                                             actions->terminal_fd);
+  }
+#endif
+
+  for (int i = 0; i < actions->len; i++) {
+    const struct SpawnFileAction *action = &actions->actions[i];
+    switch (action->type) {
+      case SPAWN_ACTION_DUP2:
+        /* glibc clears FD_CLOEXEC if src_fd and fd are the same */
+        posix_spawn_file_actions_adddup2(&file_actions, action->src_fd,
+                                         action->fd);
+        break;
+      case SPAWN_ACTION_CLOSE:
+        posix_spawn_file_actions_addclose(&file_actions, action->fd);
+        break;
+      default:
+        break;
+    }
+  }
+
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+  sigset_t no_signals;
+  sigemptyset(&no_signals);
+  posix_spawnattr_setsigmask(&attr, &no_signals);
+  sigset_t default_signals;
+  sigemptyset(&default_signals);
+  for (int i = 0; i < 3; i++) {
+    sigaddset(&default_signals, job_control_signals[i]);
+  }
+  posix_spawnattr_setsigdefault(&attr, &default_signals);
+  if (actions->pgroup != -1) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attr, actions->pgroup);
+  }
+  posix_spawnattr_setflags(&attr, flags);
+
+  pid_t pid;
+  int res = posix_spawn(&pid, path, &file_actions, &attr, argv, envp);
+  posix_spawn_file_actions_destroy(&file_actions);
+  posix_spawnattr_destroy(&attr);
+
+  if (res != 0) {
+    errno = res;
+    return -1;
+  }
+  return pid;
+}
+
+pid_t spawn_process(SpawnBackend backend, const char *path, char *const argv[],
+                    char *const envp[],
+                    const struct SpawnFileActions *actions) {
+  switch (backend) {
+    case SPAWN_SERVER: {
+      pid_t pid = spawn_server_exec(path, argv, envp, actions);
+      if (pid != -2) {
+        return pid;
+      }
+      return posix_spawn_exec(path, argv, envp, actions);
+    }
+    case SPAWN_POSIX_SPAWN:
+      return posix_spawn_exec(path, argv, envp, actions);
+    case SPAWN_FORK:
+    default:
+      return fork_exec(path, argv, envp, actions);
+  }
+}
@@ -0,0 +1,126 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_SPAWN_H_
+#define PSH_SPAWN_H_
+
+#include <sys/types.h>
+
+/*
+ * Enum of the mechanisms psh can use to launch external commands.
+ */
+typedef enum {
+  SPAWN_FORK,        /* fork() followed by execve() in the child. */
+  SPAWN_POSIX_SPAWN, /* posix_spawn(), which glibc implements with
+                        clone(CLONE_VM | CLONE_VFORK), so the page tables of
+                        the shell are not copied. */
+  SPAWN_SERVER,      /* A small helper process started early on forks and
+                        executes the command, which remains a child of the
+                        shell (see spawn_server.h). Falls back to
+                        SPAWN_POSIX_SPAWN if the helper can not be used. */
+} SpawnBackend;
+
+/*
+ * Enum of the file descriptor operations that are performed in the child
+ * before the command is executed.
+ */
+typedef enum {
+  SPAWN_ACTION_DUP2,
+  SPAWN_ACTION_CLOSE,
+} SpawnActionType;
+
+/*
+ * Holds a single file descriptor operation.
+ */
+struct SpawnFileAction {
+  SpawnActionType type;
+  int fd;     /* File descriptor that is set up (DUP2) or closed (CLOSE). */
+  int src_fd; /* File descriptor that is duplicated onto fd (DUP2 only). */
+};
+
+/*
+ * Holds the file descriptor operations for one child, in the order in which
+ * they are applied, and the process group the child is put into. Mirrors
+ * posix_spawn_file_actions_t and posix_spawnattr_t, but can be applied by
+ * every backend.
+ */
+struct SpawnFileActions {
+  int max_len; /* Number of actions allocated. */
+  int len;     /* Number of actions stored. */
+  struct SpawnFileAction *actions;
+  pid_t pgroup;    /* Process group the child joins, 0 for a new group led by
+                      the child and -1 to stay in the group of the shell. */
+  int terminal_fd; /* Terminal whose foreground process group is set to that
+                      of the child, or -1. */
+};
+
+/*
+ * Initializes an empty list of file actions.
+ */
+void init_spawn_file_actions(struct SpawnFileActions *actions);
+
+/*
+ * Frees the memory held by the list of file actions.
+ */
+void free_spawn_file_actions(struct SpawnFileActions *actions);
+
+/*
+ * Appends an action that duplicates src_fd onto fd in the child.
+ */
+void add_dup2_action(struct SpawnFileActions *actions, int src_fd, int fd);
+
+/*
+ * Appends an action that closes fd in the child.
+ */
+void add_close_action(struct SpawnFileActions *actions, int fd);
+
+/*
+ * Puts the child into process group pgroup, see SpawnFileActions.pgroup. If
+ * terminal_fd is not -1, the group also becomes the foreground process group
+ * of that terminal. The signals used for job control, which an interactive
+ * shell ignores, are reset to their default in the child either way.
+ */
+void set_spawn_pgroup(struct SpawnFileActions *actions, pid_t pgroup,
+                      int terminal_fd);
+
+/*
+ * Applies the file actions to the calling process. Used in forked children.
+ * Returns 0 on success and -1 if one of the operations failed.
+ */
+int apply_spawn_file_actions(const struct SpawnFileActions *actions);
+
+/*
+ * Resets the signals used for job control to their default and unblocks all
+ * signals in a forked child of the shell.
+ */
+void reset_child_signals(void);
+
+/*
+ * Launches the executable at path with the given argv and envp after applying
+ * the file actions in the child, using the given backend. The command starts
+ * with no signals blocked, whatever the shell blocks. Returns the pid of
+ * the child, or -1 with errno set if the command could not be launched. The
+ * posix_spawn backend also reports errors of execve() this way, while the fork
+ * backend lets the child exit with status 127 instead.
+ */
+pid_t spawn_process(SpawnBackend backend, const char *path, char *const argv[],
+                    char *const envp[],
+                    const struct SpawnFileActions *actions);
+
+#endif /* PSH_SPAWN_H_ */
@@ -0,0 +1,461 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "spawn_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/* Limits of a single request. Larger requests are launched by the shell. */
+#define SPAWN_SERVER_MAX_MESSAGE (128 * 1024)
+#define SPAWN_SERVER_MAX_FDS 64
+
+/*
+ * Header of a request. It is followed by n_actions SpawnRequestActions and
+ * by the NUL terminated path, argc arguments and envc environment strings.
+ * The file descriptors the actions refer to are passed with SCM_RIGHTS, and
+ * so are the shell's working directory and standard descriptors, which the
+ * server's own were only copies of when it was started.
+ */
+struct SpawnRequest {
+  int n_actions;
+  int argc;
+  int envc;
+  pid_t pgroup;     /* See SpawnFileActions.pgroup. */
+  int terminal_fd;  /* Index of the terminal among the passed fds, or -1. */
+  int cwd;          /* Index of an O_PATH fd of the working directory. */
+  int stdio[3];     /* Indices of the shell's fds 0 to 2, or -1 if closed. */
+  mode_t umask;     /* File mode creation mask of the shell. */
+};
+
+/*
+ * Holds a file action of a request. src is the index of the source among the
+ * passed file descriptors, or -1 if the source is src_fd of the child, which
+ * an earlier action has set up, as for 2>&1 after a pipe on 1.
+ */
+struct SpawnRequestAction {
+  int type;
+  int fd;
+  int src;
+  int src_fd;
+};
+
+/*
+ * Reply to a request.
+ */
+struct SpawnReply {
+  pid_t pid; /* Pid of the child, also if execve() failed. */
+  int error; /* errno of the failed launch, or 0. */
+};
+
+/* Socket to the server and the process that started it, -1 and 0 while no
+ * server runs.
+ */
+static int server_socket = -1;
+static pid_t server_pid = 0;
+static pid_t owner_pid = 0;
+
+/* Buffer requests are assembled in, grown as needed. */
+static char *request_buffer = NULL;
+static size_t request_size = 0;
+
+/*
+ * Launches one command for a request in the server. The child is created with
+ * CLONE_PARENT, which makes it a child of the shell rather than of the
+ * server, so that the shell can wait for it as for any other child.
+ */
+static struct SpawnReply serve_request(char *message, size_t len, int *fds,
+                                       int n_fds, int sigint_ignored) {
+  struct SpawnReply reply = {.pid = -1, .error = EINVAL};
+  struct SpawnRequest *request = (struct SpawnRequest *)message;
+  if (len < sizeof *request) {
+    return reply;
+  }
+  struct SpawnRequestAction *request_actions =
+      (struct SpawnRequestAction *)(message + sizeof *request);
+  char *strings = (char *)(request_actions + request->n_actions);
+  char *end = message + len;
+
+  /* Point path, argv and envp into the message */
+  char **pointers =
+      handled_malloc(sizeof(char *) * (request->argc + request->envc + 3));
+  char *path = strings;
+  char **argv = pointers;
+  char **envp = pointers + request->argc + 1;
+  char *s = path + strlen(path) + 1;
+  for (int i = 0; i < request->argc + request->envc && s < end; i++) {
+    pointers[i < request->argc ? i : i + 1] = s;
+    s += strlen(s) + 1;
+  }
+  argv[request->argc] = NULL;
+  envp[request->envc] = NULL;
+
+  struct SpawnFileActions actions;
+  init_spawn_file_actions(&actions);
+  for (int i = 0; i < request->n_actions; i++) {
+    struct SpawnRequestAction *action = &request_actions[i];
+    if (action->type == SPAWN_ACTION_DUP2 && action->src >= 0 &&
+        action->src < n_fds) {
+      add_dup2_action(&actions, fds[action->src], action->fd);
+    } else if (action->type == SPAWN_ACTION_DUP2 && action->src == -1) {
+      add_dup2_action(&actions, action->src_fd, action->fd);
+    } else if (action->type == SPAWN_ACTION_CLOSE) {
+      add_close_action(&actions, action->fd);
+    }
+  }
+  int terminal_fd = request->terminal_fd >= 0 && request->terminal_fd < n_fds
+                        ? fds[request->terminal_fd]
+                        : -1;
+  int cwd_fd = request->cwd >= 0 && request->cwd < n_fds ? fds[request->cwd]
+                                                          : -1;
+  int stdio[3];
+  for (int i = 0; i < 3; i++) {
+    stdio[i] = request->stdio[i] >= 0 && request->stdio[i] < n_fds
+                   ? fds[request->stdio[i]]
+                   : -1;
+  }
+  set_spawn_pgroup(&actions, request->pgroup, terminal_fd);
+
+  /* The child reports a failed execve() through a pipe that is closed on a
+   * successful one.
+   */
+  int error_pipe[2];
+  if (pipe2(error_pipe, O_CLOEXEC) == -1) {
+    reply.error = errno;
+    free_spawn_file_actions(&actions);
+    free(pointers);
+    return reply;
+  }
+
+  pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+  if (pid == 0) {
+    close(error_pipe[0]);
+    signal(SIGINT, sigint_ignored ? SIG_IGN : SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+
+    /* Take over the shell's context first, the actions build on its
+     * descriptors. The passed descriptors are all above 2, see serve().
+     */
+    for (int i = 0; i < 3; i++) {
+      if (stdio[i] != -1) {
+        dup2(stdio[i], i);
+      } else {
+        close(i);
+      }
+    }
+    umask(request->umask);
+    if ((cwd_fd == -1 || fchdir(cwd_fd) == 0) &&
+        apply_spawn_file_actions(&actions) == 0) {
+      execve(path, argv, envp);
+    }
+    int error = errno;
+    ssize_t res = write(error_pipe[1], &error, sizeof error);
+    (void)res;
+    _exit(127);
+  }
+
+  close(error_pipe[1]);
+  reply.pid = pid;
+  reply.error = pid == -1 ? errno : 0;
+  if (pid != -1) {
+    int error;
+    ssize_t n;
+    while ((n = read(error_pipe[0], &error, sizeof error)) == -1 &&
+           errno == EINTR) {
+    }
+    if (n == sizeof error) {
+      reply.error = error;
+    }
+  }
+  close(error_pipe[0]);
+  free_spawn_file_actions(&actions);
+  free(pointers);
+  return reply;
+}
+
+/*
+ * Main loop of the server. Exits when the shell closes its end of the socket.
+ */
+static void serve(int sock) {
+  /* Terminal signals are meant for the shell and its commands, not for the
+   * server, which shares the shell's process group.
+   */
+  struct sigaction old_sigint;
+  sigaction(SIGINT, NULL, &old_sigint);
+  int sigint_ignored = old_sigint.sa_handler == SIG_IGN;
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  signal(SIGTSTP, SIG_IGN);
+  signal(SIGTTIN, SIG_IGN);
+  signal(SIGTTOU, SIG_IGN);
+  signal(SIGCHLD, SIG_DFL);
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+  /* Commands get the standard descriptors of the shell with each request.
+   * Keeping /dev/null at 0 to 2 makes sure that the passed descriptors are
+   * received above them.
+   */
+  int null_fd = open("/dev/null", O_RDWR);
+  for (int i = 0; null_fd != -1 && i < 3; i++) {
+    if (null_fd != i) {
+      dup2(null_fd, i);
+    }
+  }
+  if (null_fd > 2) {
+    close(null_fd);
+  }
+
+  /* Commands inherit the signal mask of the server, but not the SIGCHLD the
+   * shell may have blocked.
+   */
+  sigset_t no_signals;
+  sigemptyset(&no_signals);
+  sigprocmask(SIG_SETMASK, &no_signals, NULL);
+
+  char *message = handled_malloc(SPAWN_SERVER_MAX_MESSAGE);
+  char control[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_MAX_FDS)];
+  while (1) {
+    struct iovec iov = {.iov_base = message,
+                        .iov_len = SPAWN_SERVER_MAX_MESSAGE};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control,
+                         .msg_controllen = sizeof control};
+    ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (len == -1 && errno == EINTR) {
+      continue;
+    }
+    if (len <= 0) {
+      _exit(0);
+    }
+
+    int fds[SPAWN_SERVER_MAX_FDS];
+    int n_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n_fds);
+      }
+    }
+
+    struct SpawnReply reply =
+        serve_request(message, len, fds, n_fds, sigint_ignored);
+    for (int i = 0; i < n_fds; i++) {
+      close(fds[i]);
+    }
+    while (send(sock, &reply, sizeof reply, 0) == -1 && errno == EINTR) {
+    }
+  }
+}
+
+int start_spawn_server() {
+  if (server_socket != -1) {
+    return 0;
+  }
+
+  int sockets[2];
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1) {
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(sockets[0]);
+    close(sockets[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(sockets[0]);
+    serve(sockets[1]);
+  }
+  close(sockets[1]);
+  server_socket = sockets[0];
+  server_pid = pid;
+  owner_pid = getpid();
+  return 0;
+}
+
+void stop_spawn_server() {
+  if (server_socket == -1) {
+    return;
+  }
+  close(server_socket);
+  waitpid(server_pid, NULL, 0);
+  server_socket = -1;
+  server_pid = 0;
+}
+
+/*
+ * Appends len bytes of data at offset of the request buffer, growing it if
+ * necessary. Returns the offset after the data.
+ */
+static size_t append_request(size_t offset, const void *data, size_t len) {
+  if (offset + len > request_size) {
+    request_size = 2 * (offset + len);
+    request_buffer = handled_realloc(request_buffer, request_size);
+  }
+  memcpy(request_buffer + offset, data, len);
+  return offset + len;
+}
+
+pid_t spawn_server_exec(const char *path, char *const argv[],
+                        char *const envp[],
+                        const struct SpawnFileActions *actions) {
+  if (server_socket == -1 || getpid() != owner_pid ||
+      actions->len + 5 > SPAWN_SERVER_MAX_FDS) {
+    return -2;
+  }
+
+  /* The passed descriptors end up at arbitrary numbers above 2 in the
+   * server, where actions on higher descriptors could replace them before
+   * they are used. Such rare requests are launched by the shell.
+   */
+  for (int i = 0; i < actions->len; i++) {
+    if (actions->actions[i].fd > 2) {
+      return -2;
+    }
+  }
+
+  int argc = 0;
+  while (argv[argc] != NULL) {
+    argc++;
+  }
+  int envc = 0;
+  while (envp[envc] != NULL) {
+    envc++;
+  }
+
+  /* Collect the file descriptors to pass along with the request, starting
+   * with the context of the shell the command inherits
+   */
+  int fds[SPAWN_SERVER_MAX_FDS];
+  int n_fds = 0;
+  struct SpawnRequest request = {.n_actions = actions->len,
+                                 .argc = argc,
+                                 .envc = envc,
+                                 .pgroup = actions->pgroup,
+                                 .terminal_fd = -1,
+                                 .cwd = -1};
+  if (actions->terminal_fd != -1) {
+    request.terminal_fd = n_fds;
+    fds[n_fds++] = actions->terminal_fd;
+  }
+  int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (cwd_fd != -1) {
+    request.cwd = n_fds;
+    fds[n_fds++] = cwd_fd;
+  }
+  for (int i = 0; i < 3; i++) {
+    request.stdio[i] = -1;
+    if (fcntl(i, F_GETFD) != -1) {
+      request.stdio[i] = n_fds;
+      fds[n_fds++] = i;
+    }
+  }
+  request.umask = umask(0);
+  umask(request.umask);
+  size_t offset = append_request(0, &request, sizeof request);
+  for (int i = 0; i < actions->len; i++) {
+    struct SpawnRequestAction action = {.type = actions->actions[i].type,
+                                        .fd = actions->actions[i].fd,
+                                        .src = -1,
+                                        .src_fd = actions->actions[i].src_fd};
+    int set_up = 0;
+    for (int j = 0; j < i; j++) {
+      set_up |= actions->actions[j].fd == action.src_fd;
+    }
+    if (action.type == SPAWN_ACTION_DUP2 && !set_up) {
+      action.src = n_fds;
+      fds[n_fds++] = actions->actions[i].src_fd;
+    }
+    offset = append_request(offset, &action, sizeof action);
+  }
+  offset = append_request(offset, path, strlen(path) + 1);
+  for (int i = 0; i < argc; i++) {
+    offset = append_request(offset, argv[i], strlen(argv[i]) + 1);
+  }
+  for (int i = 0; i < envc; i++) {
+    offset = append_request(offset, envp[i], strlen(envp[i]) + 1);
+  }
+  if (offset > SPAWN_SERVER_MAX_MESSAGE) {
+    if (cwd_fd != -1) {
+      close(cwd_fd);
+    }
+    return -2;
+  }
+
+  struct iovec iov = {.iov_base = request_buffer, .iov_len = offset};
+  char control[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_MAX_FDS)];
+  memset(control, 0, sizeof control);
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  if (n_fds > 0) {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n_fds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n_fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n_fds);
+  }
+
+  ssize_t res;
+  while ((res = sendmsg(server_socket, &msg, MSG_NOSIGNAL)) == -1 &&
+         errno == EINTR) {
+  }
+  if (cwd_fd != -1) {
+    close(cwd_fd);
+  }
+  if (res == -1 && errno == EMSGSIZE) {
+    return -2;
+  }
+  struct SpawnReply reply;
+  if (res != -1) {
+    while ((res = recv(server_socket, &reply, sizeof reply, 0)) == -1 &&
+           errno == EINTR) {
+    }
+  }
+  if (res != sizeof reply) {
+    /* The server is gone, launch commands in the shell from now on */
+    close(server_socket);
+    server_socket = -1;
+    return -2;
+  }
+
+  if (reply.error != 0) {
+    /* A child whose execve() failed is a child of the shell, reap it */
+    if (reply.pid > 0) {
+      waitpid(reply.pid, NULL, 0);
+    }
+    errno = reply.error;
+    return -1;
+  }
+  return reply.pid;
+}
@@ -0,0 +1,55 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_SPAWN_SERVER_H_
+#define PSH_SPAWN_SERVER_H_
+
+#include <sys/types.h>
+
+#include "spawn.h"
+
+/*
+ * Starts the spawn server, a helper process forked from the shell that
+ * launches commands on its behalf (see SPAWN_SERVER). It should be started
+ * early, while the shell is still small, since that keeps every later fork()
+ * in the helper cheap. Commands launched through it get the working
+ * directory, umask and standard descriptors the shell has when it sends the
+ * request, not those of the helper. Does nothing if the server runs already.
+ * Returns 0 on success and -1 otherwise.
+ */
+int start_spawn_server();
+
+/*
+ * Stops the spawn server, if it runs.
+ */
+void stop_spawn_server();
+
+/*
+ * Sends a request to launch the executable at path to the spawn server, see
+ * spawn_process(). Returns the pid of the child or -1 with errno set if it
+ * could not be launched. Returns -2 if the request can not be handled by the
+ * server, e.g. because it does not run, the request is too large or the
+ * caller is a forked child of the shell, which the launched command would not
+ * be a child of.
+ */
+pid_t spawn_server_exec(const char *path, char *const argv[],
+                        char *const envp[],
+                        const struct SpawnFileActions *actions);
+
+#endif /* PSH_SPAWN_SERVER_H_ */
@@ -0,0 +1,304 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vars.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+/*
+ * Holds a single shell variable.
+ */
+struct Variable {
+  char *entry;            /* "NAME=value", as it appears in the environment. */
+  size_t name_len;        /* Length of NAME. */
+  unsigned int hash;      /* Hash of NAME. */
+  int exported;           /* Whether the variable is passed to commands. */
+  struct Variable *next;  /* Next variable in the same bucket. */
+};
+
+static struct Variable **buckets = NULL;
+static int n_buckets = 0;
+static int n_variables = 0;
+
+/* Environment handed to commands, valid while envp_stale is not set. */
+static char **envp = NULL;
+static int envp_stale = 1;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static unsigned int hash_name(const char *name, size_t len) {
+  /* 32 bit FNV-1a */
+  unsigned int hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * Doubles the number of buckets, so that chains stay short while variables
+ * are added.
+ */
+static void grow_buckets() {
+  int new_n_buckets = n_buckets == 0 ? 64 : 2 * n_buckets;
+  struct Variable **new_buckets =
+      handled_malloc(sizeof(struct Variable *) * new_n_buckets);
+  memset(new_buckets, 0, sizeof(struct Variable *) * new_n_buckets);
+  for (int i = 0; i < n_buckets; i++) {
+    struct Variable *variable = buckets[i];
+    while (variable != NULL) {
+      struct Variable *next = variable->next;
+      unsigned int bucket = variable->hash % new_n_buckets;
+      variable->next = new_buckets[bucket];
+      new_buckets[bucket] = variable;
+      variable = next;
+    }
+  }
+  free(buckets);
+  buckets = new_buckets;
+  n_buckets = new_n_buckets;
+}
+
+/*
+ * Returns the link that points to the variable named by the first len
+ * characters of name, or the NULL link at the end of its bucket if it is not
+ * set.
+ */
+static struct Variable **find_link(const char *name, size_t len,
+                                   unsigned int hash) {
+  struct Variable **link = &buckets[hash % n_buckets];
+  while (*link != NULL &&
+         ((*link)->hash != hash || (*link)->name_len != len ||
+          memcmp((*link)->entry, name, len) != 0)) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+/*
+ * Sets the variable named by the first len characters of name to value, and
+ * exports it if export is set. Returns the variable.
+ */
+static struct Variable *store(const char *name, size_t len, const char *value,
+                              int export) {
+  unsigned int hash = hash_name(name, len);
+  struct Variable *variable = *find_link(name, len, hash);
+  if (variable == NULL) {
+    if (n_variables >= n_buckets) {
+      grow_buckets();
+    }
+    variable = handled_malloc(sizeof(struct Variable));
+    variable->entry = NULL;
+    variable->name_len = len;
+    variable->hash = hash;
+    variable->exported = 0;
+    unsigned int bucket = hash % n_buckets;
+    variable->next = buckets[bucket];
+    buckets[bucket] = variable;
+    n_variables++;
+  }
+
+  /* value may point into the old entry, so build the new one first */
+  size_t value_len = strlen(value);
+  char *entry = handled_malloc(len + value_len + 2);
+  memcpy(entry, name, len);
+  entry[len] = '=';
+  memcpy(entry + len + 1, value, value_len + 1);
+  free(variable->entry);
+  variable->entry = entry;
+
+  variable->exported |= export;
+  if (variable->exported) {
+    envp_stale = 1;
+  }
+  return variable;
+}
+
+static void import_environ() {
+  extern char **environ;
+  grow_buckets();
+  for (char **env = environ; *env != NULL; env++) {
+    char *equals = strchr(*env, '=');
+    if (equals != NULL && is_variable_name(*env, equals - *env)) {
+      store(*env, equals - *env, equals + 1, 1);
+    }
+  }
+}
+
+static void init_variables() { pthread_once(&init_once, import_environ); }
+
+int is_variable_name(const char *name, size_t len) {
+  if (len == 0 || (!isalpha((unsigned char)name[0]) && name[0] != '_')) {
+    return 0;
+  }
+  for (size_t i = 1; i < len; i++) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_') {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+const char *lookup_variable(const char *name, size_t len) {
+  init_variables();
+  struct Variable *variable = *find_link(name, len, hash_name(name, len));
+  return variable != NULL ? variable->entry + len + 1 : NULL;
+}
+
+const char *get_variable(const char *name) {
+  return lookup_variable(name, strlen(name));
+}
+
+void set_variable(const char *name, const char *value) {
+  init_variables();
+  store(name, strlen(name), value, 0);
+}
+
+void export_variable(const char *name) {
+  init_variables();
+  size_t len = strlen(name);
+  struct Variable *variable = *find_link(name, len, hash_name(name, len));
+  if (variable == NULL) {
+    store(name, len, "", 1);
+  } else if (!variable->exported) {
+    variable->exported = 1;
+    envp_stale = 1;
+  }
+}
+
+void unset_variable(const char *name) {
+  init_variables();
+  size_t len = strlen(name);
+  struct Variable **link = find_link(name, len, hash_name(name, len));
+  struct Variable *variable = *link;
+  if (variable == NULL) {
+    return;
+  }
+  *link = variable->next;
+  n_variables--;
+  if (variable->exported) {
+    envp_stale = 1;
+  }
+  free(variable->entry);
+  free(variable);
+}
+
+char **variables_envp() {
+  init_variables();
+  if (!envp_stale) {
+    return envp;
+  }
+
+  envp = handled_realloc(envp, sizeof(char *) * (n_variables + 1));
+  int n = 0;
+  for (int i = 0; i < n_buckets; i++) {
+    for (struct Variable *variable = buckets[i]; variable != NULL;
+         variable = variable->next) {
+      if (variable->exported) {
+        envp[n++] = variable->entry;
+      }
+    }
+  }
+  envp[n] = NULL;
+  envp_stale = 0;
+  return envp;
+}
+
+/*
+ * Returns whether the "NAME=value" string entry assigns one of the n
+ * assignments.
+ */
+static int is_assigned(const char *entry, char **assignments, int n) {
+  size_t len = strchr(entry, '=') - entry + 1;
+  for (int i = 0; i < n; i++) {
+    if (strncmp(entry, assignments[i], len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+char **variables_envp_with(char **assignments, int n, struct Arena *arena) {
+  char **base = variables_envp();
+  int n_base = 0;
+  while (base[n_base] != NULL) {
+    n_base++;
+  }
+
+  char **with = arena_alloc(arena, sizeof(char *) * (n_base + n + 1));
+  int n_with = 0;
+  for (int i = 0; i < n_base; i++) {
+    if (!is_assigned(base[i], assignments, n)) {
+      with[n_with++] = base[i];
+    }
+  }
+  for (int i = 0; i < n; i++) {
+    /* A later assignment to the same name wins */
+    if (!is_assigned(assignments[i], assignments + i + 1, n - i - 1)) {
+      with[n_with++] = assignments[i];
+    }
+  }
+  with[n_with] = NULL;
+  return with;
+}
+
+static int compare_variables(const void *a, const void *b) {
+  const struct Variable *variable_a = *(struct Variable *const *)a;
+  const struct Variable *variable_b = *(struct Variable *const *)b;
+  size_t len = variable_a->name_len < variable_b->name_len
+                   ? variable_a->name_len
+                   : variable_b->name_len;
+  int res = memcmp(variable_a->entry, variable_b->entry, len);
+  if (res != 0) {
+    return res;
+  }
+  return variable_a->name_len < variable_b->name_len   ? -1
+         : variable_a->name_len > variable_b->name_len ? 1
+                                                       : 0;
+}
+
+void for_each_variable(void (*visit)(const char *name, size_t name_len,
+                                     const char *value, int exported,
+                                     void *arg),
+                       void *arg) {
+  init_variables();
+  struct Variable **sorted =
+      handled_malloc(sizeof(struct Variable *) * (n_variables + 1));
+  int n = 0;
+  for (int i = 0; i < n_buckets; i++) {
+    for (struct Variable *variable = buckets[i]; variable != NULL;
+         variable = variable->next) {
+      sorted[n++] = variable;
+    }
+  }
+  qsort(sorted, n, sizeof(struct Variable *), compare_variables);
+
+  for (int i = 0; i < n; i++) {
+    size_t len = sorted[i]->name_len;
+    visit(sorted[i]->entry, len, sorted[i]->entry + len + 1,
+          sorted[i]->exported, arg);
+  }
+  free(sorted);
+}
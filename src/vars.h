@@ -0,0 +1,96 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_VARS_H_
+#define PSH_VARS_H_
+
+#include <stddef.h>
+
+#include "arena.h"
+
+/*
+ * Shell variables live in a hash table that holds both exported variables,
+ * which are passed to commands in their environment, and local ones, which are
+ * only visible to the shell. The table is filled from environ the first time
+ * any of the functions below is called; after that the process environment is
+ * no longer consulted or updated.
+ */
+
+/*
+ * Returns whether the first len characters of name form a valid variable name,
+ * i.e. a letter or _ followed by letters, digits and _.
+ */
+int is_variable_name(const char *name, size_t len);
+
+/*
+ * Returns the value of the variable whose name is the first len characters of
+ * name, or NULL if it is not set. The value is owned by the table and stays
+ * valid until the variable is set or unset again.
+ */
+const char *lookup_variable(const char *name, size_t len);
+
+/*
+ * Returns the value of the variable name, or NULL if it is not set, see
+ * lookup_variable.
+ */
+const char *get_variable(const char *name);
+
+/*
+ * Sets the variable name to value. A new variable is local, an existing one
+ * keeps its export flag.
+ */
+void set_variable(const char *name, const char *value);
+
+/*
+ * Marks the variable name as exported, creating it with an empty value if it
+ * is not set.
+ */
+void export_variable(const char *name);
+
+/*
+ * Removes the variable name. Does nothing if it is not set.
+ */
+void unset_variable(const char *name);
+
+/*
+ * Returns the NULL terminated environment for commands, an array of
+ * "NAME=value" strings of all exported variables. The array is cached and only
+ * rebuilt after an exported variable changed, so it stays valid until the next
+ * call of a function in this module that changes the table.
+ */
+char **variables_envp();
+
+/*
+ * Returns the environment for a command preceded by n assignments of the form
+ * "NAME=value", i.e. variables_envp() with the assigned variables replaced or
+ * added. The array is allocated from arena.
+ */
+char **variables_envp_with(char **assignments, int n, struct Arena *arena);
+
+/*
+ * Calls visit for each variable, sorted by name, e.g. to list them with export
+ * or set. The name passed to visit is not NUL terminated, but followed by the
+ * = of the variable's entry.
+ */
+void for_each_variable(void (*visit)(const char *name, size_t name_len,
+                                     const char *value, int exported,
+                                     void *arg),
+                       void *arg);
+
+#endif /* PSH_VARS_H_ */
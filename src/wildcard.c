@@ -0,0 +1,503 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "wildcard.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+/* Size of the buffer directory entries are read into with getdents64. */
+#define DIRENT_BUFFER_SIZE (64 * 1024)
+
+/*
+ * Enum of the operations a path component of a pattern is compiled into.
+ */
+typedef enum {
+  OP_LITERAL,  /* A run of characters that must match exactly. */
+  OP_ANY,      /* ?, any single character. */
+  OP_CLASS,    /* [...], a character from a set. */
+  OP_STAR,     /* *, any number of characters. */
+} PatternOpType;
+
+/*
+ * Holds a single operation of a compiled path component.
+ */
+struct PatternOp {
+  PatternOpType type;
+  const char *literal;     /* OP_LITERAL: the characters to match. */
+  size_t len;              /* OP_LITERAL: number of characters. */
+  unsigned char set[32];   /* OP_CLASS: bit c is set if c is in the class. */
+};
+
+/*
+ * Holds one path component of a pattern, e.g. "part-?" of "/data/x?/part-?".
+ */
+struct Component {
+  char *text;               /* The component itself. */
+  int is_literal;           /* Whether text contains no glob characters. */
+  struct PatternOp *ops;    /* The compiled component, unless is_literal. */
+  int n_ops;
+  size_t min_len;           /* Length of the shortest name that can match. */
+  int leading_dot;          /* Whether the pattern starts with a literal .,
+                               so that it can match hidden names. */
+};
+
+/*
+ * Holds the paths matched so far, back to back in buffer, each NUL
+ * terminated.
+ */
+struct Matches {
+  char *buffer;
+  size_t len;
+  size_t size;
+  size_t *offsets;  /* Start of each path in buffer. */
+  int n;
+  int max;
+};
+
+/*
+ * Holds the state of expanding one pattern.
+ */
+struct Glob {
+  struct Component *components;
+  int n_components;
+  char *path;               /* The path being built, PATH_MAX bytes. */
+  char **dirent_buffers;    /* One getdents64 buffer per component, as
+                               directories of all levels are open at once. */
+  struct Matches matches;
+};
+
+static int is_glob_char(char c) { return c == '*' || c == '?' || c == '['; }
+
+/*
+ * Returns the end of the bracket expression that starts at open, i.e. a
+ * pointer to its closing ], or NULL if it is not closed.
+ */
+static const char *class_end(const char *open) {
+  const char *c = open + 1;
+  if (*c == '!' || *c == '^') {
+    c++;
+  }
+  /* A ] right after the [ or the negation is part of the set */
+  if (*c == ']') {
+    c++;
+  }
+  while (*c != '\0' && *c != ']' && *c != '/') {
+    c++;
+  }
+  return *c == ']' ? c : NULL;
+}
+
+int is_glob(const char *token) {
+  for (const char *c = token; *c != '\0'; c++) {
+    if (*c == '*' || *c == '?' || (*c == '[' && class_end(c) != NULL)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Compiles component->text into component->ops.
+ */
+static void compile_component(struct Component *component) {
+  const char *text = component->text;
+  size_t text_len = strlen(text);
+  component->ops = handled_malloc(sizeof(struct PatternOp) * (text_len + 1));
+  component->n_ops = 0;
+  component->min_len = 0;
+  component->leading_dot = text[0] == '.';
+
+  const char *c = text;
+  while (*c != '\0') {
+    struct PatternOp *op = &component->ops[component->n_ops];
+    const char *end;
+    if (*c == '*') {
+      /* Consecutive stars are the same as one */
+      if (component->n_ops == 0 || op[-1].type != OP_STAR) {
+        op->type = OP_STAR;
+        component->n_ops++;
+      }
+      c++;
+      continue;
+    } else if (*c == '?') {
+      op->type = OP_ANY;
+      c++;
+    } else if (*c == '[' && (end = class_end(c)) != NULL) {
+      op->type = OP_CLASS;
+      memset(op->set, 0, sizeof op->set);
+      const char *member = c + 1;
+      int negate = *member == '!' || *member == '^';
+      if (negate) {
+        member++;
+      }
+      /* The first character is a member even if it is a ] */
+      do {
+        unsigned char first = *member, last = first;
+        if (member[1] == '-' && member + 2 < end) {
+          last = member[2];
+          member += 2;
+        }
+        for (unsigned int ch = first; ch <= last; ch++) {
+          op->set[ch / 8] |= 1 << (ch % 8);
+        }
+        member++;
+      } while (member < end);
+      if (negate) {
+        for (size_t i = 0; i < sizeof op->set; i++) {
+          op->set[i] = ~op->set[i];
+        }
+      }
+      c = end + 1;
+    } else {
+      /* A run of characters up to the next glob character */
+      const char *run = c++;
+      while (*c != '\0' && !(is_glob_char(*c) &&
+                             (*c != '[' || class_end(c) != NULL))) {
+        c++;
+      }
+      op->type = OP_LITERAL;
+      op->literal = run;
+      op->len = c - run;
+      component->min_len += op->len;
+      component->n_ops++;
+      continue;
+    }
+    component->min_len++;
+    component->n_ops++;
+  }
+}
+
+/*
+ * Returns whether name, which is len characters long, matches the compiled
+ * component. A star that is followed by a literal run jumps to the next
+ * occurrence of the run with memmem instead of trying each position.
+ */
+static int match_component(const struct Component *component,
+                           const char *name, size_t len) {
+  if (len < component->min_len) {
+    return 0;
+  }
+  if (name[0] == '.' && !component->leading_dot) {
+    return 0;
+  }
+
+  /* Reject most names on a literal suffix like .c of *.c right away */
+  const struct PatternOp *ops = component->ops;
+  int n_ops = component->n_ops;
+  const struct PatternOp *last = &ops[n_ops - 1];
+  if (last->type == OP_LITERAL &&
+      memcmp(name + len - last->len, last->literal, last->len) != 0) {
+    return 0;
+  }
+
+  size_t i = 0;
+  int op = 0;
+  int star_op = -1;
+  size_t star_pos = 0;
+  while (1) {
+    if (op == n_ops) {
+      if (i == len) {
+        return 1;
+      }
+    } else if (ops[op].type == OP_STAR) {
+      star_op = op++;
+      if (op == n_ops) {
+        return 1;
+      }
+      if (ops[op].type == OP_LITERAL) {
+        const char *found =
+            memmem(name + i, len - i, ops[op].literal, ops[op].len);
+        if (found == NULL) {
+          return 0;
+        }
+        i = found - name;
+      }
+      star_pos = i;
+      continue;
+    } else if (i < len) {
+      const struct PatternOp *current = &ops[op];
+      unsigned char ch = name[i];
+      if (current->type == OP_LITERAL) {
+        if (len - i >= current->len &&
+            memcmp(name + i, current->literal, current->len) == 0) {
+          i += current->len;
+          op++;
+          continue;
+        }
+      } else if (current->type == OP_ANY ||
+                 (current->set[ch / 8] & (1 << (ch % 8)))) {
+        i++;
+        op++;
+        continue;
+      }
+    }
+
+    /* Mismatch, let the last star take one more character */
+    if (star_op < 0 || star_pos >= len) {
+      return 0;
+    }
+    i = star_pos + 1;
+    op = star_op;
+  }
+}
+
+static void add_match(struct Matches *matches, const char *path, size_t len) {
+  if (matches->n == matches->max) {
+    matches->max = matches->max == 0 ? 64 : 2 * matches->max;
+    matches->offsets =
+        handled_realloc(matches->offsets, sizeof(size_t) * matches->max);
+  }
+  if (matches->len + len + 1 > matches->size) {
+    matches->size = matches->size == 0 ? 4096 : 2 * matches->size;
+    while (matches->len + len + 1 > matches->size) {
+      matches->size *= 2;
+    }
+    matches->buffer = handled_realloc(matches->buffer, matches->size);
+  }
+  matches->offsets[matches->n++] = matches->len;
+  memcpy(matches->buffer + matches->len, path, len + 1);
+  matches->len += len + 1;
+}
+
+/*
+ * Appends name to the path of length path_len, separated by a / unless the
+ * path is empty or the root. Returns the new length, or 0 if it does not fit.
+ */
+static size_t join_path(char *path, size_t path_len, const char *name,
+                        size_t name_len) {
+  size_t slash = path_len > 0 && path[path_len - 1] != '/';
+  if (path_len + slash + name_len + 1 > PATH_MAX) {
+    return 0;
+  }
+  if (slash) {
+    path[path_len] = '/';
+  }
+  memcpy(path + path_len + slash, name, name_len + 1);
+  return path_len + slash + name_len;
+}
+
+/*
+ * Matches the components from level on against the directory path, which is
+ * path_len characters long, and adds the matching paths to glob->matches.
+ */
+static void glob_level(struct Glob *glob, int level, size_t path_len) {
+  struct Component *component = &glob->components[level];
+  int last = level == glob->n_components - 1;
+
+  if (component->is_literal) {
+    size_t len = join_path(glob->path, path_len, component->text,
+                           strlen(component->text));
+    if (len == 0 && component->text[0] != '\0') {
+      return;
+    }
+    if (len == 0) {
+      len = path_len;
+    }
+    if (!last) {
+      glob_level(glob, level + 1, len);
+      return;
+    }
+    /* The last component has to exist, e.g. foo in * /foo */
+    struct stat st;
+    if (fstatat(AT_FDCWD, glob->path, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      add_match(&glob->matches, glob->path, len);
+    }
+    return;
+  }
+
+  int fd = open(path_len > 0 ? glob->path : ".",
+                O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return;
+  }
+  if (glob->dirent_buffers[level] == NULL) {
+    glob->dirent_buffers[level] = handled_malloc(DIRENT_BUFFER_SIZE);
+  }
+  char *buffer = glob->dirent_buffers[level];
+
+  ssize_t n_read;
+  while ((n_read = getdents64(fd, buffer, DIRENT_BUFFER_SIZE)) > 0) {
+    for (ssize_t offset = 0; offset < n_read;) {
+      struct dirent64 *entry = (struct dirent64 *)(buffer + offset);
+      offset += entry->d_reclen;
+
+      const char *name = entry->d_name;
+      if (name[0] == '.' &&
+          (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+        continue;
+      }
+      size_t name_len = strlen(name);
+      if (!match_component(component, name, name_len)) {
+        continue;
+      }
+
+      size_t len = join_path(glob->path, path_len, name, name_len);
+      if (len == 0) {
+        continue;
+      }
+      if (last) {
+        add_match(&glob->matches, glob->path, len);
+        continue;
+      }
+
+      /* Only directories lead to further matches. Symbolic links and file
+       * systems that do not fill in d_type need a stat to tell.
+       */
+      int is_dir = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+        struct stat st;
+        is_dir = stat(glob->path, &st) == 0 && S_ISDIR(st.st_mode);
+      }
+      if (is_dir) {
+        glob_level(glob, level + 1, len);
+      }
+    }
+  }
+  close(fd);
+  glob->path[path_len] = '\0';
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Expands pattern and stores the sorted matches in *matches. Returns the
+ * number of matches.
+ */
+static int glob_pattern(const char *pattern, struct Arena *arena,
+                        char ***matches) {
+  struct Glob glob = {0};
+  char *copy = strdup(pattern);
+
+  /* Split the pattern into its components. A trailing / leaves an empty
+   * last component, which restricts the matches to directories.
+   */
+  int max_components = 1;
+  for (const char *c = pattern; *c != '\0'; c++) {
+    max_components += *c == '/';
+  }
+  glob.components = handled_malloc(sizeof(struct Component) * max_components);
+  glob.dirent_buffers = handled_malloc(sizeof(char *) * max_components);
+  glob.path = handled_malloc(PATH_MAX);
+  size_t path_len = 0;
+
+  char *rest = copy;
+  if (*rest == '/') {
+    /* Absolute pattern, start at the root */
+    strcpy(glob.path, "/");
+    path_len = 1;
+    rest++;
+  }
+  glob.path[path_len] = '\0';
+  char *text;
+  while ((text = strsep(&rest, "/")) != NULL) {
+    /* Empty components from // in the middle of the pattern are skipped */
+    if (text[0] == '\0' && rest != NULL) {
+      continue;
+    }
+    struct Component *component = &glob.components[glob.n_components++];
+    component->text = text;
+    component->is_literal = !is_glob(text);
+    component->ops = NULL;
+    if (!component->is_literal) {
+      compile_component(component);
+    }
+    glob.dirent_buffers[glob.n_components - 1] = NULL;
+  }
+
+  if (glob.n_components > 0) {
+    glob_level(&glob, 0, path_len);
+  }
+
+  /* Copy the paths into the arena at once and sort them */
+  int n = glob.matches.n;
+  if (n > 0) {
+    char *paths = arena_alloc(arena, glob.matches.len);
+    memcpy(paths, glob.matches.buffer, glob.matches.len);
+    *matches = arena_alloc(arena, sizeof(char *) * n);
+    for (int i = 0; i < n; i++) {
+      (*matches)[i] = paths + glob.matches.offsets[i];
+    }
+    qsort(*matches, n, sizeof(char *), compare_paths);
+  }
+
+  for (int i = 0; i < glob.n_components; i++) {
+    free(glob.components[i].ops);
+    free(glob.dirent_buffers[i]);
+  }
+  free(glob.components);
+  free(glob.dirent_buffers);
+  free(glob.path);
+  free(glob.matches.buffer);
+  free(glob.matches.offsets);
+  free(copy);
+  return n;
+}
+
+void expand_globs(struct Command *command, struct Arena *arena) {
+  int first = 0;
+  while (first < command->len &&
+         ((command->quoted != NULL && command->quoted[first]) ||
+          !is_glob(command->tokens[first]))) {
+    first++;
+  }
+  if (first == command->len) {
+    return;
+  }
+
+  /* Collect the new tokens, then copy them into the arena */
+  int max_tokens = command->len + 16;
+  char **tokens = handled_malloc(sizeof(char *) * max_tokens);
+  memcpy(tokens, command->tokens, sizeof(char *) * first);
+  int n_tokens = first;
+  for (int i = first; i < command->len; i++) {
+    char *token = command->tokens[i];
+    char **matches = NULL;
+    int n_matches = 0;
+    if ((command->quoted == NULL || !command->quoted[i]) && is_glob(token)) {
+      n_matches = glob_pattern(token, arena, &matches);
+    }
+    if (n_matches == 0) {
+      matches = &command->tokens[i];
+      n_matches = 1;
+    }
+    if (n_tokens + n_matches > max_tokens) {
+      max_tokens = 2 * (n_tokens + n_matches);
+      tokens = handled_realloc(tokens, sizeof(char *) * max_tokens);
+    }
+    memcpy(tokens + n_tokens, matches, sizeof(char *) * n_matches);
+    n_tokens += n_matches;
+  }
+
+  command->tokens = arena_alloc(arena, sizeof(char *) * (n_tokens + 1));
+  memcpy(command->tokens, tokens, sizeof(char *) * n_tokens);
+  command->tokens[n_tokens] = NULL;
+  command->len = n_tokens;
+  command->quoted = NULL;
+  free(tokens);
+}
@@ -0,0 +1,48 @@
+/*
+ * picoshell - a rudimentary interactive shell
+ *
+ * Copyright (C) 2022 Christoph Meyer
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PSH_WILDCARD_H_
+#define PSH_WILDCARD_H_
+
+#include "arena.h"
+#include "parser.h"
+
+/*
+ * Replaces each token of command that contains a *, ? or [...] outside of
+ * double quotes by the paths that match it, sorted by strcmp. A pattern that
+ * matches nothing is kept as it is. * and ? do not match a leading . of a
+ * name, and a pattern ending with / only matches directories.
+ *
+ * Each path component of a pattern is compiled once into a sequence of
+ * literal runs, single characters, character classes and stars, which is then
+ * run against the names of a directory. Directories are read with getdents64
+ * in large batches, and the type from the directory entry spares a stat
+ * unless the file system does not report it or the entry is a symbolic link.
+ * The matches of a pattern are copied into arena with a single allocation.
+ *
+ * The new tokens are allocated from arena; command->quoted is NULL afterwards.
+ */
+void expand_globs(struct Command *command, struct Arena *arena);
+
+/*
+ * Returns whether token has to be expanded by expand_globs().
+ */
+int is_glob(const char *token);
+
+#endif /* PSH_WILDCARD_H_ */